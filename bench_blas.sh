@@ -0,0 +1,34 @@
+#!/bin/bash
+# Compares the time of the scores of precision.txt and meanrank.txt (one matrix product
+# per block of sampled users) and of the item neighbors (one per tile of items) with the
+# plain loops and with CBLAS.
+# Usage: ./bench_blas.sh <dir> <n> <m> <k> <uc> <ic> [more hgaprec options]
+# Builds hgaprec with make BLAS=none, with the CBLAS of GSL, and with make BLAS=openblas
+# (set BLASES to the builds to compare, e.g. BLASES="none gsl blis"), with make clean
+# before each, so the last build is the one left in place.
+
+dir=$1; n=$2; m=$3; k=$4; uc=$5; ic=$6
+shift 6
+prefix=n$n-m$m-k$k-uc$uc-ic$ic
+
+for blas in ${BLASES:-none gsl openblas}; do
+  opt=""
+  if [ $blas != gsl ]; then
+    opt="BLAS=$blas"
+  fi
+  make clean > /dev/null 2>&1
+  if ! make $opt > /dev/null 2>&1; then
+    echo "$blas: build failed"
+    continue
+  fi
+  out=$(mktemp -d)
+  rm -f $prefix/infer.log
+  ./hgaprec -dir $dir -outdir $out -n $n -m $m -k $k -uc $uc -ic $ic -itemsim 10 "$@" > $out/stdout.txt 2>&1
+  awk -v blas=$blas '
+    /: precision [0-9.]+ secs/ { for (i = 1; i <= NF; ++i) if ($i == "precision") { t += $(i+1); nt++ } }
+    /computed item neighbors in/ { for (i = 1; i <= NF; ++i) if ($i == "in") s = $(i+1) }
+    END {
+      printf "%-9s scores %3d times, mean %.4f secs  item neighbors %.4f secs\n", blas, nt, nt ? t / nt : 0, s
+    }' $prefix/infer.log
+  rm -rf $out
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Compares the time and the cache misses of the user sweep of vb_hier with the users and
+# items in the order of train.tsv, by degree, and by reverse Cuthill-McKee.
+# Usage: ./bench_reorder.sh <dir> <n> <m> <k> <uc> <ic> [more hgaprec options]
+# The cache misses are only reported where perf events are available (see -counters).
+
+dir=$1; n=$2; m=$3; k=$4; uc=$5; ic=$6
+shift 6
+prefix=n$n-m$m-k$k-uc$uc-ic$ic
+
+for order in none degree rcm; do
+  out=$(mktemp -d)
+  opt=""
+  if [ $order != none ]; then
+    opt="-reorder $order"
+  fi
+  rm -f $prefix/infer.log
+  ./hgaprec -dir $dir -outdir $out -n $n -m $m -k $k -uc $uc -ic $ic -counters $opt "$@" > $out/stdout.txt 2>&1
+  gap=$(grep "median gap" $out/stdout.txt | sed 's/.*items of a user //')
+  awk -v order=$order -v gap="$gap" '
+    /user sweep [0-9.]+, / { for (i = 1; i <= NF; ++i) if ($i == "sweep") { t += $(i+1); nt++ } }
+    /user sweep LLC/ { gsub(",", ""); for (i = 1; i <= NF; ++i) if ($i == "misses") { ms += $(i+1); nm++ } }
+    END {
+      printf "%-7s iterations %4d  mean user sweep %.4f secs", order, nt, nt ? t / nt : 0
+      if (nm) printf "  mean LLC misses %.0f", ms / nm
+      if (gap != "") printf "  item gap %s", gap
+      printf "\n"
+    }' $prefix/infer.log
+  rm -rf $out
+done
@@ -0,0 +1,69 @@
+#ifndef BLAS_HH
+#define BLAS_HH
+
+// Wrappers of the CBLAS routines used by the dense reductions and the scoring. By
+// default they call the CBLAS of GSL (-lgslcblas); make BLAS=openblas or BLAS=blis
+// (-DUSE_CBLAS_H) links that library instead, and make BLAS=none (-DNO_CBLAS) keeps the
+// plain loops. Only double vectors go through CBLAS; the float parameters of make
+// FLOAT=1 use the loops.
+
+#include <stdint.h>
+#ifndef NO_CBLAS
+#define HAVE_CBLAS
+#ifdef USE_CBLAS_H
+#include <cblas.h>
+#else
+#include <gsl/gsl_cblas.h>
+#endif
+#endif
+
+// Adds a times the n-vector x to y
+template<class T> inline void
+blas_axpy(uint32_t n, double a, const T *x, double *y)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    y[i] += a * x[i];
+}
+
+// Returns the dot product of the n-vectors a and b
+template<class T> inline double
+blas_dot(uint32_t n, const double *a, const T *b)
+{
+  double s = .0;
+  for (uint32_t i = 0; i < n; ++i)
+    s += a[i] * b[i];
+  return s;
+}
+
+#ifdef HAVE_CBLAS
+template<> inline void
+blas_axpy<double>(uint32_t n, double a, const double *x, double *y)
+{
+  cblas_daxpy(n, a, x, 1, y, 1);
+}
+
+template<> inline double
+blas_dot<double>(uint32_t n, const double *a, const double *b)
+{
+  return cblas_ddot(n, a, 1, b, 1);
+}
+
+// Computes c = a b' for a (m x k), b (n x k), and c (m x n), all stored by rows in one block
+inline void
+blas_gemm_nt(uint32_t m, uint32_t n, uint32_t k, const double *a, const double *b, double *c)
+{
+  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, m, n, k,
+              1.0, a, k, b, k, 0.0, c, n);
+}
+#else
+// Computes c = a b' for a (m x k), b (n x k), and c (m x n), all stored by rows in one block
+inline void
+blas_gemm_nt(uint32_t m, uint32_t n, uint32_t k, const double *a, const double *b, double *c)
+{
+  for (uint32_t i = 0; i < m; ++i)
+    for (uint32_t j = 0; j < n; ++j)
+      c[(size_t)i * n + j] = blas_dot(k, a + (size_t)i * k, b + (size_t)j * k);
+}
+#endif
+
+#endif
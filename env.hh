@@ -22,6 +22,14 @@ typedef uint16_t yval_t;
 
 typedef D2Array<yval_t> AdjMatrix;
 typedef D2Array<double> Matrix;
+
+// Element type of the parameter matrices (GPMatrix): float with -DPARAM_FLOAT, to halve their memory
+#ifdef PARAM_FLOAT
+typedef float param_t;
+#else
+typedef double param_t;
+#endif
+typedef D2Array<param_t> ParamMatrix;
 typedef D3Array<double> D3;
 typedef D2Array<KV> MatrixKV;
 typedef D1Array<KV> KVArray;
@@ -137,10 +145,46 @@ public:
   
   bool fitpriors;
   
+  uint32_t nthreads;  // Threads used for batch fold-in and scoring
+  string foldin_dir;  // Directory with the users to fold in, empty if none
+  string coldstart_dir; // Directory with the new items to score, empty if none
+  uint32_t itemsim_k; // Neighbors per item in the item similarity table, 0 if none
+  bool simcosine;     // Item similarity is cosine instead of inner product
+  bool simrho;        // Item similarity also uses E[rho]
+  string score_file;  // File with (user id, item id) pairs to score, empty if none
+  bool score_binary;  // Pair scores are written as floats instead of tsv
+  string sessions_file; // File with (user id, session id) pairs to rank the available items for, empty if none
+  uint32_t topn_table; // Items per user in the materialized top-N table, 0 if none
+  uint32_t export_topn; // Items per user in the full ranking export, 0 if none
+  bool twopass;       // The sweep updates item-side shapes in a second pass over items instead of with per-thread buffers
+  bool tiled;         // The sweep visits the ratings in cache-sized tiles of users and items
+  bool counters;      // Logs the cache references and misses of the user sweep
+  int reorder;        // Order of users and items after loading (DEGREE or RCM), 0 to keep the order of train.tsv
+  bool pin;           // Pins the threads of the sweeps to CPUs
+  bool numa;          // Pins the threads and places the parameters on the NUMA node of the thread that updates them
+  bool lowmem;        // Trains with factored rates, in-place shapes, and no stored expected values
+  bool packed;        // The sweep reads the expected logs from one packed row per user and per item
+  uint32_t phitop;    // Truncated phi keeps at most this many components, 0 for all
+  double phimass;     // Truncated phi drops at most this mass, 0 for none
+  string phiref;      // validation.txt of a run with exact phi, to log the gap in validation likelihood of truncated phi
+  double activeset;   // Users and items whose expected values change less than this are frozen, 0 for none
+  uint32_t reactivate; // Frozen users and items are swept again every this many iterations
+  bool squarem;       // Extrapolates the parameters every third iteration (SQUAREM)
+  string warmstart_dir; // Directory of a previous model to start from, empty if none
+  string newratings;  // Ratings added since the previous model, whose users and items are affected
+  uint32_t localsweeps; // Iterations after a warm start that only update the affected users and items
+  string stream_file; // File or FIFO of ratings to train on as they arrive, empty if none
+  uint32_t staleness; // Streamed ratings after which the parameters of their items are updated
+  double snapshot;    // Seconds between snapshots of the streamed model, 0 for one at the end
+  double stream_idle; // Seconds without new ratings after which a streamed file ends, 0 for never
+  
   static const int ONES = 1;
   static const int MEAN = 2;
   static const int STD = 3;
   
+  static const int DEGREE = 1;
+  static const int RCM = 2;
+  
   template<class T> static void plog(string s, const T &v);
   static string file_str(string fname);
   static string outfile_str(string fname);
@@ -239,6 +283,7 @@ uc(UC),
 ic(IC),
 t(2),
 mini_batch_size(1000),
+offset(pOffset),
 a(Na), ap(Nap), bp(Nbp), c(Nc), cp(Ncp), dp(Ndp), e(Ne), f(Nf),
 tau0(0),
 tau1(0),
@@ -248,21 +293,54 @@ reportfreq(rfreq),
 epsilon(0.001),
 logepsilon(log(epsilon)),
 nolambda(true),
+logl(false),
 max_iterations(max_iterations),
 seed(rseed),
 save_state_now(false),
 datfname(Nfname),
 outfname(Noutfname),
+model_load(false),
 online_iterations(1),
 meanchangethresh(0.001),
 mode(TRAINING),
-offset(pOffset),
+binary_data(false),
+bias(false),
+rating_threshold(1),
+graphchi(false),
+mle_item(false),
+mle_user(false),
+canny(false),
+ctr(false),
 scale(nScale),
 scaleFactor(nScaleFactor),
 lfirst(nLfirst),
 ofirst(nOfirst),
 session(nSession),
-fitpriors(nFitpriors)
+fitpriors(nFitpriors),
+nthreads(1),
+itemsim_k(0),
+simcosine(false),
+simrho(false),
+score_binary(false),
+topn_table(0),
+export_topn(0),
+twopass(false),
+tiled(false),
+counters(false),
+reorder(0),
+pin(false),
+numa(false),
+lowmem(false),
+packed(false),
+phitop(0),
+phimass(0),
+activeset(0),
+reactivate(10),
+squarem(false),
+localsweeps(0),
+staleness(1000),
+snapshot(0),
+stream_idle(0)
 {
   ostringstream sa;
   sa << "n" << n << "-";
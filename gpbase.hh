@@ -11,8 +11,51 @@
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
 #include "env.hh"
+#include "parallel.hh"
+#include "blas.hh"
 using namespace std;
 
+// Reads a file written by save_state(), with a row per line (its index, its id, and ncols values), and calls set(i, values) for each row whose id is in id2seq, with i its index there. Returns the number of rows set. Exits if the file cannot be read or a row has another number of values.
+template<class F> inline uint32_t
+load_rows_by_id(string fname, const IDMap &id2seq, uint32_t ncols, F set)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    printf("error: cannot open %s\n", fname.c_str());
+    exit(-1);
+  }
+  vector<double> v(ncols);
+  uint32_t rows = 0;
+  char *line = NULL;
+  size_t sz = 0;
+  while (getline(&line, &sz, f) > 0) {
+    char *p = line, *q = NULL;
+    strtoull(p, &q, 10);
+    uint64_t id = strtoull(q, &p, 10);
+    if (p == q)
+      continue;
+    uint32_t k = 0;
+    for (double d = strtod(p, &q); q != p; d = strtod(p, &q)) {
+      if (k < ncols)
+        v[k] = d;
+      k++;
+      p = q;
+    }
+    if (k != ncols) {
+      printf("error: a row of %s has %d values instead of %d\n", fname.c_str(), k, ncols);
+      exit(-1);
+    }
+    IDMap::const_iterator it = id2seq.find(id);
+    if (it != id2seq.end()) {
+      set(it->second, v.data());
+      rows++;
+    }
+  }
+  free(line);
+  fclose(f);
+  return rows;
+}
+
 template <class T>
 class GPBase {
 public:
@@ -67,26 +110,32 @@ GPBase<T>::compute_elbo_term() const
 // Matrix of gamma random variables
 // prior refers to the hyperparameters
 // curr is the current value, next the next value
-class GPMatrix : public GPBase<Matrix> {
+template<class T>
+class GPMatrixT : public GPBase<D2Array<T> > {
 public:
   // Constructor with constant parameters
-  GPMatrix(string name, double a, double b,
+  GPMatrixT(string name, double a, double b,
 	   uint32_t n, uint32_t k,
-	   gsl_rng **r): 
-    GPBase<Matrix>(name),
+	   gsl_rng **r, bool lowmem = false): 
+    GPBase<D2Array<T> >(name),
     _n(n), _k(k),
+    _r(r),
     _sprior(a), // shape 
     _rprior(k,b), // rate
     _hier(false),
     _hier_rprior(n),
     _hier_log_rprior(n),
     _scurr(n,k),
-    _snext(n,k),
-    _rnext(n,k),
-    _rcurr(n,k),
-    _Ev(n,k),
+    _snext(lowmem ? 0 : n,k),
+    _rcurr(lowmem ? 0 : n,k),
+    _rnext(lowmem ? 0 : n,k),
+    _Ev(lowmem ? 0 : n,k),
     _Elogv(n,k),
-    _r(r) {
+    _nthreads(1),
+    _lowmem(lowmem),
+    _racurr(n), _ranext(n),
+    _rscurr(k, 1.0), _rsnext(k, 1.0),
+    _rccurr(k), _rcnext(k) {
 //      cout << "here" << endl;
 //      double** mat = _scurr.data();
 //      cout << k << " " << n << endl;
@@ -95,23 +144,28 @@ public:
     }
   
   //Constructor with an array of rate parameters
-  GPMatrix(string name, double a, double b, Array & rateScale,
+  GPMatrixT(string name, double a, double b, Array & rateScale,
            uint32_t n, uint32_t k,
-           gsl_rng **r):
-  GPBase<Matrix>(name),
+           gsl_rng **r, bool lowmem = false):
+  GPBase<D2Array<T> >(name),
   _n(n), _k(k),
+  _r(r),
   _sprior(a), // shape
   _rprior(rateScale.size()), // rate
   _hier(false),
   _hier_rprior(n),
   _hier_log_rprior(n),
   _scurr(n,k),
-  _snext(n,k),
-  _rnext(n,k),
-  _rcurr(n,k),
-  _Ev(n,k),
+  _snext(lowmem ? 0 : n,k),
+  _rcurr(lowmem ? 0 : n,k),
+  _rnext(lowmem ? 0 : n,k),
+  _Ev(lowmem ? 0 : n,k),
   _Elogv(n,k),
-  _r(r) {
+  _nthreads(1),
+  _lowmem(lowmem),
+  _racurr(n), _ranext(n),
+  _rscurr(k, 1.0), _rsnext(k, 1.0),
+  _rccurr(k), _rcnext(k) {
     _rprior.copy_from(rateScale);
     _rprior.scale(b);
     
@@ -122,10 +176,10 @@ public:
   }
   
 //  //Constructor with an array of rate parameters and a variable for popularity/activity
-//  GPMatrix(string name, double a, double b, Array & rateScale, double popAct,
+//  GPMatrixT(string name, double a, double b, Array & rateScale, double popAct,
 //           uint32_t n, uint32_t k,
 //           gsl_rng **r):
-//  GPBase<Matrix>(name),
+//  GPBase<D2Array<T> >(name),
 //  _n(n), _k(k),
 //  _sprior(a), // shape
 //  _rprior(rateScale.size()), // rate
@@ -149,29 +203,51 @@ public:
 //    
 //  }
   
-  virtual ~GPMatrix() { }
+  virtual ~GPMatrixT() { }
 
   uint32_t n() const { return _n;}
   uint32_t k() const { return _k;}
+  
+  // Sets the number of threads for the updates that work row by row
+  void set_nthreads(uint32_t nthreads) { _nthreads = nthreads; }
+
+  // In low-memory mode (lowmem in the constructor) the rates are kept as a per-row
+  // scalar times a k-vector plus a shared k-vector, the next shape is accumulated in
+  // place of the current one (after begin_shape_next()), and the expected values are
+  // computed from the shape and the rate when needed. Rate updates that differ by row
+  // are then not available, and neither are the matrices of rates and expected values.
+  bool lowmem() const { return _lowmem; }
+  void begin_shape_next();
+  uint64_t bytes(bool lowmem) const;
+
+  // Returns the expected value of row i, column k
+  double expected(uint32_t i, uint32_t k) const
+  {
+    if (!_lowmem)
+      return _Ev.const_data()[i][k];
+    double a = .0, b = .0;
+    this->make_nonzero(_scurr.const_data()[i][k], rate_curr_at(i, k), a, b);
+    return a / b;
+  }
 
   void save() const;
   void load();
 
-  const Matrix &shape_curr() const         { return _scurr; }
-  const Matrix &rate_curr() const          { return _rcurr; }
-  const Matrix &shape_next() const         { return _snext; }
-  const Matrix &rate_next() const          { return _rnext; }
-  const Matrix &expected_v() const         { return _Ev;    }
-  const Matrix &expected_logv() const      { return _Elogv; }
+  const D2Array<T> &shape_curr() const         { return _scurr; }
+  const D2Array<T> &rate_curr() const          { return _rcurr; }
+  const D2Array<T> &shape_next() const         { return _lowmem ? _scurr : _snext; }
+  const D2Array<T> &rate_next() const          { return _rnext; }
+  const D2Array<T> &expected_v() const         { return _Ev;    }
+  const D2Array<T> &expected_logv() const      { return _Elogv; }
   
   void expected_means(Array & means) const;
   
-  Matrix &shape_curr()       { return _scurr; }
-  Matrix &rate_curr()        { return _rcurr; }
-  Matrix &shape_next()       { return _snext; }
-  Matrix &rate_next()        { return _rnext; }
-  Matrix &expected_v()       { return _Ev;    }
-  Matrix &expected_logv()    { return _Elogv; }
+  D2Array<T> &shape_curr()       { return _scurr; }
+  D2Array<T> &rate_curr()        { return _rcurr; }
+  D2Array<T> &shape_next()       { return _lowmem ? _scurr : _snext; }
+  D2Array<T> &rate_next()        { return _rnext; }
+  D2Array<T> &expected_v()       { return _Ev;    }
+  D2Array<T> &expected_logv()    { return _Elogv; }
 
   const double sprior() const { return _sprior; }
   const Array rprior() const { return _rprior; }
@@ -192,6 +268,9 @@ public:
   void update_rate_next(uint32_t n, const Array &u);
 
   void swap();
+  void swap_and_update(Array *rowsum, Array *colsum, const Array *weights = NULL,
+                       const vector<char> *keep = NULL, Array *change = NULL);
+  void move_rows(uint32_t begin, uint32_t end);
   void compute_expectations();
   void sum_rows(Array &v); 
   void sum_available_rows(Array &avbl,Array &v);
@@ -204,6 +283,9 @@ public:
   void initialize_exp(double offset);
   void initialize_exp(double v, double offset);
   void save_state(const IDMap &m, string filename) const;
+  void load_state(string dir);
+  void load_state(string dir, const IDMap &id2seq, vector<char> &found);
+  void set_row(uint32_t i, const Array &shape, const Array &rate);
   void load_from_lda(string dir, double alpha, uint32_t K);
   void set_prior_rate(const Array &ev, const Array &elogv);
   void set_prior_rate_scaled(const Array &ev, const Array &elogv, Array &scale);
@@ -213,6 +295,19 @@ public:
   double compute_elbo_term_helper() const;
 
 private:
+  // Current rate of row i, column k
+  double rate_curr_at(uint32_t i, uint32_t k) const
+  { return _lowmem ? _racurr[i] * _rscurr[k] + _rccurr[k] : _rcurr.const_data()[i][k]; }
+  void lowmem_fail(const char *f) const
+  { printf("%s: %s is not available in low-memory mode\n", this->name().c_str(), f); exit(-1); }
+  template<class F> void save_rows(string name, const IDMap &m, F value) const;
+
+  // Adds scale times u to a row, and sets every row of m to u
+  template<class R> void add_row(R *row, const Array &u, double scale = 1.0) const
+  { for (uint32_t k = 0; k < _k; ++k) row[k] += scale * u[k]; }
+  void set_rows(D2Array<T> &m, const Array &u) const
+  { T **d = m.data(); for (uint32_t i = 0; i < _n; ++i) for (uint32_t k = 0; k < _k; ++k) d[i][k] = u[k]; }
+
   uint32_t _n;
   uint32_t _k;	
   gsl_rng **_r;
@@ -223,49 +318,120 @@ private:
   Array _hier_rprior;
   Array _hier_log_rprior;
 
-  Matrix _scurr;      // current variational shape posterior 
-  Matrix _snext;      // to help compute gradient update
-  Matrix _rcurr;      // current variational rate posterior (global)
-  Matrix _rnext;      // help compute gradient update
-  Matrix _Ev;         // expected weights under variational
+  D2Array<T> _scurr;      // current variational shape posterior 
+  D2Array<T> _snext;      // to help compute gradient update
+  D2Array<T> _rcurr;      // current variational rate posterior (global)
+  D2Array<T> _rnext;      // help compute gradient update
+  D2Array<T> _Ev;         // expected weights under variational
 		      // distribution
-  Matrix _Elogv;      // expected log weights 
+  D2Array<T> _Elogv;      // expected log weights 
+  uint32_t _nthreads; // threads for the row by row updates
+
+  bool _lowmem;
+  Array _racurr;      // rates in low-memory mode: rate[i][k] = ra[i] * rs[k] + rc[k]
+  Array _ranext;
+  Array _rscurr;
+  Array _rsnext;
+  Array _rccurr;
+  Array _rcnext;
 };
 
-// Sets parameters of next iteration to prior values
-inline void
-GPMatrix::set_to_prior()
+// Sets the next shape at the prior. In low-memory mode the next shape is the current one, so this is called once the current shape (and so the expected values) is no longer needed; otherwise swap() has already done it.
+template<class T> inline void
+GPMatrixT<T>::begin_shape_next()
+{
+  if (_lowmem)
+    _scurr.set_elements(_sprior);
+}
+
+// Returns the bytes of the parameters with or without low-memory mode
+template<class T> inline uint64_t
+GPMatrixT<T>::bytes(bool lowmem) const
+{
+  uint64_t matrices = lowmem ? 2 : 6;
+  return matrices * _n * _k * sizeof(T) + (4 * _n + 7 * _k) * sizeof(double);
+}
+
+// Writes value(i, k) for every row in the format of D2Array<double>::save()
+template<class T> template<class F> inline void
+GPMatrixT<T>::save_rows(string name, const IDMap &m, F value) const
 {
+  FILE *tf = fopen(name.c_str(), "w");
+  if (!tf)
+    lerr("cannot open file %s\n", name.c_str());
+  assert(tf);
+  for (uint32_t i = 0; i < _n; ++i) {
+    IDMap::const_iterator idt = m.find(i);
+    uint64_t id = idt != m.end() ? idt->second : i;
+    fprintf(tf, "%d\t", i);
+    fprintf(tf, "%llu\t", id);
+    for (uint32_t k = 0; k < _k; ++k)
+      fprintf(tf, k == _k - 1 ? "%.12f\n" : "%.12f\t", value(i, k));
+  }
+  fclose(tf);
+}
+
+// Sets parameters of next iteration to prior values
+template<class T> inline void
+GPMatrixT<T>::set_to_prior()
+{
+  if (_lowmem) {
+    _ranext.zero();
+    _rsnext.set_elements(1.0);
+    _rcnext.copy_from(_rprior);
+    return;
+  }
   _snext.set_elements(_sprior);
-  _rnext.set_rows(_rprior);
+  set_rows(_rnext, _rprior);
 }
 
-inline void
-GPMatrix::set_to_prior_curr()
+template<class T> inline void
+GPMatrixT<T>::set_to_prior_curr()
 {
   _scurr.set_elements(_sprior);
-  _rcurr.set_rows(_rprior);
+  if (_lowmem) {
+    _racurr.zero();
+    _rscurr.set_elements(1.0);
+    _rccurr.copy_from(_rprior);
+    return;
+  }
+  set_rows(_rcurr, _rprior);
 }
 
 // Sets in the prior rate
-inline void
-GPMatrix::set_prior_rate(const Array &ev, const Array &elogv)
+template<class T> inline void
+GPMatrixT<T>::set_prior_rate(const Array &ev, const Array &elogv)
 {
   assert (ev.size() == _n && elogv.size() == _n);
-  for (uint32_t n = 0; n < _n; ++n) {
-    _rnext.set_row(n, ev[n]);
-    _hier_rprior[n] = ev[n];
-    _hier_log_rprior[n] = elogv[n];
+  if (_lowmem) {
+    _ranext.copy_from(ev);
+    _rsnext.set_elements(1.0);
+    _rcnext.zero();
   }
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t n = begin; n < end; ++n) {
+      if (!_lowmem)
+        _rnext.set_row(n, ev[n]);
+      _hier_rprior[n] = ev[n];
+      _hier_log_rprior[n] = elogv[n];
+    }
+  });
   _hier = true;
 }
 
 // Saves
-inline void
-GPMatrix::set_prior_rate_scaled(const Array &ev, const Array &elogv, Array &scale)
+template<class T> inline void
+GPMatrixT<T>::set_prior_rate_scaled(const Array &ev, const Array &elogv, Array &scale)
 {
   assert (ev.size() == _n && elogv.size() == _n);
   assert(scale.size() == _k);
+  if (_lowmem) {
+    _ranext.copy_from(ev);
+    _rsnext.copy_from(scale);
+    _rcnext.zero();
+    _hier = true;
+    return;
+  }
   for (uint32_t n = 0; n < _n; ++n) {
     for ( uint32_t k = 0; k < _k; ++k) {
       _rnext.set(n,k, ev[n]*scale[k]);
@@ -278,45 +444,55 @@ GPMatrix::set_prior_rate_scaled(const Array &ev, const Array &elogv, Array &scal
 }
 
 // Saves
-inline void
-GPMatrix::set_prior_rate_scaled(const Array &ev, double factor, Array &scale)
+template<class T> inline void
+GPMatrixT<T>::set_prior_rate_scaled(const Array &ev, double factor, Array &scale)
 {
   assert (ev.size() == _n);
   assert(scale.size() == _k);
-  for (uint32_t n = 0; n < _n; ++n) {
-    for ( uint32_t k = 0; k < _k; ++k) {
-      _rnext.set(n,k, factor * ev[n] * scale[k]);
-      //Not sure what the next two lines do
-      //    _hier_rprior[n] = ev[n];
-      //    _hier_log_rprior[n] = elogv[n];
-    }
+  if (_lowmem) {
+    for (uint32_t n = 0; n < _n; ++n)
+      _ranext[n] = factor * ev[n];
+    _rsnext.copy_from(scale);
+    _rcnext.zero();
+    _hier = true;
+    return;
   }
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t n = begin; n < end; ++n) {
+      for ( uint32_t k = 0; k < _k; ++k) {
+        _rnext.set(n,k, factor * ev[n] * scale[k]);
+        //Not sure what the next two lines do
+        //    _hier_rprior[n] = ev[n];
+        //    _hier_log_rprior[n] = elogv[n];
+      }
+    }
+  });
   _hier = true;
 }
 
 // Adds sphi to the nth row of this
-inline void
-GPMatrix::update_shape_next1(uint32_t n, const Array &sphi)
+template<class T> inline void
+GPMatrixT<T>::update_shape_next1(uint32_t n, const Array &sphi)
 {
-  _snext.add_slice(n, sphi);
+  add_row(shape_next().data()[n], sphi);
   //printf("snext = %s\n", _snext.s().c_str());
 }
 
-inline void
-GPMatrix::update_shape_next2(uint32_t n, const uArray &sphi)
+template<class T> inline void
+GPMatrixT<T>::update_shape_next2(uint32_t n, const uArray &sphi)
 {
-  _snext.add_slice(n, sphi);
+  shape_next().add_slice(n, sphi);
 }
 
-inline void
-GPMatrix::update_shape_next3(uint32_t n, uint32_t k, double v)
+template<class T> inline void
+GPMatrixT<T>::update_shape_next3(uint32_t n, uint32_t k, double v)
 {
-  double **snextd = _snext.data();
+  T **snextd = shape_next().data();
   snextd[n][k] += v;
 }
 
-inline void
-GPMatrix::update_shape_curr(uint32_t n, const uArray &sphi)
+template<class T> inline void
+GPMatrixT<T>::update_shape_curr(uint32_t n, const uArray &sphi)
 {
   _scurr.add_slice(n, sphi);
 }
@@ -333,148 +509,313 @@ GPMatrix::update_shape_curr(uint32_t n, const uArray &sphi)
 //}
 
 // Updates the next rate with a scaled array,
-inline void
-GPMatrix::update_rate_next(const Array &u, const Array &scale)
+template<class T> inline void
+GPMatrixT<T>::update_rate_next(const Array &u, const Array &scale)
 {
+  if (_lowmem)
+    lowmem_fail("a rate update scaled by row");
   Array t(_k);
   for (uint32_t i = 0; i < _n; ++i) {
     for (uint32_t k = 0; k < _k; ++k)
       t[k] = u[k] * scale[i];
-    _rnext.add_slice(i, t);
+    add_row(_rnext.data()[i], t);
   }
 }
 
 // Adds u to the nth row of this
-inline void
-GPMatrix::update_rate_next(uint32_t n, const Array &u)
+template<class T> inline void
+GPMatrixT<T>::update_rate_next(uint32_t n, const Array &u)
 {
-  _rnext.add_slice(n, u);
+  if (_lowmem)
+    lowmem_fail("a rate update of one row");
+  add_row(_rnext.data()[n], u);
 }
 
 // Adds u to every row of this
-inline void
-GPMatrix::update_rate_next(const Array &u)
+template<class T> inline void
+GPMatrixT<T>::update_rate_next(const Array &u)
 {
-  for (uint32_t i = 0; i < _n; ++i)
-    _rnext.add_slice(i, u);
+  if (_lowmem) {
+    add_row(_rcnext.data(), u);
+    return;
+  }
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t i = begin; i < end; ++i)
+      add_row(_rnext.data()[i], u);
+  });
 }
 
-inline void
-GPMatrix::update_rate_next(const Array &u, double scale)
+template<class T> inline void
+GPMatrixT<T>::update_rate_next(const Array &u, double scale)
 {
-  for (uint32_t i = 0; i < _n; ++i)
-    _rnext.add_slice(i, u, scale);
+  if (_lowmem) {
+    add_row(_rcnext.data(), u, scale);
+    return;
+  }
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t i = begin; i < end; ++i)
+      add_row(_rnext.data()[i], u, scale);
+  });
 }
 
-inline void
-GPMatrix::update_rate_next_all(uint32_t k, double v)
+template<class T> inline void
+GPMatrixT<T>::update_rate_next_all(uint32_t k, double v)
 {
-  double **rd = _rnext.data();
+  if (_lowmem) {
+    _rcnext[k] += v;
+    return;
+  }
+  T **rd = _rnext.data();
   for (uint32_t i = 0; i < _n; ++i)
     rd[i][k] += v;
 }
 
-inline void
-GPMatrix::update_rate_curr(const Array &u)
+template<class T> inline void
+GPMatrixT<T>::update_rate_curr(const Array &u)
 {
+  if (_lowmem) {
+    add_row(_rccurr.data(), u);
+    return;
+  }
   for (uint32_t i = 0; i < _n; ++i)
-    _rcurr.add_slice(i, u);
+    add_row(_rcurr.data()[i], u);
 }
 
 // Swaps the current and the next values for the parameters
-inline void
-GPMatrix::swap()
-{
-  _scurr.swap(_snext);
-  _rcurr.swap(_rnext);
+template<class T> inline void
+GPMatrixT<T>::swap()
+{
+  if (_lowmem) {
+    _racurr.swap(_ranext);
+    _rscurr.swap(_rsnext);
+    _rccurr.swap(_rcnext);
+  } else {
+    _scurr.swap(_snext);
+    _rcurr.swap(_rnext);
+  }
   
   // Sets the next values at the prior, so that the next step would be to add values to it in the next iteration
   set_to_prior();
 }
 
-inline void
-GPMatrix::compute_expectations()
-{
-  const double ** const ad = _scurr.const_data();
-  const double ** const bd = _rcurr.const_data();
-  double **vd1 = _Ev.data();
-  double **vd2 = _Elogv.data();
+// Swaps the current and the next values and, in one pass over the rows split among the threads, sets the next values at the prior and computes the expectations. Adds the sums over rows of the expected values to rowsum (k) and their sums over columns, weighted by weights if given, to colsum (n); either can be NULL. Rows i with keep[i] nonzero keep their current values (the rows of the others are swapped one by one), and change gets the change of the expected values of each row, relative to their sum; neither is available in low-memory mode.
+template<class T> inline void
+GPMatrixT<T>::swap_and_update(Array *rowsum, Array *colsum, const Array *weights,
+                              const vector<char> *keep, Array *change)
+{
+  assert(!rowsum || rowsum->size() == _k);
+  assert(!colsum || colsum->size() == _n);
+  assert(!weights || weights->size() == _k);
+  assert(!keep || keep->size() == _n);
+  assert(!change || change->size() == _n);
+  if ((keep || change) && _lowmem)
+    lowmem_fail("swap_and_update with kept rows");
+  if (_lowmem) {
+    _racurr.swap(_ranext);
+    _rscurr.swap(_rsnext);
+    _rccurr.swap(_rcnext);
+    set_to_prior();
+  } else if (!keep) {
+    _scurr.swap(_snext);
+    _rcurr.swap(_rnext);
+  }
+  
+  uint32_t nthreads = _nthreads < 1 ? 1 : _nthreads;
+  vector<vector<double> > partial(nthreads);
+  parallel_for(_n, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    const T ** const ad = _scurr.const_data();
+    T **vd1 = _Ev.data();
+    T **vd2 = _Elogv.data();
+    T **sn = _snext.data();
+    T **rn = _rnext.data();
+    double *ps = NULL;
+    if (rowsum) {
+      partial[t].assign(_k, .0);
+      ps = partial[t].data();
+    }
+    double a = .0, b = .0;
+    for (uint32_t i = begin; i < end; ++i) {
+      double cs = .0;
+      bool kept = keep && (*keep)[i];
+      if (keep && !kept) {
+        std::swap(_scurr.data()[i], sn[i]);
+        std::swap(_rcurr.data()[i], rn[i]);
+      }
+      double diff = .0, prev = .0;
+      for (uint32_t k = 0; k < _k; ++k) {
+        double ev;
+        if (kept) {
+          ev = vd1[i][k];
+          sn[i][k] = _sprior;
+          rn[i][k] = _rprior[k];
+        } else {
+          this->make_nonzero(ad[i][k], rate_curr_at(i, k), a, b);
+          ev = a / b;
+          if (!_lowmem) {
+            if (change) {
+              diff += fabs(ev - vd1[i][k]);
+              prev += vd1[i][k];
+            }
+            ev = vd1[i][k] = ev;
+            sn[i][k] = _sprior;
+            rn[i][k] = _rprior[k];
+          }
+          vd2[i][k] = gsl_sf_psi(a) - log(b);
+        }
+        if (ps)
+          ps[k] += ev;
+        cs += weights ? (*weights)[k] * ev : ev;
+      }
+      if (colsum)
+        (*colsum)[i] += cs;
+      if (change)
+        (*change)[i] = prev > 0 ? diff / prev : .0;
+    }
+  });
+  if (rowsum)
+    for (uint32_t t = 0; t < nthreads; ++t)
+      for (uint32_t k = 0; k < partial[t].size(); ++k)
+        (*rowsum)[k] += partial[t][k];
+}
+
+// Moves rows [begin, end) of all the parameters to memory allocated by the calling thread
+template<class T> inline void
+GPMatrixT<T>::move_rows(uint32_t begin, uint32_t end)
+{
+  _scurr.move_rows(begin, end);
+  _Elogv.move_rows(begin, end);
+  if (_lowmem)
+    return;
+  _snext.move_rows(begin, end);
+  _rcurr.move_rows(begin, end);
+  _rnext.move_rows(begin, end);
+  _Ev.move_rows(begin, end);
+}
+
+template<class T> inline void
+GPMatrixT<T>::compute_expectations()
+{
+  const T ** const ad = _scurr.const_data();
+  const T ** const bd = _rcurr.const_data();
+  T **vd1 = _Ev.data();
+  T **vd2 = _Elogv.data();
   double a = .0, b = .0;
+  if (_lowmem) {
+    for (uint32_t i = 0; i < _n; ++i)
+      for (uint32_t j = 0; j < _k; ++j) {
+        this->make_nonzero(ad[i][j], rate_curr_at(i, j), a, b);
+        vd2[i][j] = gsl_sf_psi(a) - log(b);
+      }
+    return;
+  }
   for (uint32_t i = 0; i < _scurr.m(); ++i)
     for (uint32_t j = 0; j < _rcurr.n(); ++j) {
 //      cout << ad[i][j] << " " << bd[i][j] << endl;
-      make_nonzero(ad[i][j], bd[i][j], a, b);
+      this->make_nonzero(ad[i][j], bd[i][j], a, b);
       vd1[i][j] = a / b;
       vd2[i][j] = gsl_sf_psi(a) - log(b);
     }
 }
 
-inline void
-GPMatrix::sum_rows(Array &v)
+template<class T> inline void
+GPMatrixT<T>::sum_rows(Array &v)
 {
-  const double **ev = _Ev.const_data();
+  if (!_lowmem) {
+    const T **ev = _Ev.const_data();
+    for (uint32_t i = 0; i < _n; ++i)
+      blas_axpy(_k, 1.0, ev[i], v.data());
+    return;
+  }
   for (uint32_t i = 0; i < _n; ++i)
     for (uint32_t k = 0; k < _k; ++k)
-      v[k] += ev[i][k];
+      v[k] += expected(i, k);
 }
 
 //New function: sum_available_rows
-inline void
-GPMatrix::sum_available_rows(Array &avbl, Array &v)
-{
-  const double **ev = _Ev.const_data();
+template<class T> inline void
+GPMatrixT<T>::sum_available_rows(Array &avbl, Array &v)
+{
+  if (!_lowmem) {
+    const T **ev = _Ev.const_data();
+    for (uint32_t i = 0; i < _n; ++i)
+      if (avbl[i] != .0)
+        blas_axpy(_k, avbl[i], ev[i], v.data());
+    return;
+  }
   for (uint32_t i = 0; i < _n; ++i){
     for (uint32_t k = 0; k < _k; ++k){
-      v[k] += avbl[i]*ev[i][k];
+      v[k] += avbl[i]*expected(i, k);
     }
   }
 }
 
-inline void
-GPMatrix::sum_cols(Array &v)
+template<class T> inline void
+GPMatrixT<T>::sum_cols(Array &v)
 {
   assert(v.size()==_n);
-  const double **ev = _Ev.const_data();
-  for (uint32_t i = 0; i < _n; ++i)
-    for (uint32_t k = 0; k < _k; ++k)
-      v[i] += ev[i][k];
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t i = begin; i < end; ++i)
+      for (uint32_t k = 0; k < _k; ++k)
+        v[i] += expected(i, k);
+  });
 }
 
 // Sums columns and saves them as an arry
-inline void
-GPMatrix::sum_cols_weight(const Array &weights,Array &v) {
+template<class T> inline void
+GPMatrixT<T>::sum_cols_weight(const Array &weights,Array &v) {
   assert(v.size()==_n);
   assert(weights.size()==_k);
-  const double **ev = _Ev.const_data();
-  for (uint32_t i = 0; i < _n; ++i) {
-    for (uint32_t k = 0; k < _k; ++k) {
-      v[i] += weights.get(k)*ev[i][k];
+  parallel_for(_n, _nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    if (!_lowmem) {
+      const T **ev = _Ev.const_data();
+      for (uint32_t i = begin; i < end; ++i)
+        v[i] += blas_dot(_k, weights.const_data(), ev[i]);
+      return;
     }
-  }
+    for (uint32_t i = begin; i < end; ++i) {
+      for (uint32_t k = 0; k < _k; ++k) {
+        v[i] += weights.get(k)*expected(i, k);
+      }
+    }
+  });
 }
 
-inline void
-GPMatrix::scaled_sum_rows(Array &v, const Array &scale)
+template<class T> inline void
+GPMatrixT<T>::scaled_sum_rows(Array &v, const Array &scale)
 {
   assert(scale.size() == n() && v.size() == k());
-  const double **ev = _Ev.const_data();
+  if (!_lowmem) {
+    const T **ev = _Ev.const_data();
+    for (uint32_t i = 0; i < _n; ++i)
+      blas_axpy(_k, scale[i], ev[i], v.data());
+    return;
+  }
   for (uint32_t i = 0; i < _n; ++i)
     for (uint32_t k = 0; k < _k; ++k)
-      v[k] += ev[i][k] * scale[i];
+      v[k] += expected(i, k) * scale[i];
 }
 
 // Sets the current parameters for the first iteration, at the hyperparameters plus a random shock
-inline void
-GPMatrix::initialize(double offset)
+template<class T> inline void
+GPMatrixT<T>::initialize(double offset)
 {
   // Gets the matrices of current parameters to modify them
-  double **ad = _scurr.data();
-  double **bd = _rcurr.data();
+  T **ad = _scurr.data();
+  T **bd = _rcurr.data();
   for (uint32_t i = 0; i < _n; ++i)
     for (uint32_t k = 0; k < _k; ++k)
       // Initial shape values: hyperparameter plus a small random shock
        ad[i][k] = _sprior * (1 + offset * 0.01 * gsl_ran_ugaussian(*_r));
 
+  if (_lowmem) {
+    // The initial rates are the same for all rows
+    _racurr.zero();
+    _rscurr.set_elements(1.0);
+    for (uint32_t k = 0; k < _k; ++k)
+      _rccurr[k] = _rprior[k]*(1+offset* 0.01 * gsl_ran_ugaussian(*_r));
+    set_to_prior();
+    return;
+  }
   for (uint32_t k = 0; k < _k; ++k) {
     // Initial rate values are also hyperparameters plus a small shock
     bd[0][k] = _rprior[k]*(1+offset* 0.01 * gsl_ran_ugaussian(*_r));
@@ -490,33 +831,40 @@ GPMatrix::initialize(double offset)
 }
 
 // Sets the current rate parameters for the first iteration, at the hyperparameters plus a random shock. The shape parameters are set at the prior plus argument v
-inline void
-GPMatrix::initialize2(double v, double offset)
+template<class T> inline void
+GPMatrixT<T>::initialize2(double v, double offset)
 {
   // Gets the matrices of current parameters to modify them
-  double **ad = _scurr.data();
-  double **bd = _rcurr.data();
+  T **ad = _scurr.data();
+  T **bd = _rcurr.data();
+  if (_lowmem) {
+    _racurr.zero();
+    _rscurr.set_elements(1.0);
+    for (uint32_t k = 0; k < _k; ++k)
+      _rccurr[k] = _rprior[k] + v;
+  }
   for (uint32_t i = 0; i < _n; ++i) {
     for (uint32_t k = 0; k < _k; ++k) {
       // Initial values: hyperparameter plus a small random shock
       ad[i][k] = _sprior + offset*0.01 * gsl_ran_ugaussian(*_r);
       // Prior plus argument v, which in the paper is Ka or Kc
-      bd[i][k] = _rprior[k] + v;
+      if (!_lowmem)
+        bd[i][k] = _rprior[k] + v;
     }
   }
   set_to_prior();
 }
 
 // Sets the means of user and item attributes and the log means ( used for the vector of parameters for the multinomial distribution, phi in the paper) for the first iteration, at the computed values from previous parameters plus a small shock
-inline void
-GPMatrix::initialize_exp(double offset)
+template<class T> inline void
+GPMatrixT<T>::initialize_exp(double offset)
 {
   // Gets the matrix of current parameters which should have been initialized already
-  double **ad = _scurr.data();
+  T **ad = _scurr.data();
   
   // Gets the matrices of means and log means to modify them
-  double **vd1 = _Ev.data();
-  double **vd2 = _Elogv.data();
+  T **vd1 = _Ev.data();
+  T **vd2 = _Elogv.data();
 
   // This array will hold the initial values of the rate parameters
   Array b(_k);  
@@ -526,46 +874,46 @@ GPMatrix::initialize_exp(double offset)
       b[k] = _rprior[k]*(1+offset * 0.01 * gsl_ran_ugaussian(*_r));
       assert(b[k]);
       
-      // Means: shape/rate parameter
-      vd1[i][k] = ad[i][k] / b[k];
+      // Means: shape/rate parameter (in low-memory mode they are computed from the current rate instead)
+      if (!_lowmem)
+        vd1[i][k] = ad[i][k] / b[k];
       // Log mean: From expectation of a Gamma r.v.
       vd2[i][k] = gsl_sf_psi(ad[i][k]) - log(b[k]);
     }
   set_to_prior();
 } 
 
-inline void
-GPMatrix::initialize_exp(double v, double offset)
+template<class T> inline void
+GPMatrixT<T>::initialize_exp(double v, double offset)
 {
-  double **ad = _scurr.data();
-  double **vd1 = _Ev.data();
-  double **vd2 = _Elogv.data();
+  T **ad = _scurr.data();
+  T **vd1 = _Ev.data();
+  T **vd2 = _Elogv.data();
 
   Array b(_k);  
   for (uint32_t i = 0; i < _n; ++i)
     for (uint32_t k = 0; k < _k; ++k) {
       b[k] = v + offset * 0.01 * gsl_ran_ugaussian(*_r);
       assert(b[k]);
-      vd1[i][k] = ad[i][k] / b[k];
+      if (!_lowmem)
+        vd1[i][k] = ad[i][k] / b[k];
       vd2[i][k] = gsl_sf_psi(ad[i][k]) - log(b[k]);
     }
   set_to_prior();
 } 
 
-inline double
-GPMatrix::compute_elbo_term_helper() const
+template<class T> inline double
+GPMatrixT<T>::compute_elbo_term_helper() const
 {
-  const double **etheta = _Ev.data();
-  const double **elogtheta = _Elogv.data();
-  const double ** const ad = shape_curr().const_data();
-  const double ** const bd = rate_curr().const_data();
+  const T **elogtheta = _Elogv.data();
+  const T ** const ad = shape_curr().const_data();
 
   double s = .0;
   for (uint32_t n = 0; n < _n; ++n)  {
     for (uint32_t k = 0; k < _k; ++k) {
       if (_hier) {
 	s += _sprior * _hier_log_rprior[n] + (_sprior - 1) * elogtheta[n][k];
-	s -= _hier_rprior[n] * etheta[n][k] + gsl_sf_lngamma(_sprior);
+	s -= _hier_rprior[n] * expected(n, k) + gsl_sf_lngamma(_sprior);
       } else {
 //	s += _sprior * log(_rprior) + (_sprior - 1) * elogtheta[n][k];
 //	s -= _rprior * etheta[n][k] + gsl_sf_lngamma(_sprior);
@@ -573,41 +921,116 @@ GPMatrix::compute_elbo_term_helper() const
     }
     double a = .0, b = .0;
     for (uint32_t k = 0; k < _k; ++k) {
-      make_nonzero(ad[n][k], bd[n][k], a, b);
+      this->make_nonzero(ad[n][k], rate_curr_at(n, k), a, b);
       s -= a * log(b) + (a - 1) * elogtheta[n][k];
-      s += b * etheta[n][k] + gsl_sf_lngamma(a);
+      s += b * expected(n, k) + gsl_sf_lngamma(a);
     }
   }
   return s;
 }
 
-inline void
-GPMatrix::save_state(const IDMap &m, string filename) const
+template<class T> inline void
+GPMatrixT<T>::save_state(const IDMap &m, string filename) const
 {
-  string expv_fname = string("/") + name() + ".tsv";
-  string shape_fname = string("/") + name() + "_shape.tsv";
-  string rate_fname = string("/") + name() + "_rate.tsv";
+  string expv_fname = string("/") + this->name() + ".tsv";
+  string shape_fname = string("/") + this->name() + "_shape.tsv";
+  string rate_fname = string("/") + this->name() + "_rate.tsv";
   _scurr.save(filename+"/"+Env::outfile_str(shape_fname), m);
+  if (_lowmem) {
+    save_rows(filename+"/"+Env::outfile_str(rate_fname), m,
+              [&](uint32_t i, uint32_t k) { return rate_curr_at(i, k); });
+    save_rows(filename+"/"+Env::outfile_str(expv_fname), m,
+              [&](uint32_t i, uint32_t k) { return expected(i, k); });
+    return;
+  }
   _rcurr.save(filename+"/"+Env::outfile_str(rate_fname), m);
   _Ev.save(filename+"/"+Env::outfile_str(expv_fname), m);
 }
 
-inline void
-GPMatrix::load()
+template<class T> inline void
+GPMatrixT<T>::load()
 {
-  string fname = name() + ".tsv";
+  if (_lowmem)
+    lowmem_fail("load()");
+  string fname = this->name() + ".tsv";
   _Ev.load(fname);
 }
 
-inline void
-GPMatrix::load_from_lda(string dir, double alpha, uint32_t K)
+// Loads the shape and rate parameters written by save_state() to directory dir and computes the expectations
+template<class T> inline void
+GPMatrixT<T>::load_state(string dir)
+{
+  if (_k == 0)
+    return;
+  if (_lowmem)
+    lowmem_fail("load_state()");
+  string shape_fname = dir + "/" + this->name() + "_shape.tsv";
+  string rate_fname = dir + "/" + this->name() + "_rate.tsv";
+  _scurr.load(shape_fname);
+  _rcurr.load(rate_fname);
+  compute_expectations();
+  lerr("loaded from %s and %s",
+       shape_fname.c_str(), rate_fname.c_str());
+}
+
+// Sets the current shape and rate of row i and computes its expectations
+template<class T> inline void
+GPMatrixT<T>::set_row(uint32_t i, const Array &shape, const Array &rate)
+{
+  if (_lowmem)
+    lowmem_fail("set_row()");
+  T *sd = _scurr.data()[i];
+  T *rd = _rcurr.data()[i];
+  T *vd1 = _Ev.data()[i];
+  T *vd2 = _Elogv.data()[i];
+  double a = .0, b = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    sd[k] = shape[k];
+    rd[k] = rate[k];
+    this->make_nonzero(shape[k], rate[k], a, b);
+    vd1[k] = a / b;
+    vd2[k] = gsl_sf_psi(a) - log(b);
+  }
+}
+
+// Loads the rows of a model saved with other users or items, by their ids in id2seq. Rows that are not in the model keep their values, and found tells which rows were loaded.
+template<class T> inline void
+GPMatrixT<T>::load_state(string dir, const IDMap &id2seq, vector<char> &found)
+{
+  found.assign(_n, 0);
+  if (_k == 0)
+    return;
+  if (_lowmem)
+    lowmem_fail("load_state()");
+  string shape_fname = dir + "/" + this->name() + "_shape.tsv";
+  string rate_fname = dir + "/" + this->name() + "_rate.tsv";
+  T **sd = _scurr.data();
+  T **rd = _rcurr.data();
+  uint32_t rows = load_rows_by_id(shape_fname, id2seq, _k, [&](uint32_t i, const double *v) {
+    for (uint32_t k = 0; k < _k; ++k)
+      sd[i][k] = v[k];
+    found[i] = 1;
+  });
+  load_rows_by_id(rate_fname, id2seq, _k, [&](uint32_t i, const double *v) {
+    for (uint32_t k = 0; k < _k; ++k)
+      rd[i][k] = v[k];
+  });
+  compute_expectations();
+  lerr("loaded %d of %d rows from %s and %s", rows, _n,
+       shape_fname.c_str(), rate_fname.c_str());
+}
+
+template<class T> inline void
+GPMatrixT<T>::load_from_lda(string dir, double alpha, uint32_t K)
 {
+  if (_lowmem)
+    lowmem_fail("load_from_lda()");
   char buf[1024];
-  sprintf(buf, "%s/lda-fits/%s-lda-k%d.tsv", dir.c_str(), name().c_str(), K);
+  sprintf(buf, "%s/lda-fits/%s-lda-k%d.tsv", dir.c_str(), this->name().c_str(), K);
   lerr("loading from %s", buf);
   _Ev.load(buf, 0);
-  double **vd1 = _Ev.data();
-  double **vd2 = _Elogv.data();
+  T **vd1 = _Ev.data();
+  T **vd2 = _Elogv.data();
 
   Array b(_k);  
   for (uint32_t i = 0; i < _n; ++i) {
@@ -619,19 +1042,27 @@ GPMatrix::load_from_lda(string dir, double alpha, uint32_t K)
     }
   }
   IDMap m;
-  string expv_fname = string("/") + name() + ".tsv";
+  string expv_fname = string("/") + this->name() + ".tsv";
   _Ev.save(Env::file_str(expv_fname), m);
 }
 
 // Saves the means of the expected values over users/items
-inline void
-GPMatrix::expected_means(Array & means) const {
+template<class T> inline void
+GPMatrixT<T>::expected_means(Array & means) const {
 //  cout << means.size() << endl;
 //  cout << _k << endl;
   assert(means.size()==_k);
-  _Ev.colmeans(means);
+  for (uint32_t k = 0; k < _k; ++k) {
+    double s = .0;
+    for (uint32_t i = 0; i < _n; ++i)
+      s += expected(i, k);
+    means[k] = s / _n;
+  }
 }
 
+// Parameters are stored in double, or in float when built with PARAM_FLOAT
+typedef GPMatrixT<param_t> GPMatrix;
+
 class GPMatrixGR : public GPBase<Matrix> { // global rates
 public:
   GPMatrixGR(string name, 
@@ -1041,6 +1472,9 @@ public:
   double compute_elbo_term_helper() const;
   void save_state(const IDMap &m, string filename) const;
   void load();
+  void load_state(string dir);
+  void load_state(string dir, const IDMap &id2seq, vector<char> &found);
+  void set(uint32_t i, double shape, double rate);
   
   double expected_mean() const;
 
@@ -1225,6 +1659,51 @@ GPArray::load()
   compute_expectations();
 }
 
+// Loads the shape and rate parameters written by save_state() to directory dir and computes the expectations
+inline void
+GPArray::load_state(string dir)
+{
+  string shape_fname = dir + "/" + name() + "_shape.tsv";
+  string rate_fname = dir + "/" + name() + "_rate.tsv";
+  _scurr.load(shape_fname);
+  _rcurr.load(rate_fname);
+  compute_expectations();
+  lerr("loaded from %s and %s",
+       shape_fname.c_str(), rate_fname.c_str());
+}
+
+// Sets the current shape and rate of entry i and computes its expectations
+inline void
+GPArray::set(uint32_t i, double shape, double rate)
+{
+  double a = .0, b = .0;
+  _scurr[i] = shape;
+  _rcurr[i] = rate;
+  make_nonzero(shape, rate, a, b);
+  _Ev[i] = a / b;
+  _Elogv[i] = gsl_sf_psi(a) - log(b);
+  _Einv[i] = b/(a-1);
+}
+
+// Loads the entries of a model saved with other users or items, by their ids in id2seq, as GPMatrixT::load_state() does
+inline void
+GPArray::load_state(string dir, const IDMap &id2seq, vector<char> &found)
+{
+  found.assign(_n, 0);
+  string shape_fname = dir + "/" + name() + "_shape.tsv";
+  string rate_fname = dir + "/" + name() + "_rate.tsv";
+  double *sd = _scurr.data();
+  double *rd = _rcurr.data();
+  uint32_t rows = load_rows_by_id(shape_fname, id2seq, 1, [&](uint32_t i, const double *v) {
+    sd[i] = v[0];
+    found[i] = 1;
+  });
+  load_rows_by_id(rate_fname, id2seq, 1, [&](uint32_t i, const double *v) { rd[i] = v[0]; });
+  compute_expectations();
+  lerr("loaded %d of %d rows from %s and %s", rows, _n,
+       shape_fname.c_str(), rate_fname.c_str());
+}
+
 // Saves the means of the expected values over users/items
 inline double
 GPArray::expected_mean() const {
@@ -1,7 +1,16 @@
 #include "hgaprec.hh"
 #include "env.hh"
+#include "parallel.hh"
+#include "kernels.hh"
+#include "sweep.hh"
+#include "ranktable.hh"
+#include "perfcount.hh"
+#include "numa.hh"
+#include "stream.hh"
 #include <iostream>
 #include <iomanip>
+#include <chrono>
+#include <sys/resource.h>
 
 #ifdef HAVE_NMFLIB
 #include "./nmflib/include/common.h"
@@ -23,12 +32,18 @@ _theta("theta", 0.3, 0.3, _n,_k,&_r),
 _beta("beta", 0.3, 0.3, _m,_k,&_r),
 _thetabias("thetabias", 0.3, 0.3, _n, 1, &_r),
 _betabias("betabias", 0.3, 0.3, _m, 1, &_r),
-_htheta("htheta", env.a, env.bp, _n, _k, &_r),
-_hbeta("hbeta", env.c, env.dp, _m, _k, &_r),
-_hsigma("hsigma", env.e, env.e*env.bp/(env.c*env.a), _ratings._itemObsScale , _n, _ic, &_r),
-_hrho("hrho", env.f, env.f*env.dp/(env.c*env.a), _ratings._userObsScale , _m, _uc, &_r),
+_htheta("htheta", env.a, env.bp, _n, _k, &_r, env.lowmem),
+_hbeta("hbeta", env.c, env.dp, _m, _k, &_r, env.lowmem),
+_hsigma("hsigma", env.e, env.e*env.bp/(env.c*env.a), _ratings._itemObsScale , _n, _ic, &_r, env.lowmem),
+_hrho("hrho", env.f, env.f*env.dp/(env.c*env.a), _ratings._userObsScale , _m, _uc, &_r, env.lowmem),
 _thetarate("thetarate", env.ap, env.ap/env.bp, _n, &_r),
 _betarate("betarate", env.cp, env.cp/env.dp, _m, &_r),
+_uaug(_n, _k+_ic+_uc),
+_iaug(_m, _k+_ic+_uc),
+_foldin_betarowsum(_k),
+_foldin_itemsum(_ic),
+_coldstart_base(_n),
+_coldstart_einveta(.0),
 //phi(_k+_ic+_uc),
 _theta_mle(_n, _k),
 _beta_mle(_m, _k),
@@ -52,6 +67,31 @@ _maxval(0), _minval(65536)
   if (_env.seed)
     gsl_rng_set(_r, _env.seed);
   Env::plog("infer n:", _n);
+  
+  // Work of each user and item in the sweeps: one plus one per rating, as CSR and CSC offsets
+  _user_offsets.resize(_n+1);
+  _user_offsets[0] = 0;
+  for (uint32_t n = 0; n < _n; ++n)
+    _user_offsets[n+1] = _user_offsets[n] + 1 + (_ratings.users()[n] ? _ratings.users()[n]->size() : 0);
+  _item_offsets.resize(_m+1);
+  _item_offsets[0] = 0;
+  for (uint32_t m = 0; m < _m; ++m)
+    _item_offsets[m+1] = _item_offsets[m] + 1 + (_ratings.movies()[m] ? _ratings.movies()[m]->size() : 0);
+  
+  _htheta.set_nthreads(_env.nthreads);
+  _hbeta.set_nthreads(_env.nthreads);
+  _hsigma.set_nthreads(_env.nthreads);
+  _hrho.set_nthreads(_env.nthreads);
+  if (_env.pin || _env.numa)
+    pin_threads() = true;
+  
+  // Hashed id maps used at serving time
+  _user_index.reserve(_n);
+  _item_index.reserve(_m);
+  for (IDMap::const_iterator it = _ratings.user2seq().begin(); it != _ratings.user2seq().end(); ++it)
+    _user_index[it->first] = it->second;
+  for (IDMap::const_iterator it = _ratings.movie2seq().begin(); it != _ratings.movie2seq().end(); ++it)
+    _item_index[it->first] = it->second;
 
   // Creates various output files it will use later
   
@@ -113,6 +153,8 @@ HGAPRec::~HGAPRec()
   fclose(_pf);
   fclose(_tf);
   fclose(_rf);
+  for (uint32_t j = 0; j < _elogbeta_copies.size(); ++j)
+    delete _elogbeta_copies[j];
 }
 
 void
@@ -211,7 +253,7 @@ HGAPRec::get_phi(GPBase<Matrix> &theta, uint32_t u, GPBase<Matrix> &beta, uint32
 
 // Calculates the vector of probabilites for the multinomial distribution and saves it in argument phi. Takes into account that the item and user observables have to be scaled down by popularity and activity.
 void
-HGAPRec::get_phi(GPMatrix &theta, uint32_t u, GPMatrix &beta, uint32_t i, GPMatrix &sigma, GPMatrix &rho, GPArray &xi, GPArray &eta, uint32_t ic, uint32_t uc, Array &phi)
+HGAPRec::get_phi(GPMatrix &theta, uint32_t u, GPMatrix &beta, uint32_t i, GPMatrix &sigma, GPMatrix &rho, GPArray &xi, GPArray &eta, uint32_t ic, uint32_t uc, Array &phi, const param_t **elogbeta)
 {
   // Checks that the sizes of beta, theta, and phi agree
   assert (phi.size() == theta.k()+sigma.k()+rho.k() &&
@@ -219,11 +261,12 @@ HGAPRec::get_phi(GPMatrix &theta, uint32_t u, GPMatrix &beta, uint32_t i, GPMatr
   // Checks that the position does not exceed the array dimensions
   assert (u < theta.n() && i < beta.n());
   
-  // Gets the expected log of theta, beta, sigma, and rho
-  const double  **elogtheta = theta.expected_logv().const_data();
-  const double  **elogbeta = beta.expected_logv().const_data();
-  const double  **elogsigma = sigma.expected_logv().const_data();
-  const double  **elogrho = rho.expected_logv().const_data();
+  // Gets the expected log of theta, beta (unless a copy is given), sigma, and rho
+  const param_t  **elogtheta = theta.expected_logv().const_data();
+  if (!elogbeta)
+    elogbeta = beta.expected_logv().const_data();
+  const param_t  **elogsigma = sigma.expected_logv().const_data();
+  const param_t  **elogrho = rho.expected_logv().const_data();
   const double  *elogxi = xi.expected_logv().const_data();
   const double  *elogeta = eta.expected_logv().const_data();
   
@@ -266,8 +309,8 @@ HGAPRec::get_phi(GPMatrix &theta, uint32_t u, GPMatrix &beta, uint32_t i, Array
   assert (u < theta.n() && i < beta.n());
   
   // Gets the expected log of theta, beta, sigma, and rho
-  const double  **elogtheta = theta.expected_logv().const_data();
-  const double  **elogbeta = beta.expected_logv().const_data();
+  const param_t  **elogtheta = theta.expected_logv().const_data();
+  const param_t  **elogbeta = beta.expected_logv().const_data();
   
   // Makes phi a zero vector
   phi.zero();
@@ -295,8 +338,8 @@ HGAPRec::get_phi(uint32_t u, uint32_t i, GPMatrix &sigma, GPMatrix &rho, GPArray
   assert (u < sigma.n() && i < rho.n());
   
   // Gets the expected log of theta, beta, sigma, and rho
-  const double  **elogsigma = sigma.expected_logv().const_data();
-  const double  **elogrho = rho.expected_logv().const_data();
+  const param_t  **elogsigma = sigma.expected_logv().const_data();
+  const param_t  **elogrho = rho.expected_logv().const_data();
   const double  *elogxi = xi.expected_logv().const_data();
   const double  *elogeta = eta.expected_logv().const_data();
   
@@ -324,17 +367,17 @@ HGAPRec::get_phi(uint32_t u, uint32_t i, GPMatrix &sigma, GPMatrix &rho, GPArray
   phi.lognormalize();
 }
 
-void
-HGAPRec::get_phi(GPBase<Matrix> &a, uint32_t ai, 
-		 GPBase<Matrix> &b, uint32_t bi, 
+template<class GP> void
+HGAPRec::get_phi(GP &a, uint32_t ai, 
+		 GP &b, uint32_t bi, 
 		 double biasa, double biasb,
 		 Array &phi)
 {
   assert (phi.size() == a.k() + 2 &&
 	  phi.size() == b.k() + 2);
   assert (ai < a.n() && bi < b.n());
-  const double  **eloga = a.expected_logv().const_data();
-  const double  **elogb = b.expected_logv().const_data();
+  auto eloga = a.expected_logv().const_data();
+  auto elogb = b.expected_logv().const_data();
   phi.zero();
   for (uint32_t k = 0; k < _k; ++k)
     phi[k] = eloga[ai][k] + elogb[bi][k];
@@ -1451,6 +1494,14 @@ HGAPRec::vb_hier_ori()
   }
 }
 
+// Resizes v to hold size elements from its first 64-byte aligned element, and returns that element
+template<class T> static T *
+aligned_block(vector<T> &v, uint64_t size)
+{
+  v.assign(size + 64 / sizeof(T), T());
+  return (T *)(((uintptr_t)v.data() + 63) & ~(uintptr_t)63);
+}
+
 // Main method for the hierarchical model (the one in the paper)
 void
 HGAPRec::vb_hier()
@@ -1458,6 +1509,11 @@ HGAPRec::vb_hier()
   // Initial values of the parameters, according to the posterior plus a random shock
   
   initialize();
+  // With -warmstart the parameters of a saved fit replace the initial values, and the users and items that are new or have new ratings are the ones affected
+  bool warm = _env.warmstart_dir != "";
+  vector<char> user_affected(_n, 1), item_affected(_m, 1);
+  if (warm)
+	  warm_start(_env.warmstart_dir, user_affected, item_affected);
   //  _betarate.shape_curr().print();
   //  _betarate.rate_curr().print();
   //  _thetarate.shape_curr().print();
@@ -1477,14 +1533,14 @@ HGAPRec::vb_hier()
   cout << "Initialized" << endl;
   //  cout << _env.reportfreq << endl;
   
-  // Matrices that save the evolution of the means of variables as the algorithm iterates
-  Matrix betaMeans(_k,_env.max_iterations+1);
-  Matrix thetaMeans(_k,_env.max_iterations+1);
-  Matrix sigmaMeans(_ic,_env.max_iterations+1);
-  Matrix rhoMeans(_uc,_env.max_iterations+1);
+  // Matrices that save the evolution of the means of variables as the algorithm iterates: the initial values and those after iterations 0 to max_iterations
+  Matrix betaMeans(_k,_env.max_iterations+2);
+  Matrix thetaMeans(_k,_env.max_iterations+2);
+  Matrix sigmaMeans(_ic,_env.max_iterations+2);
+  Matrix rhoMeans(_uc,_env.max_iterations+2);
   
-  Array xiMeans(_env.max_iterations+1);
-  Array etaMeans(_env.max_iterations+1);
+  Array xiMeans(_env.max_iterations+2);
+  Array etaMeans(_env.max_iterations+2);
   
   Array betaMean(_k);
   Array thetaMean(_k);
@@ -1521,12 +1577,13 @@ HGAPRec::vb_hier()
   //  _thetarate.rate_curr().print();
   
   // Runs this part of the code to run 100 iterations only with the latent variables before starting updating all other variables
-  if ( _env.lfirst ) {
+  if ( _env.lfirst && !warm ) {
     // Constructs the array for the parameters of the multinomial distribution
     Array phiLatents(_k);
     
     while (_iter < 100) {
 
+    	    build_augmented();
     	    compute_likelihood(false);
 	    if (_k > 0){
 		    // Sets the prior rate based on expectations with current parameters, i.e.,\frac{\kappa^{shp}}{\kappa^{rte}}
@@ -1607,12 +1664,13 @@ HGAPRec::vb_hier()
   }
   
   // Runs this part of the code to run 100 iterations only with the observed variables before starting updating all other variables
-  if ( _env.ofirst ) {
+  if ( _env.ofirst && !warm ) {
     // Constructs the array for the parameters of the multinomial distribution
     Array phiObserved(_uc+_ic);
     
     while (_iter < 100) {
      
+    	    build_augmented();
     	    compute_likelihood(false);
 	    if (_k > 0){
 		    // Sets the prior rate based on expectations with current parameters, i.e.,\frac{\kappa^{shp}}{\kappa^{rte}}
@@ -1716,12 +1774,227 @@ HGAPRec::vb_hier()
   // Constructs the array for the parameters of the multinomial distribution
   Array phi(x);
   
+  // Wall-clock time of each phase of an iteration, logged to infer.log
+  std::chrono::steady_clock::time_point tphase;
+  auto lap = [&tphase]() {
+	  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	  std::chrono::duration<double> secs = now - tphase;
+	  tphase = now;
+	  return secs.count();
+  };
+  
+  // Threads for the sweeps, and buffers for the shapes of beta and rho of every thread but the first (not needed with -twopass). The bias terms are only updated by one thread.
+  uint32_t nthreads = _env.bias ? 1 : (_env.nthreads < 1 ? 1 : _env.nthreads);
+  vector<vector<param_t> > betashape(nthreads), rhoshape(nthreads);
+  
+  // With -numa, places the rows of the parameters on the node of the thread that updates them
+  if (_env.numa)
+	  place_parameters(nthreads);
+  // Rows of the expected log of beta that each thread reads in the user sweep: the copy on its node, if there are copies
+  vector<const param_t **> elogbeta_rows(nthreads, (const param_t **)NULL);
+  for (uint32_t t = 0; t < nthreads && _elogbeta_copies.size() > 0; ++t)
+	  elogbeta_rows[t] = _elogbeta_copies[cpu_node(thread_cpu(t))]->const_data();
+  
+  // Each thread allocates its own buffers, so that their pages are on its node
+  if (!_env.twopass)
+	  parallel_for(nthreads, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+		  if (t > 0) {
+			  betashape[t].resize((size_t)_m*_k);
+			  rhoshape[t].resize((size_t)_m*_uc);
+		  }
+	  });
+  vector<double> user_busy, item_busy;
+  
+  // Ratings in tiles, with -tiled
+  if (_env.tiled)
+	  build_tiles();
+  memory_report(nthreads);
+  
+  // Cache counters of the user sweep, with -counters
+  PerfCounters perf;
+  PerfCounters *counters = NULL;
+  if (_env.counters) {
+	  if (perf.open(nthreads))
+		  counters = &perf;
+	  else
+		  lerr("hardware cache counters are not available");
+  }
+  
+  // Sums over items of the expected values of beta, from the update of beta in the previous iteration
+  Array betasum(_k);
+  bool have_betasum = false;
+  
+  // Kernels of the sweeps for this configuration, and the logs of the item and user characteristics that they read
+  UserKernel user_kernel;
+  ItemKernel item_kernel;
+  bool truncated = _env.phitop > 0 || _env.phimass > 0;
+  bool fixed_k = sweep_kernels(_k, _ic, _uc, _env.bias, _env.packed, truncated, user_kernel, item_kernel);
+  lerr("sweep kernels: k %s, ic %s, uc %s, bias %s, %s layout, %s phi", fixed_k ? "fixed" : "runtime",
+       _ic > 0 ? "on" : "off", _uc > 0 ? "on" : "off", _env.bias ? "on" : "off",
+       _env.packed ? "packed" : "separate", truncated ? "truncated" : "exact");
+  Matrix logitemobs(_m, _ic), loguserobs(_n, _uc);
+  for (uint32_t m = 0; m < _m; ++m)
+	  for (uint32_t l = 0; l < _ic; ++l)
+		  logitemobs.set(m, l, log(_ratings._itemObs.get(m,l)));
+  for (uint32_t n = 0; n < _n; ++n)
+	  for (uint32_t l = 0; l < _uc; ++l)
+		  loguserobs.set(n, l, log(_ratings._userObs.get(n,l)));
+  // Room for the bias terms, which read phi past the latent factors, and for a copy of phi to find the largest components of truncated phi
+  uint32_t phisize = 2 * (x > _k + 2 ? x : _k + 2);
+  // With -phimass e, the components of phi below e / x times the largest are dropped, so that the dropped mass is below e
+  double phicut = _env.phimass > 0 ? log(_env.phimass / x) : -INFINITY;
+  vector<SweepStats, CacheAlignedAllocator<SweepStats> > sweep_stats(nthreads);
+  // With -phiref, the validation likelihood of each iteration of the run with exact phi (NAN for the iterations it did not check), and the estimated ELBO gap of the last sweep
+  vector<double> phiref_h;
+  double elbogap = .0;
+  if (truncated && _env.phiref != "") {
+	  FILE *f = fopen(_env.phiref.c_str(), "r");
+	  if (!f) {
+		  printf("error: cannot open %s\n", _env.phiref.c_str());
+		  exit(-1);
+	  }
+	  int it, secs;
+	  double h;
+	  uint32_t nh;
+	  while (fscanf(f, "%d\t%d\t%lf\t%u", &it, &secs, &h, &nh) == 4)
+		  if (it >= 0) {
+			  if ((uint32_t)it >= phiref_h.size())
+				  phiref_h.resize(it + 1, NAN);
+			  phiref_h[it] = h;
+		  }
+	  fclose(f);
+	  lerr("read the validation likelihoods of %d iterations of exact phi from %s",
+	       (uint32_t)phiref_h.size(), _env.phiref.c_str());
+  }
+  
+  // With -packed, the expected logs that phi reads of each user [E log theta_u, E log sigma_u, log w_u, E log xi_u] and of each item [E log beta_i, log x_i, E log rho_i, E log eta_i] in one row of whole cache lines, so that a rating reads one row of each side. The logs of the characteristics are written once, and the rest before every sweep.
+  const uint32_t perline = 64 / sizeof(param_t);
+  uint32_t pstride = (x + 1 + perline - 1) / perline * perline;
+  vector<param_t> upacked_buf, ipacked_buf;
+  param_t *upacked = NULL, *ipacked = NULL;
+  if (_env.packed) {
+	  upacked = aligned_block(upacked_buf, (uint64_t)_n * pstride);
+	  ipacked = aligned_block(ipacked_buf, (uint64_t)_m * pstride);
+	  for (uint32_t n = 0; n < _n; ++n)
+		  for (uint32_t l = 0; l < _uc; ++l)
+			  upacked[(size_t)n * pstride + _k + _ic + l] = loguserobs.get(n, l);
+	  for (uint32_t m = 0; m < _m; ++m)
+		  for (uint32_t l = 0; l < _ic; ++l)
+			  ipacked[(size_t)m * pstride + _k + l] = logitemobs.get(m, l);
+  }
+  auto pack_rows = [&]() {
+	  const param_t **elogtheta = _htheta.expected_logv().const_data();
+	  const param_t **elogsigma = _hsigma.expected_logv().const_data();
+	  const double *elogxi = _thetarate.expected_logv().const_data();
+	  const param_t **elogbeta = _hbeta.expected_logv().const_data();
+	  const param_t **elogrho = _hrho.expected_logv().const_data();
+	  const double *elogeta = _betarate.expected_logv().const_data();
+	  parallel_for_balanced(_n, nthreads, _user_offsets.data(), [&](uint32_t begin, uint32_t end, uint32_t t) {
+		  for (uint32_t n = begin; n < end; ++n) {
+			  param_t *r = upacked + (size_t)n * pstride;
+			  for (uint32_t k = 0; k < _k; ++k)
+				  r[k] = elogtheta[n][k];
+			  for (uint32_t l = 0; l < _ic; ++l)
+				  r[_k+l] = elogsigma[n][l];
+			  r[x] = elogxi[n];
+		  }
+	  });
+	  parallel_for(_m, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+		  for (uint32_t m = begin; m < end; ++m) {
+			  param_t *r = ipacked + (size_t)m * pstride;
+			  for (uint32_t k = 0; k < _k; ++k)
+				  r[k] = elogbeta[m][k];
+			  for (uint32_t l = 0; l < _uc; ++l)
+				  r[_k+_ic+l] = elogrho[m][l];
+			  r[x] = elogeta[m];
+		  }
+	  });
+  };
+  
+  // With -activeset, each user is swept (ACTIVE), swept once more while its item-side shapes are cached (FREEZING), or skipped, with the cached shapes added to its items (FROZEN); the rows of the frozen keep their values. Items are frozen at once, since their users read nothing but their expected logs. Everything is swept again every reactivate iterations.
+  enum { ACTIVE = 0, FREEZING = 1, FROZEN = 2 };
+  bool activeset = _env.activeset > 0;
+  assert(!activeset || (!_env.bias && !_htheta.lowmem()));
+  vector<char> user_state(_n, ACTIVE), item_state(_m, ACTIVE);
+  vector<char> user_keep(_n, 0), item_keep(_m, 0);
+  Array thetachange(_n), sigmachange(_n), betachange(_m), rhochange(_m);
+  D2Array<param_t> cache_beta(activeset ? _m : 0, _k), cache_rho(activeset ? _m : 0, _uc);
+  // After a warm start, the first localsweeps iterations sweep only the affected users and items, with the others frozen; the affected items still take the item-side shapes of all their users
+  uint32_t localsweeps = warm ? _env.localsweeps : 0;
+  bool restricted = activeset || localsweeps > 0;
+  assert(!restricted || (!_env.bias && !_htheta.lowmem()));
+  auto frozen_user = [&](uint32_t n) { return restricted && user_state[n] == FROZEN; };
+  auto frozen_item = [&](uint32_t m) { return restricted && item_state[m] == FROZEN; };
+  
+  // With -squarem, every third iteration extrapolates the shapes and rates from the two steps before it, x0 to x1 to x2 (SQUAREM, with the step length of its S3 scheme), and takes its step from there. If the step is longer than the plain one (which gives x2) and the ELBO of the extrapolated parameters is below that of x1, they are replaced by x2 and the iteration is repeated. The longest step allowed grows by 4 each time it is taken, and shrinks by 4 when a step is rejected.
+  vector<double> squarem_x[3];
+  uint32_t squarem_phase = 0, squarem_accepted = 0, squarem_rejected = 0;
+  double squarem_alpha = -1, squarem_stepmax = 1, squarem_elbo = -INFINITY;
+  
   while (!stop) {
 	  setUserAvailability = false;
 	  setItemAvailability = false;
-	  // Stop if the max number of iterations is reached
+	  tphase = std::chrono::steady_clock::now();
+	  // Sums over rows (k) and over columns (per user or item) of the expected values, from the updates of each matrix
+	  Array thetarowsum(_k), thetacolsum(_n), sigmarowsum(_ic), sigmacolsum(_n);
+	  Array betarowsum_next(_k), betacolsum(_m), rhorowsum(_uc), rhocolsum(_m);
+	  double t_users = .0, t_user_params = .0, t_items = .0, t_item_params = .0, t_rates = .0;
+	  // Stop if the max number of iterations is reached, saving the model as on convergence so that the stages after training (fold-in, scoring) can run
 	  if (_iter > _env.max_iterations) {
-		  exit(0);
+		  lerr("stopping at the maximum of %d iterations", _env.max_iterations);
+		  do_on_stop();
+		  return;
+	  }
+	  
+	  bool local = _iter < localsweeps;
+	  if (localsweeps > 0 && _iter <= localsweeps) {
+		  for (uint32_t n = 0; n < _n; ++n) {
+			  user_state[n] = local && !user_affected[n] ? FROZEN : ACTIVE;
+			  user_keep[n] = user_state[n] == FROZEN;
+		  }
+		  for (uint32_t m = 0; m < _m; ++m) {
+			  item_state[m] = local && !item_affected[m] ? FROZEN : ACTIVE;
+			  item_keep[m] = item_state[m] == FROZEN;
+		  }
+		  if (activeset) {
+			  cache_beta.zero();
+			  cache_rho.zero();
+		  }
+	  }
+	  bool squarem = _env.squarem && !local;
+	  
+	  if (squarem) {
+		  vb_state(squarem_x[squarem_phase], false);
+		  if (squarem_phase == 2) {
+			  // The step length is |r| / |v|, for r = x1 - x0 and v = x2 - 2 x1 + x0, and the extrapolation is x0 - 2 alpha r + alpha^2 v for alpha = -|r| / |v|, which is x2 for alpha = -1; alpha is halved toward -1 until all the shapes and rates are positive
+			  const vector<double> &x0 = squarem_x[0], &x1 = squarem_x[1], &x2 = squarem_x[2];
+			  double rr = .0, vv = .0;
+			  for (uint64_t p = 0; p < x0.size(); ++p) {
+				  double r = x1[p] - x0[p], v = x2[p] - 2 * x1[p] + x0[p];
+				  rr += r * r;
+				  vv += v * v;
+			  }
+			  double alpha = vv > 0 ? -sqrt(rr / vv) : -1;
+			  if (alpha > -1)
+				  alpha = -1;
+			  if (alpha < -squarem_stepmax)
+				  alpha = -squarem_stepmax;
+			  auto extrapolated = [&](uint64_t p, double alpha) {
+				  double r = x1[p] - x0[p], v = x2[p] - 2 * x1[p] + x0[p];
+				  return x0[p] - 2 * alpha * r + alpha * alpha * v;
+			  };
+			  for (uint64_t p = 0; alpha < -1 && p < x0.size(); ++p)
+				  while (alpha < -1 && extrapolated(p, alpha) <= 0)
+					  alpha = (alpha - 1) / 2;
+			  // x0 is not needed any more, and x2 is kept to fall back to
+			  vector<double> &xa = squarem_x[0];
+			  for (uint64_t p = 0; p < xa.size(); ++p)
+				  xa[p] = extrapolated(p, alpha);
+			  vb_state(xa, true);
+			  have_betasum = false;
+			  squarem_alpha = alpha;
+			  lerr("iteration %d: squarem step %.3f (longest %.0f)", _iter, -alpha, squarem_stepmax);
+		  }
 	  }
 	  
 	  if (_k > 0){
@@ -1740,125 +2013,284 @@ HGAPRec::vb_hier()
 		  debug("adding %s to theta rate", _thetarate.expected_v().s().c_str());
 		  debug("betarowsum %s", betarowsum.s().c_str());
 	  }
-	  // Loop over users
-	  for (uint32_t n = 0; n < _n; ++n) {
-		  // Gets the matrix of items for each user and stores it in movies
-		  const vector<uint32_t> *movies = _ratings.get_movies(n);
-		  setUserAvailability = false;
-		  // For each user, all available items are stored in the availability_user array
-		  for (uint32_t item = 0; item < _m; ++item){
-			  if(!_env.session){
-				  availability_user[item] = 1;
-			  }else{
-				  availability_user[item] = _ratings.getAvailability(n,item);
-			  }
-		  }    
-		  // Loop over each user's items
-		  for (uint32_t j = 0; movies && j < movies->size(); ++j) {
-			  //        cout << "Loop over items " << j <<endl;
-			  // Gets the code of the movie
-			  uint32_t m = (*movies)[j];
-
-			  // Get the movie rating
-			  yval_t y = _ratings.r(n,m);
-
-			  // Finds phi from the current parameters of hbeta, htheta, hsigma, and hrho (the equation in step 1 of the algorithm in the paper)
-			  get_phi(_htheta, n, _hbeta, m, _hsigma, _hrho, _thetarate, _betarate, _ic, _uc, phi);
-
-			  //        cout << phi.sum(0) << endl;
-			  //        if (_iter < 2) {
-			  //          cout << "Phi: " << endl;
-			  //          phi.print();
-			  //        }
-
-			  //        _phi.set_row( r, phi);
-
-			  // Makes phi sum up to y to get y_{ui} phi_{uik}
-			  if (y > 1) {
-				  phi.scale(y);
+	  // Loop over users. The users are split in chunks of about the same number of ratings that threads take and steal from each other. Each thread writes the rows of its users in theta and sigma; thread 0 adds the item-side shapes to beta and rho, and the other threads to their own buffers, which are added at the end. With -twopass, the item-side shapes are left to a second pass over items.
+	  Array betarowsum(_k);
+	  if (_k > 0 && !_env.session) {
+		  // Without sessions every item is available to every user, so the sums over items are the same for all users
+		  if (have_betasum)
+			  betarowsum.copy_from(betasum);
+		  else
+			  _hbeta.sum_rows(betarowsum);
+		  // With -lowmem the rate of theta keeps this sum once for all the rows
+		  if (_htheta.lowmem())
+			  _htheta.update_rate_next(betarowsum);
+	  }
+	  // With -lowmem the next shapes are accumulated in place of the current ones, which are no longer read
+	  _htheta.begin_shape_next();
+	  _hsigma.begin_shape_next();
+	  _hbeta.begin_shape_next();
+	  _hrho.begin_shape_next();
+	  for (uint32_t t = 1; t < nthreads; ++t) {
+		  std::fill(betashape[t].begin(), betashape[t].end(), .0);
+		  std::fill(rhoshape[t].begin(), rhoshape[t].end(), .0);
+	  }
+	  param_t **thetashape = _htheta.shape_next().data();
+	  param_t **sigmashape = _hsigma.shape_next().data();
+	  param_t **bshape = _hbeta.shape_next().data();
+	  param_t **rshape = _hrho.shape_next().data();
+	  if (_elogbeta_copies.size() > 0)
+		  copy_elogbeta();
+	  if (_env.packed)
+		  pack_rows();
+	  if (activeset) {
+		  // Adds the cached item-side shapes of the frozen users to the items that are still updated
+		  const param_t **cb = cache_beta.const_data();
+		  const param_t **cr = cache_rho.const_data();
+		  for (uint32_t m = 0; m < _m; ++m) {
+			  if (item_state[m] == FROZEN)
+				  continue;
+			  for (uint32_t k = 0; k < _k; ++k)
+				  bshape[m][k] += cb[m][k];
+			  for (uint32_t l = 0; l < _uc; ++l)
+				  rshape[m][l] += cr[m][l];
+		  }
+	  }
+	  
+	  // Parameters read and written by the kernels in this iteration. Threads without a copy of the expected log of beta on their node read beta itself.
+	  vector<const param_t **> elogbeta_t(nthreads);
+	  for (uint32_t t = 0; t < nthreads; ++t)
+		  elogbeta_t[t] = elogbeta_rows[t] ? elogbeta_rows[t] : _hbeta.expected_logv().const_data();
+	  SweepArgs sa;
+	  sa.k = _k;
+	  sa.ic = _ic;
+	  sa.uc = _uc;
+	  sa.elogtheta = _htheta.expected_logv().const_data();
+	  sa.elogbeta = elogbeta_t.data();
+	  sa.elogsigma = _hsigma.expected_logv().const_data();
+	  sa.elogrho = _hrho.expected_logv().const_data();
+	  sa.elogxi = _thetarate.expected_logv().const_data();
+	  sa.elogeta = _betarate.expected_logv().const_data();
+	  sa.logitemobs = logitemobs.const_data();
+	  sa.loguserobs = loguserobs.const_data();
+	  sa.thetashape = thetashape;
+	  sa.sigmashape = sigmashape;
+	  sa.betashape = bshape;
+	  sa.rhoshape = rshape;
+	  sa.thetabiasshape = _env.bias ? _thetabias.shape_next().data() : NULL;
+	  sa.betabiasshape = _env.bias ? _betabias.shape_next().data() : NULL;
+	  sa.tbetashape = &betashape;
+	  sa.trhoshape = &rhoshape;
+	  sa.upacked = upacked;
+	  sa.ipacked = ipacked;
+	  sa.stride = pstride;
+	  sa.phitop = _env.phitop;
+	  sa.phicut = phicut;
+	  memset(sweep_stats.data(), 0, nthreads * sizeof(SweepStats));
+	  sa.stats = sweep_stats.data();
+	  sa.twopass = _env.twopass;
+	  
+	  // Adds the contribution of rating y of user n for item m, computed by thread t. Finds phi from the current parameters of hbeta, htheta, hsigma, and hrho (the equation in step 1 of the algorithm in the paper), scaled by y, and adds its parts for latent variables, user observables, and item observables to the next shape parameters of theta, beta, sigma, and rho (the first equation in steps 2 and 3).
+	  auto add_rating = [&](uint32_t n, uint32_t m, yval_t y, uint32_t t, phi_t *phi) {
+		  user_kernel(sa, n, m, y, t, phi);
+	  };
+	  
+	  //----------------------------------
+	  // Updates for user parameters
+	  //----------------------------------
+	  auto update_user_rate = [&](uint32_t n, Array &availability, Array &rowsum) {
+		  // If there are latent characteristics...
+		  if (_k > 0 && _env.session) {
+			  // For each user, all available items are stored in the availability array
+			  for (uint32_t item = 0; item < _m; ++item)
+				  availability[item] = _ratings.getAvailability(n,item);
+			  // Saves the sums over items of expected values for each factor ( the second part of \gamma^{rte}_{uk})
+			  rowsum.zero();
+			  _hbeta.sum_available_rows(availability,rowsum);
+			  // Adds the previous sum to \frac{\kappa^{shp}}{\kappa^{shp}} in the next rate
+			  _htheta.update_rate_next(n,rowsum);
+		  } else if (_k > 0 && !_htheta.lowmem()) {
+			  _htheta.update_rate_next(n,betarowsum);
+		  }
+	  };
+	  
+	  if (counters)
+		  counters->start();
+	  if (!_env.tiled) {
+		  parallel_for_balanced(_n, nthreads, _user_offsets.data(), [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  vector<phi_t> phi(phisize);
+			  Array availability(_m);
+			  Array rowsum(_k);
+			  for (uint32_t n = begin; n < end; ++n) {
+				  if (frozen_user(n))
+					  continue;
+				  // Gets the matrix of items for each user and stores it in movies
+				  const vector<uint32_t> *movies = _ratings.users()[n];
+				  // Loop over each user's items
+				  for (uint32_t j = 0; movies && j < movies->size(); ++j) {
+					  // Gets the code of the movie
+					  uint32_t m = (*movies)[j];
+					  add_rating(n, m, _ratings.r(n,m), t, phi.data());
+				  }
+				  update_user_rate(n, availability, rowsum);
 			  }
-
-
-			  //        if (_iter == 0 && n == 0 && j == 1)
-			  //        cout << n << " " << j << endl;
-			  //          phi.print();
-
-			  //        cout << phi.sum(0) << endl;
-			  //        phi.print();
-
-			  // Defines the subarrays of phi for latent variables, user observables, and item observables and updates the next shape parameter of theta and beta (gamma and kappa) by adding y_{ui} phi_{uik} to the nth row of gamma and the mth row of kappa (the first equation in steps 2 and 3 of the algorithm in the paper)
-			  Array phik(_k);
-			  Array phil(_ic);
-			  Array phim(_uc);
-			  // For each item, all users for which this item was available are stored in the availability_item array
-/*			  if(n == 100){
-				  for (uint32_t user = 0; user < _n; ++user){
-					  if(!_env.session){
-						  availability_item[user] = 1;
-					  }else{
-						  availability_item[user] = _ratings.getAvailability(user,m);
+		  }, &user_busy);
+	  } else {
+		  // Tiled order: each chunk is a block of users, and its ratings are sorted by item block, so the rows of a tile stay in cache. The rows of the ratings a few steps ahead are prefetched.
+		  const uint32_t ahead = 8;
+		  const param_t **elogtheta = _htheta.expected_logv().const_data();
+		  const param_t **elogbeta = _hbeta.expected_logv().const_data();
+		  const param_t **elogrho = _hrho.expected_logv().const_data();
+		  uint32_t nblocks = _tile_offsets.size() - 1;
+		  parallel_for_balanced(nblocks, nthreads, _tile_offsets.data(), [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  vector<phi_t> phi(phisize);
+			  Array availability(_m);
+			  Array rowsum(_k);
+			  for (uint32_t b = begin; b < end; ++b) {
+				  uint64_t last = _tile_offsets[b+1];
+				  for (uint64_t r = _tile_offsets[b]; r < last; ++r) {
+					  if (r + ahead < last) {
+						  const TiledRating &p = _tiled[r+ahead];
+						  if (_env.packed) {
+							  __builtin_prefetch(upacked + (size_t)p.n * pstride);
+							  __builtin_prefetch(ipacked + (size_t)p.m * pstride);
+						  } else {
+							  __builtin_prefetch(elogtheta[p.n]);
+							  __builtin_prefetch(elogbeta[p.m]);
+							  __builtin_prefetch(elogrho[p.m]);
+						  }
+						  __builtin_prefetch(bshape[p.m], 1);
 					  }
+					  const TiledRating &tr = _tiled[r];
+					  if (!frozen_user(tr.n))
+						  add_rating(tr.n, tr.m, tr.y, t, phi.data());
 				  }
-			  }*/
-
-			  if (_k>0) {
-				  phik.copy_from(phi.subarray(0,_k-1));
-				  _htheta.update_shape_next1(n, phik);
-				  _hbeta.update_shape_next1(m, phik);  
-			  }
-
-			  if (_ic > 0) {
-				  phil.copy_from(phi.subarray(_k,_k+_ic-1));
-				  _hsigma.update_shape_next1(n, phil);
-			  }
-
-			  if ( _uc > 0) {
-				  phim.copy_from(phi.subarray(_k+_ic,_k+_ic+_uc-1));
-				  _hrho.update_shape_next1(m, phim);
+				  uint32_t nlast = (b + 1) * _tile_users < _n ? (b + 1) * _tile_users : _n;
+				  for (uint32_t n = b * _tile_users; n < nlast; ++n)
+					  if (!frozen_user(n))
+						  update_user_rate(n, availability, rowsum);
 			  }
-
-			  if (_env.bias) {
-				  _thetabias.update_shape_next3(n, 0, phi[_k]);
-				  _betabias.update_shape_next3(m, 0, phi[_k+1]);
+		  }, &user_busy);
+	  }
+	  
+	  if (_env.twopass) {
+		  // Loop over items, with the users of each item from the column index of the ratings, to add the item-side shapes to beta and rho. phi is computed again, with the same parameters as in the loop over users, and every row of beta and rho is written only by the thread that owns its item.
+		  parallel_for_balanced(_m, nthreads, _item_offsets.data(), [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  vector<phi_t> phi(phisize);
+			  for (uint32_t m = begin; m < end; ++m) {
+				  if (frozen_item(m))
+					  continue;
+				  const vector<uint32_t> *users = _ratings.movies()[m];
+				  for (uint32_t j = 0; users && j < users->size(); ++j) {
+					  uint32_t n = (*users)[j];
+					  if (frozen_user(n) && !local)
+						  continue;
+					  item_kernel(sa, n, m, _ratings.r(n,m), phi.data());
+				  }
 			  }
-			  
-/*			  if(_k > 0){
-				  //----------------------------------
-				  // Updates for item parameters
-				  //----------------------------------
-
-				  // If there are latent variables...
-  				  Array thetarowsum(_k);
-				  if(setItemAvailability == false){
-					  // Saves the sums of expected values over users for each factor (the second part of \lambda^{rte}_{ik})
-					  _htheta.sum_available_rows(availability_item,thetarowsum);
+		  }, &item_busy);
+	  } else if (nthreads > 1) {
+		  // Adds the item-side shapes of the other threads
+		  parallel_for(_m, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  param_t **bshape = _hbeta.shape_next().data();
+			  param_t **rshape = _hrho.shape_next().data();
+			  for (uint32_t m = begin; m < end; ++m)
+				  for (uint32_t u = 1; u < nthreads; ++u) {
+					  for (uint32_t k = 0; k < _k; ++k)
+						  bshape[m][k] += betashape[u][(size_t)m*_k+k];
+					  for (uint32_t l = 0; l < _uc; ++l)
+						  rshape[m][l] += rhoshape[u][(size_t)m*_uc+l];
+				  }
+		  });
+	  } // End of loop over users/movies
+	  if (local && !_env.twopass) {
+		  // Adds the item-side shapes of the frozen users to the affected items, which the loop over users left out
+		  parallel_for_balanced(_m, nthreads, _item_offsets.data(), [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  vector<phi_t> phi(phisize);
+			  for (uint32_t m = begin; m < end; ++m) {
+				  if (frozen_item(m))
+					  continue;
+				  const vector<uint32_t> *users = _ratings.movies()[m];
+				  for (uint32_t j = 0; users && j < users->size(); ++j) {
+					  uint32_t n = (*users)[j];
+					  if (frozen_user(n))
+						  item_kernel(sa, n, m, _ratings.r(n,m), phi.data());
 				  }
-				  // Adds the previous sum to \frac{\tau^{shp}}{\tau^{shp}} in the next rate
-			  	  cout << "ThetaRowMean " << thetarowsum.mean() << " item = " << m << endl;
-				  _hbeta.update_rate_next(m,thetarowsum);
-			  }*/
-		  }//End of Loop over movies
-
-		  //----------------------------------
-		  // Updates for user parameters
-		  //----------------------------------
-
-		  // If there are latent characteristics...
-
-		  if (_k > 0) {
-			  Array betarowsum(_k);
-			  if(setUserAvailability == false){ // Saves the sums over items of expected values for each factor ( the second part of \gamma^{rte}_{uk})
-				  _hbeta.sum_available_rows(availability_user,betarowsum);
-
-				  setUserAvailability = true;//So that the availability_user Array is only set once
 			  }
-			  // Adds the previous sum (betarowsum) to \frac{\kappa^{shp}}{\kappa^{shp}} in the next rate
-			  if(n == 0){
-//			  	cout << "BetaRowMean " << betarowsum.mean() << endl;
+		  }, &item_busy);
+	  }
+	  if (activeset) {
+		  // Caches the item-side shapes of the users that are freezing, from the same parameters as the sweep
+		  SweepArgs ca = sa;
+		  ca.betashape = cache_beta.data();
+		  ca.rhoshape = cache_rho.data();
+		  vector<phi_t> phi(phisize);
+		  for (uint32_t n = 0; n < _n; ++n) {
+			  if (user_state[n] != FREEZING)
+				  continue;
+			  const vector<uint32_t> *movies = _ratings.users()[n];
+			  for (uint32_t j = 0; movies && j < movies->size(); ++j) {
+				  uint32_t m = (*movies)[j];
+				  item_kernel(ca, n, m, _ratings.r(n,m), phi.data());
 			  }
-			  _htheta.update_rate_next(n,betarowsum);
-		  }	
-	  } // End of loop over users/movies
+		  }
+	  }
+	  if (counters)
+		  counters->stop();
+	  t_users += lap();
+	  if (truncated) {
+		  // Components kept and mass dropped by truncated phi, against exact phi on a sample of the ratings
+		  SweepStats all;
+		  memset(&all, 0, sizeof(all));
+		  for (uint32_t t = 0; t < nthreads; ++t) {
+			  all.ratings += sweep_stats[t].ratings;
+			  all.kept += sweep_stats[t].kept;
+			  all.sampled += sweep_stats[t].sampled;
+			  all.dropped += sweep_stats[t].dropped;
+			  all.elbogap += sweep_stats[t].elbogap;
+			  if (sweep_stats[t].maxdropped > all.maxdropped)
+				  all.maxdropped = sweep_stats[t].maxdropped;
+		  }
+		  double sampled = all.sampled > 0 ? all.sampled : 1;
+		  elbogap = all.elbogap / sampled * all.ratings;
+		  lerr("iteration %d: truncated phi keeps %.2f of %d components, dropped mass %.3e mean, %.3e max on %lu sampled ratings, ELBO gap %.3e (estimated over all ratings)",
+		       _iter, all.ratings ? (double)all.kept / all.ratings : .0, x,
+		       all.dropped / sampled, all.maxdropped, (unsigned long)all.sampled,
+		       elbogap);
+	  }
+	  if (squarem && squarem_phase > 0) {
+		  // The ELBO of x1, and of the extrapolated parameters
+		  double logl = .0;
+		  for (uint32_t t = 0; t < nthreads; ++t)
+			  logl += sweep_stats[t].logl;
+		  lap();
+		  double elbo = vb_elbo(logl);
+		  lerr("iteration %d: ELBO %.9e (%.4f secs)", _iter, elbo, lap());
+		  if (squarem_phase == 1)
+			  squarem_elbo = elbo;
+		  else if (squarem_phase == 2 && squarem_alpha < -1 && elbo < squarem_elbo) {
+			  // Falls back to x2, drops the next values from the sweep, and repeats the iteration
+			  lerr("iteration %d: squarem step rejected, ELBO %.6e below %.6e, %.4f secs lost",
+			       _iter, elbo, squarem_elbo, t_users);
+			  vb_state(squarem_x[2], true);
+			  _htheta.set_to_prior();
+			  _hsigma.set_to_prior();
+			  _hbeta.set_to_prior();
+			  _hrho.set_to_prior();
+			  have_betasum = false;
+			  squarem_phase = 0;
+			  squarem_rejected++;
+			  squarem_stepmax = squarem_stepmax / 4 > 1 ? squarem_stepmax / 4 : 1;
+			  continue;
+		  } else if (squarem_phase == 2) {
+			  squarem_accepted++;
+			  if (squarem_alpha == -squarem_stepmax)
+				  squarem_stepmax *= 4;
+			  lerr("iteration %d: squarem step accepted, ELBO %.6e, %.6e at x1 (%d accepted, %d rejected)",
+			       _iter, elbo, squarem_elbo, squarem_accepted, squarem_rejected);
+		  }
+	  }
+	  if (squarem)
+		  squarem_phase = (squarem_phase + 1) % 3;
 
 	  debug("htheta = %s", _htheta.expected_v().s().c_str());
 	  debug("hbeta = %s", _hbeta.expected_v().s().c_str());
@@ -1870,10 +2302,11 @@ HGAPRec::vb_hier()
 	  // If there are latent characteristics...
 
 	  if (_k > 0) {
-		  // Swaps the current and the next values for the parameters
-		  _htheta.swap();
-		  // Computes expectations and log expectations based on the new parameters
-		  _htheta.compute_expectations();
+		  // Swaps the current and the next values for the parameters and computes expectations and log expectations based on the new parameters, with their sums
+		  if (restricted)
+			  _htheta.swap_and_update(&thetarowsum, &thetacolsum, NULL, &user_keep, &thetachange);
+		  else
+			  _htheta.swap_and_update(&thetarowsum, &thetacolsum);
 	  }
 	  
 	  // If there are observed item characteristics...
@@ -1888,13 +2321,15 @@ HGAPRec::vb_hier()
 
 		  // Adds the previous sum (itemSum) to \frac{\kappa^{shp}}{\kappa^{shp}} in the next rate
 		  _hsigma.update_rate_next(itemSum);
-		  // Swaps the current and the next values for the parameters
-		  _hsigma.swap();
-
-		  // Computes expectations and log expectations based on the new parameters
-		  _hsigma.compute_expectations();
+		  // Swaps the current and the next values for the parameters and computes the expectations and their sums (the third term of \kappa^{rte}_{uk})
+		  if (restricted)
+			  _hsigma.swap_and_update(&sigmarowsum, &sigmacolsum, &_ratings._itemObsScale, &user_keep, &sigmachange);
+		  else
+			  _hsigma.swap_and_update(&sigmarowsum, &sigmacolsum, &_ratings._itemObsScale);
 	  }
 
+	  t_user_params += lap();
+
 	  //    cout << "Theta: " << endl;
 	  //    _htheta.shape_curr().print();
 	  //    _htheta.rate_curr().print();
@@ -1907,35 +2342,47 @@ HGAPRec::vb_hier()
 	  // Updates for item parameters
 	  //----------------------------------
 
-	  // Second Loop over items/users for updating item parameters
-	  for(uint32_t m = 0; m < _m; ++m){
-	          // For each item, all users for which this item was available are set to 1 in the availability_item array
-		  for (uint32_t user = 0; user < _n; ++user){
-			  if(!_env.session){
-				  availability_item[user] = 1;
-			  }else{
-				  availability_item[user] = _ratings.getAvailability(user,m);
-			  }
-		  }
-		  // If there are latent variables...
-		  if(_k > 0){
+	  // Second Loop over items/users for updating item parameters. Each thread owns a block of items and only writes their rows of the next rate of beta.
+	  if (_k > 0 && !_env.session) {
+		  // Without sessions every user is available for every item, so the sums over users are the same for all items; they were computed with the expectations of theta
+		  cout << "ThetaRowMean " << thetarowsum.mean() << " item = " << 0 << endl;
+		  if (_hbeta.lowmem())
+			  _hbeta.update_rate_next(thetarowsum);
+		  else
+			  parallel_for_balanced(_m, nthreads, NULL, [&](uint32_t begin, uint32_t end, uint32_t t) {
+				  for (uint32_t m = begin; m < end; ++m)
+					  _hbeta.update_rate_next(m,thetarowsum);
+			  }, &item_busy);
+	  } else if (_k > 0) {
+		  parallel_for_balanced(_m, nthreads, NULL, [&](uint32_t begin, uint32_t end, uint32_t t) {
+			  Array availability(_n);
 			  Array thetarowsum(_k);
-			  // Saves the sums of expected values over users for each factor (the second part of \lambda^{rte}_{ik})
-			  _htheta.sum_available_rows(availability_item,thetarowsum);
-			  // Adds the previous sum to \frac{\tau^{shp}}{\tau^{shp}} in the next rate
-			  if( m == 0){
-			  	cout << "ThetaRowMean " << thetarowsum.mean() << " item = " << m << endl;
+			  for(uint32_t m = begin; m < end; ++m){
+				  // For each item, all users for which this item was available are set in the availability array
+				  for (uint32_t user = 0; user < _n; ++user)
+					  availability[user] = _ratings.getAvailability(user,m);
+				  // Saves the sums of expected values over users for each factor (the second part of \lambda^{rte}_{ik})
+				  thetarowsum.zero();
+				  _htheta.sum_available_rows(availability,thetarowsum);
+				  // Adds the previous sum to \frac{\tau^{shp}}{\tau^{shp}} in the next rate
+				  if( m == 0){
+					  cout << "ThetaRowMean " << thetarowsum.mean() << " item = " << m << endl;
+				  }
+				  _hbeta.update_rate_next(m,thetarowsum);
 			  }
-			  _hbeta.update_rate_next(m,thetarowsum);
-		  } 
+		  }, &item_busy);
 	  }//End of second loop over items/users
+	  t_items += lap();
 
 	  // If there are latent variables...
 	  if (_k>0) {
-		  // Swaps the current and the next values for the parameters
-		  _hbeta.swap(); 
-		  // Computes expectations and log expectations based on the new parameters
-		  _hbeta.compute_expectations();
+		  // Swaps the current and the next values for the parameters and computes expectations and log expectations based on the new parameters, with their sums
+		  if (restricted)
+			  _hbeta.swap_and_update(&betarowsum_next, &betacolsum, NULL, &item_keep, &betachange);
+		  else
+			  _hbeta.swap_and_update(&betarowsum_next, &betacolsum);
+		  betasum.copy_from(betarowsum_next);
+		  have_betasum = true;
 	  }
 
 	  // If there are observed user characteristics...
@@ -1954,14 +2401,16 @@ HGAPRec::vb_hier()
 
 		  // Adds the previous sum to \frac{\kappa^{shp}}{\kappa^{shp}} in the next rate
 		  _hrho.update_rate_next(userSum);
-		  // Swaps the current and the next values for the parameters
-		  _hrho.swap();
-
-		  // Computes expectations and log expectations based on the new parameters
+		  // Swaps the current and the next values for the parameters and computes the expectations and their sums (the third term of \tau^{rte}_{uk})
 		  //      cout << "rho " << _iter << endl;
-		  _hrho.compute_expectations();
+		  if (restricted)
+			  _hrho.swap_and_update(&rhorowsum, &rhocolsum, &_ratings._userObsScale, &item_keep, &rhochange);
+		  else
+			  _hrho.swap_and_update(&rhorowsum, &rhocolsum, &_ratings._userObsScale);
 	  }
 
+	  t_item_params += lap();
+
 	  //    cout << "Beta: " << endl;
 	  //    _hbeta.shape_curr().print();
 	  //    _hbeta.rate_curr().print();
@@ -1979,10 +2428,7 @@ HGAPRec::vb_hier()
 
 	  // If there are latent variables...
 	  if (_k>0) {
-		  Array thetacolsum(_n);
-		  // Computes the second term of \kappa^{rte}_{uk})
-		  _htheta.sum_cols(thetacolsum);
-
+		  // The second term of \kappa^{rte}_{uk}) is thetacolsum
 		  // Adds the new term to the rate parameter of xi
 		  _thetarate.update_rate_next(thetacolsum);
 
@@ -1991,9 +2437,7 @@ HGAPRec::vb_hier()
 
 	  // With unobserved item characteristics...
 	  if (_ic > 0) {
-		  Array sigmacolsum(_n);
-		  // Computes the third term of \kappa^{rte}_{uk})
-		  _hsigma.sum_cols_weight(_ratings._itemObsScale,sigmacolsum);
+		  // The third term of \kappa^{rte}_{uk}) is sigmacolsum
 		  //      _ratings._itemObsScale.print();
 		  // Adds the new term to the rate parameter of xi
 		  //      _thetarate.update_rate_next(sigmacolsum.scale(_env.e/(_env.c*_env.a)));
@@ -2015,20 +2459,14 @@ HGAPRec::vb_hier()
 
 	  // If there are latent variables...
 	  if (_k>0) {
-
-		  Array betacolsum(_m);
-
-		  // Computes the second term of \tau^{rte}_{uk})
-		  _hbeta.sum_cols(betacolsum);
+		  // The second term of \tau^{rte}_{uk}) is betacolsum
 		  // Adds the new term to the rate parameter of eta
 		  _betarate.update_rate_next(betacolsum);
 	  }
 
 	  // With unobserved user characteristics...
 	  if (_uc > 0) {
-		  Array rhocolsum(_m);
-		  // Computes the third term of \tau^{rte}_{uk})
-		  _hrho.sum_cols_weight(_ratings._userObsScale,rhocolsum);
+		  // The third term of \tau^{rte}_{uk}) is rhocolsum
 		  // Adds the new term to the rate parameter of eta
 		  _betarate.update_rate_next(rhocolsum.scale(_env.f/(_env.c*_env.a)));
 	  }
@@ -2039,6 +2477,7 @@ HGAPRec::vb_hier()
 	  _betarate.swap();
 	  // Computes the expectations with the (new) current values
 	  _betarate.compute_expectations();
+	  t_rates += lap();
 
 	  //    if (_iter == 59 || _iter == 0) {
 	  //      cout << "Beta shape: " << endl;
@@ -2061,17 +2500,62 @@ HGAPRec::vb_hier()
 	  //    }
 
 	  printf("iteration %d\n", _iter);
+	  lerr("iteration %d: user sweep %.4f, user params %.4f, item pass %.4f, item params %.4f, xi and eta %.4f secs (%d threads)",
+	       _iter, t_users, t_user_params, t_items, t_item_params, t_rates, nthreads);
+	  if (nthreads > 1) {
+		  ostringstream sb;
+		  for (uint32_t t = 0; t < user_busy.size(); ++t)
+			  sb << " " << std::fixed << std::setprecision(4) << user_busy[t];
+		  lerr("iteration %d: busy secs per thread in the user sweep:%s", _iter, sb.str().c_str());
+	  }
+	  if (counters) {
+		  uint64_t refs = counters->references(), misses = counters->misses();
+		  lerr("iteration %d: user sweep LLC references %" PRIu64 ", misses %" PRIu64 " (%.2f%%)",
+		       _iter, refs, misses, refs ? 100.0 * misses / refs : .0);
+	  }
+	  if (activeset && _iter >= localsweeps) {
+		  // Freezes the users and items whose expected values changed less than the tolerance, or reactivates everything
+		  uint32_t users_frozen = 0, items_frozen = 0;
+		  bool reactivate = (_iter + 1) % _env.reactivate == 0;
+		  if (reactivate) {
+			  std::fill(user_state.begin(), user_state.end(), (char)ACTIVE);
+			  std::fill(item_state.begin(), item_state.end(), (char)ACTIVE);
+			  cache_beta.zero();
+			  cache_rho.zero();
+		  }
+		  for (uint32_t n = 0; n < _n; ++n) {
+			  if (!reactivate) {
+				  if (user_state[n] == FREEZING)
+					  user_state[n] = FROZEN;
+				  else if (user_state[n] == ACTIVE && thetachange[n] < _env.activeset && sigmachange[n] < _env.activeset)
+					  user_state[n] = FREEZING;
+			  }
+			  user_keep[n] = user_state[n] == FROZEN;
+			  users_frozen += user_keep[n];
+		  }
+		  for (uint32_t m = 0; m < _m; ++m) {
+			  if (!reactivate && item_state[m] == ACTIVE && betachange[m] < _env.activeset && rhochange[m] < _env.activeset)
+				  item_state[m] = FROZEN;
+			  item_keep[m] = item_state[m] == FROZEN;
+			  items_frozen += item_keep[m];
+		  }
+		  lerr("iteration %d: active set has %d of %d users and %d of %d items frozen%s",
+		       _iter, users_frozen, _n, items_frozen, _m, reactivate ? " (all reactivated)" : "");
+	  }
 
-	  // Save the values of the new iteration to the matrices of expected values
+	  // Save the values of the new iteration to the matrices of expected values, from the sums over rows of the updates
 	  Array betaMean(_k);
 	  Array thetaMean(_k);
 	  Array sigmaMean(_ic);
 	  Array rhoMean(_uc);
-
-	  _hbeta.expected_means(betaMean);
-	  _htheta.expected_means(thetaMean);
-	  _hsigma.expected_means(sigmaMean);
-	  _hrho.expected_means(rhoMean);
+	  for (uint32_t k = 0; k < _k; ++k) {
+		  betaMean[k] = betarowsum_next[k] / _m;
+		  thetaMean[k] = thetarowsum[k] / _n;
+	  }
+	  for (uint32_t l = 0; l < _ic; ++l)
+		  sigmaMean[l] = sigmarowsum[l] / _n;
+	  for (uint32_t l = 0; l < _uc; ++l)
+		  rhoMean[l] = rhorowsum[l] / _m;
 
 	  double xiMean = _betarate.expected_mean();
 	  double etaMean = _thetarate.expected_mean();
@@ -2090,14 +2574,27 @@ HGAPRec::vb_hier()
 	  fflush(stdout);
 	  if (_iter % _env.reportfreq == 0) {
 
+		  build_augmented();
 		  compute_likelihood(false);
 		  stop = compute_likelihood(true);
+		  // The cost of truncated phi in the validation likelihood (_prev_h), against the run with exact phi at the same iteration with -phiref
+		  if (truncated) {
+			  if (_iter < phiref_h.size() && !std::isnan(phiref_h[_iter])) {
+				  lerr("iteration %d: truncated phi ELBO gap %.3e, validation likelihood %.9f, gap %.3e against exact phi",
+				       _iter, elbogap, _prev_h, phiref_h[_iter] - _prev_h);
+				  printf("+ truncated phi: validation likelihood gap %.3e against exact phi\n", phiref_h[_iter] - _prev_h);
+			  } else
+				  lerr("iteration %d: truncated phi ELBO gap %.3e, validation likelihood %.9f",
+				       _iter, elbogap, _prev_h);
+		  }
 		  //compute_rmse();
 		  save_model();
+		  lap();
 		  // Computes and saves number of relevant recommendations among best ranked items
 		  compute_precision(false);
 		  // Computes and saves average ranking of items in test set
 		  compute_itemrank(false);
+		  lerr("iteration %d: precision %.4f secs", _iter, lap());
 		  //gen_ranking_for_users(false);
 		  if (_env.logl)
 			  logl();
@@ -2228,8 +2725,9 @@ HGAPRec::compute_likelihood(bool validationLikelihood)
   if (validationLikelihood) {
     int why = -1;
     
-    // Check stopping criteria every iteration after 30
-    if (_iter > 30) {
+    // Check stopping criteria every iteration after 30, or after the local sweeps of a warm start, which begins near the optimum
+    uint32_t burnin = _env.warmstart_dir != "" ? _env.localsweeps : 30;
+    if (_iter > burnin) {
       
       cout << " Likelihood change: " << fabs((a - _prev_h) / _prev_h) << endl;
       cout << a << " " << a -  _prev_h << endl;
@@ -2285,8 +2783,8 @@ HGAPRec::rating_likelihood(uint32_t p, uint32_t q, yval_t y) const
   }
   
   if (_env.bias) {
-    const double **ethetabias = _thetabias.expected_v().const_data();
-    const double **ebetabias = _betabias.expected_v().const_data();
+    const param_t **ethetabias = _thetabias.expected_v().const_data();
+    const param_t **ebetabias = _betabias.expected_v().const_data();
     s += ethetabias[p][0] + ebetabias[q][0];
   } 
   
@@ -2302,59 +2800,12 @@ HGAPRec::rating_likelihood(uint32_t p, uint32_t q, yval_t y) const
 double
 HGAPRec::rating_likelihood_hier(uint32_t u, uint32_t i, yval_t y) const
 {
-  // Gets the current expected values of theta, beta, sigma, rho, and the expected value of the inverse of xi and eta
-  const double **etheta = _htheta.expected_v().const_data();
-  const double **ebeta = _hbeta.expected_v().const_data();
-  const double **esigma = _hsigma.expected_v().const_data();
-  const double **erho = _hrho.expected_v().const_data();
-  const double *einvxi = _thetarate.expected_inv().const_data();
-  const double *einveta = _betarate.expected_inv().const_data();
-  double **itemChar = _ratings._itemObs.data();
-  double **userChar = _ratings._userObs.data();
-  
-  // Finds the sum of dot products \theta_u\beta_i+\sigma_u\x_i+\w_u\rho_i
-
-  
-  double s = .0;
-  for (uint32_t k = 0; k < _k; ++k) {
-    s += etheta[u][k] * ebeta[i][k];
-  }
-  for (uint32_t l = 0; l < _ic; ++l) {
-    s += esigma[u][l] * itemChar[i][l] * einveta[i];
-  }
-  for (uint32_t m = 0; m < _uc; ++m) {
-    s += userChar[u][m] * einvxi[u] * erho[i][m];
-  }
-  
-//  if ( _iter == 130 && i == 263  ) {
-//    
-//    cout << _betarate.rate_curr().get(i) << " " << _betarate.shape_curr().get(i) << endl;
-//    cout << einveta[i] << " " << einvxi[u] << endl;
-//    
-//    for (uint32_t k = 0; k < _k; ++k) {
-//      cout << etheta[u][k] * ebeta[i][k] << " ";
-//    }
-//        cout << endl;
-//    for (uint32_t l = 0; l < _ic; ++l) {
-//      cout << esigma[u][l] * itemChar[i][l] * einveta[i] << " ";
-//      cout << esigma[u][l] << " " << itemChar[i][l]<< " " << einveta[i] << " " << _betarate.rate_curr().get(i)<< " " << _betarate.shape_curr().get(i) <<": ";
-//    }
-//        cout << endl;
-//    for (uint32_t m = 0; m < _uc; ++m) {
-//      cout << userChar[u][m] * einvxi[u] * erho[i][m] << " ";
-//      cout << erho[i][m] << " " << userChar[u][m] << " " << einvxi[u] << ": ";
-//    }
-//    
-//    cout << endl;
-//    
-//    cout << _ratings.seq2user().at(u) << " " << _ratings.seq2movie().at(i) << endl;
-//    cout << "y: " << y << " s: " << s << " ll: " << (y * log(s) - s - log_factorial(y)) << endl;
-////    cout << "-------------" << i << endl;
-//  }
+  // The rate \theta_u\beta_i+\sigma_u\x_i/\eta_i+\w_u\rho_i/\xi_u is the dot product of the augmented vectors (see build_augmented())
+  double s = vdot(_uaug.const_data()[u], _iaug.const_data()[i], _k+_ic+_uc);
   
   if (_env.bias) {
-    const double **ethetabias = _thetabias.expected_v().const_data();
-    const double **ebetabias = _betabias.expected_v().const_data();
+    const param_t **ethetabias = _thetabias.expected_v().const_data();
+    const param_t **ebetabias = _betabias.expected_v().const_data();
     s += ethetabias[u][0] + ebetabias[i][0];
   } 
   
@@ -2380,8 +2831,13 @@ HGAPRec::log_factorial(uint32_t n)  const
 void
 HGAPRec::do_on_stop()
 {
+  build_augmented();
   save_model();
   gen_ranking_for_users(false);
+  if (_env.topn_table > 0)
+    user_topn_table();
+  if (_env.export_topn > 0)
+    export_rankings();
 }
 
 double
@@ -2442,6 +2898,11 @@ HGAPRec::compute_itemrank(bool final)
   double sum_rank = .0;
   double sum_reciprocal_rank = .0;
   
+  // Scores of a block of sampled users, and the position of the current user in it
+  vector<uint32_t> block;
+  vector<double> block_scores;
+  uint32_t pos = 0;
+  
   // Iterates over users in sample. Uses the sample of users generated in this::compute_precision()
   for (UserMap::const_iterator itr = _sampled_users.begin();
        itr != _sampled_users.end(); ++itr) {
@@ -2449,6 +2910,13 @@ HGAPRec::compute_itemrank(bool final)
     // Saves number of user in n
     uint32_t n = itr->first;
     
+    // With -hier, the scores of the next few users are computed together
+    if (_env.hier && pos == block.size()) {
+      score_next_block(itr, block, block_scores);
+      pos = 0;
+    }
+    const double *scores_n = _env.hier ? &block_scores[(size_t)pos++ * _m] : NULL;
+    
     // Loop over items
     for (uint32_t m = 0; m < _m; ++m) {
       Rating r(n,m);
@@ -2469,7 +2937,7 @@ HGAPRec::compute_itemrank(bool final)
 //      else if (_env.graphchi) {
 //        u = prediction_score_chi(n, m);
 //      } else
-        u = _env.hier ? prediction_score_hier(n, m) : prediction_score(n, m);
+        u = _env.hier ? scores_n[m] : prediction_score(n, m);
       
       // Saves the predicted rating in mlist. If the rating is in the test set, saves the observed rating in ndcglist
       mlist[m].first = m;
@@ -2567,6 +3035,11 @@ HGAPRec::compute_precision(bool save_ranking_file)
   // Matrix of observed ratings
   KVIArray ndcglist(_m);
   
+  // Scores of a block of sampled users, and the position of the current user in it
+  vector<uint32_t> block;
+  vector<double> block_scores;
+  uint32_t pos = 0;
+  
   // Iterates over users in sample
   for (UserMap::const_iterator itr = _sampled_users.begin();
        itr != _sampled_users.end(); ++itr) {
@@ -2574,6 +3047,13 @@ HGAPRec::compute_precision(bool save_ranking_file)
     // Saves number of user in n
     uint32_t n = itr->first;
     
+    // With -hier, the scores of the next few users are computed together
+    if (_env.hier && pos == block.size()) {
+      score_next_block(itr, block, block_scores);
+      pos = 0;
+    }
+    const double *scores_n = _env.hier ? &block_scores[(size_t)pos++ * _m] : NULL;
+    
     // Loop over items
     for (uint32_t m = 0; m < _m; ++m) {
       Rating r(n,m);
@@ -2604,7 +3084,7 @@ HGAPRec::compute_precision(bool save_ranking_file)
 //        u = prediction_score_ctr(n, m);
 //      } else {
 ////                cout << "else" << endl;
-        u = _env.hier ? prediction_score_hier(n, m) : prediction_score(n, m);
+        u = _env.hier ? scores_n[m] : prediction_score(n, m);
 //      }
       
       // Saves the predicted rating in mlist. If the rating is in the test set, saves the observed rating in ndcglist
@@ -2743,8 +3223,8 @@ HGAPRec::prediction_score(uint32_t user, uint32_t movie) const
       s += etheta[user][k] * ebeta[movie][k];
 
   if (_env.bias) {
-    const double **ethetabias = _thetabias.expected_v().const_data();
-    const double **ebetabias = _betabias.expected_v().const_data();
+    const param_t **ethetabias = _thetabias.expected_v().const_data();
+    const param_t **ebetabias = _betabias.expected_v().const_data();
     s += ethetabias[user][0] + ebetabias[movie][0];
   }
   
@@ -2848,18 +3328,18 @@ HGAPRec::prediction_score_lda(uint32_t user, uint32_t movie) const
 double
 HGAPRec::prediction_score_hier(uint32_t user, uint32_t movie) const
 {
-  // Saves the expected values of theta and beta
-  const double **etheta = _htheta.expected_v().const_data();
-  const double **ebeta = _hbeta.expected_v().const_data();
-  
-  // Computes the dot product of the expected values of theta and beta (the rate of the Poisson random variable)
-  double s = .0;
-  for (uint32_t k = 0; k < _k; ++k)
-    s += etheta[user][k] * ebeta[movie][k];
+  // Computes the rate of the Poisson random variable, including the terms with observed characteristics, as the dot product of the augmented vectors
+  double s = vdot(_uaug.const_data()[user], _iaug.const_data()[movie], _k+_ic+_uc);
+  return hier_score(user, movie, s);
+}
 
+// Returns the predicted score from the dot product s of the augmented vectors of user and movie
+double
+HGAPRec::hier_score(uint32_t user, uint32_t movie, double s) const
+{
   if (_env.bias) {
-    const double **ethetabias = _thetabias.expected_v().const_data();
-    const double **ebetabias = _betabias.expected_v().const_data();
+    const param_t **ethetabias = _thetabias.expected_v().const_data();
+    const param_t **ebetabias = _betabias.expected_v().const_data();
     s += ethetabias[user][0] + ebetabias[movie][0];
   }
   
@@ -2876,6 +3356,38 @@ HGAPRec::prediction_score_hier(uint32_t user, uint32_t movie) const
   return 1 - prob_zero;
 }
 
+// Computes the scores of all items for the nu users in users, in scores (nu x _m, by rows). With CBLAS the rates are one matrix product of the augmented user vectors and the packed item vectors.
+void
+HGAPRec::score_users(const uint32_t *users, uint32_t nu, double *scores) const
+{
+#ifdef HAVE_CBLAS
+  uint32_t d = _k + _ic + _uc;
+  vector<double> ublock((size_t)nu * d);
+  for (uint32_t q = 0; q < nu; ++q)
+    memcpy(&ublock[(size_t)q * d], _uaug.const_data()[users[q]], d * sizeof(double));
+  blas_gemm_nt(nu, _m, d, ublock.data(), _iaug_packed.data(), scores);
+  for (uint32_t q = 0; q < nu; ++q)
+    for (uint32_t m = 0; m < _m; ++m)
+      scores[(size_t)q * _m + m] = hier_score(users[q], m, scores[(size_t)q * _m + m]);
+#else
+  for (uint32_t q = 0; q < nu; ++q)
+    for (uint32_t m = 0; m < _m; ++m)
+      scores[(size_t)q * _m + m] = prediction_score_hier(users[q], m);
+#endif
+}
+
+// Scores the next block of sampled users, starting at itr, for compute_precision() and compute_itemrank()
+void
+HGAPRec::score_next_block(UserMap::const_iterator itr, vector<uint32_t> &block, vector<double> &scores) const
+{
+  const uint32_t maxblock = 16;
+  block.clear();
+  for (; itr != _sampled_users.end() && block.size() < maxblock; ++itr)
+    block.push_back(itr->first);
+  scores.resize((size_t)block.size() * _m);
+  score_users(block.data(), block.size(), scores.data());
+}
+
 void
 HGAPRec::gen_msr_csv()
 {
@@ -2976,8 +3488,10 @@ HGAPRec::gen_ranking_for_users(bool load)
   if (_env.ctr) {
     lerr("loading CTR files");
     load_ctr_beta_and_theta();
-  } else if (load)
+  } else if (load) {
     load_beta_and_theta();
+    build_augmented();
+  }
 
   char buf[4096];
   sprintf(buf, "%s/test_users.tsv", _env.datfname.c_str());
@@ -3020,97 +3534,867 @@ HGAPRec::load_beta_and_theta()
   }
 }
 
-// Saves the matrices in output files
+// Materializes the augmented user vectors [E theta_u, E sigma_u, w_u E[1/xi_u]] and item vectors [E beta_i, x_i E[1/eta_i], E rho_i], so that the rate of the Poisson variable for (u,i) is a single dot product. Must be called again whenever the parameters change.
 void
-HGAPRec::save_model()
+HGAPRec::build_augmented()
 {
-  if (_env.hier) {
-    _hbeta.save_state(_ratings.seq2movie(),_env.outfname);
-    _betarate.save_state(_ratings.seq2movie(),_env.outfname);
-    _htheta.save_state(_ratings.seq2user(),_env.outfname);
-    _thetarate.save_state(_ratings.seq2user(),_env.outfname);
-    _hsigma.save_state(_ratings.seq2user(),_env.outfname);
-    _hrho.save_state(_ratings.seq2movie(),_env.outfname);
-  } else {
-    _beta.save_state(_ratings.seq2movie(),_env.outfname);
-    _theta.save_state(_ratings.seq2user(),_env.outfname);
-  }
-
-  if (_env.bias) {
-    _betabias.save_state(_ratings.seq2movie(),_env.outfname);
-    _thetabias.save_state(_ratings.seq2user(),_env.outfname);
-  }
-  if (_env.canny || _env.mle_user || _env.mle_item) {
-    _theta_mle.save(Env::file_str("/theta_mle.tsv"), _ratings.seq2user());
-    _beta_mle.save(Env::file_str("/beta_mle.tsv"), _ratings.seq2movie());
-  }
+  const double *einvxi = _thetarate.expected_inv().const_data();
+  const double *einveta = _betarate.expected_inv().const_data();
+  const double **itemChar = _ratings._itemObs.const_data();
+  const double **userChar = _ratings._userObs.const_data();
+  double **uaug = _uaug.data();
+  double **iaug = _iaug.data();
   
-//  save_phi();
+  parallel_for(_n, _env.nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t n = begin; n < end; ++n) {
+      for (uint32_t k = 0; k < _k; ++k)
+        uaug[n][k] = _htheta.expected(n, k);
+      for (uint32_t l = 0; l < _ic; ++l)
+        uaug[n][_k+l] = _hsigma.expected(n, l);
+      for (uint32_t m = 0; m < _uc; ++m)
+        uaug[n][_k+_ic+m] = userChar[n][m] * einvxi[n];
+    }
+  });
+  parallel_for(_m, _env.nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t i = begin; i < end; ++i) {
+      for (uint32_t k = 0; k < _k; ++k)
+        iaug[i][k] = _hbeta.expected(i, k);
+      for (uint32_t l = 0; l < _ic; ++l)
+        iaug[i][_k+l] = itemChar[i][l] * einveta[i];
+      for (uint32_t m = 0; m < _uc; ++m)
+        iaug[i][_k+_ic+m] = _hrho.expected(i, m);
+    }
+  });
+#ifdef HAVE_CBLAS
+  // The item vectors in one block, for the matrix products in score_users()
+  uint32_t d = _k + _ic + _uc;
+  _iaug_packed.resize((size_t)_m * d);
+  for (uint32_t i = 0; i < _m; ++i)
+    memcpy(&_iaug_packed[(size_t)i * d], iaug[i], d * sizeof(double));
+#endif
 }
 
-//void
-//HGAPRec::save_phi() {
-//  string name = string("/phi.tsv");
-//  phi.save(_env.outfname+"/"+Env::outfile_str(name));
-//}
-
+// Loads the parameters of the hierarchical model saved by save_model() in directory dir. The dataset must be the same one used for training, so that the user and item indices agree.
 void
-HGAPRec::logl()
+HGAPRec::load_model(string dir)
 {
-  uint32_t x;
-  if (_env.bias)
-    x = _k+2;
-  else
-    x = _k;
-
-  Array phi(x);
-  double s = .0;
-
-  const double  **etheta = NULL;
-  const double  **ebeta = NULL; 
-  const double  **elogtheta = NULL; 
-  const double  **elogbeta = NULL; 
-  const double  **eu = NULL;
-  const double  **ei = NULL; 
-  const double  **elogu = NULL; 
-  const double  **elogi = NULL; 
+  _hbeta.load_state(dir);
+  _hrho.load_state(dir);
+  _betarate.load_state(dir);
+  _htheta.load_state(dir);
+  _hsigma.load_state(dir);
+  _thetarate.load_state(dir);
+  build_augmented();
+  printf("+ loaded model from %s\n", dir.c_str());
+  fflush(stdout);
+}
 
-  if (!_env.hier) {
-    etheta = _theta.expected_v().const_data();
-    ebeta = _beta.expected_v().const_data();
-    elogtheta = _theta.expected_logv().const_data();
-    elogbeta = _beta.expected_logv().const_data();
+// Starts the parameters from a previous model saved in dir, trained on other ratings: the users and items it has, matched by id, take their values there, and the new ones keep their initial values. The new users and items, and those of the ratings in the file env.newratings (in the format of train.tsv), are marked as affected. Without env.newratings, the new ratings are not known, and every user and item is affected.
+void
+HGAPRec::warm_start(string dir, vector<char> &user_affected, vector<char> &item_affected)
+{
+  vector<char> found;
+  _htheta.load_state(dir, _ratings.user2seq(), found);
+  _hsigma.load_state(dir, _ratings.user2seq(), found);
+  _thetarate.load_state(dir, _ratings.user2seq(), found);
+  for (uint32_t n = 0; n < _n; ++n)
+    user_affected[n] = !found[n];
+  _hbeta.load_state(dir, _ratings.movie2seq(), found);
+  _hrho.load_state(dir, _ratings.movie2seq(), found);
+  _betarate.load_state(dir, _ratings.movie2seq(), found);
+  for (uint32_t m = 0; m < _m; ++m)
+    item_affected[m] = !found[m];
+  uint32_t newusers = std::count(user_affected.begin(), user_affected.end(), 1);
+  uint32_t newitems = std::count(item_affected.begin(), item_affected.end(), 1);
+  
+  uint32_t nratings = 0;
+  if (_env.newratings == "") {
+    std::fill(user_affected.begin(), user_affected.end(), 1);
+    std::fill(item_affected.begin(), item_affected.end(), 1);
   } else {
-    etheta = _htheta.expected_v().const_data();
-    ebeta = _hbeta.expected_v().const_data();
-    elogtheta = _htheta.expected_logv().const_data();
-    elogbeta = _hbeta.expected_logv().const_data();
+    FILE *f = fopen(_env.newratings.c_str(), "r");
+    if (!f) {
+      printf("error: cannot open %s\n", _env.newratings.c_str());
+      exit(-1);
+    }
+    uint64_t uid = 0, sid = 0, mid = 0;
+    uint32_t rating = 0;
+    // Every line must have all its fields (blank lines are skipped); a line that does not parse is an error
+    const int fields = _env.session ? 4 : 3;
+    char line[4096];
+    uint32_t lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+      lineno++;
+      if (line[strspn(line, " \t\r\n")] == '\0')
+        continue;
+      int r = _env.session ?
+        sscanf(line, "%" SCNu64 "%" SCNu64 "%" SCNu64 "%u", &uid, &sid, &mid, &rating) :
+        sscanf(line, "%" SCNu64 "%" SCNu64 "%u", &uid, &mid, &rating);
+      if (r != fields) {
+        printf("error: cannot parse line %d of %s\n", lineno, _env.newratings.c_str());
+        exit(-1);
+      }
+      IDMap::const_iterator it = _ratings.user2seq().find(uid);
+      IDMap::const_iterator mt = _ratings.movie2seq().find(mid);
+      if (it != _ratings.user2seq().end())
+        user_affected[it->second] = 1;
+      if (mt != _ratings.movie2seq().end())
+        item_affected[mt->second] = 1;
+      nratings++;
+    }
+    fclose(f);
   }
+  uint32_t users = std::count(user_affected.begin(), user_affected.end(), 1);
+  uint32_t items = std::count(item_affected.begin(), item_affected.end(), 1);
+  printf("+ warm start from %s: %d new users and %d new items; %d users and %d items affected, with %d new ratings\n",
+         dir.c_str(), newusers, newitems, users, items, nratings);
+  lerr("warm start from %s: %d new users and %d new items; %d of %d users and %d of %d items affected, with %d new ratings",
+       dir.c_str(), newusers, newitems, users, _n, items, _m, nratings);
+}
 
-  if (_env.bias) {
-    eu = _thetabias.expected_v().const_data();
-    ei = _betabias.expected_v().const_data();
-    elogu = _thetabias.expected_logv().const_data();
-    elogi = _betabias.expected_logv().const_data();
+// Computes the sums over items that enter the rates of theta and sigma of a folded-in user. They only depend on the item parameters, so they are shared by all new users.
+void
+HGAPRec::prepare_foldin()
+{
+  _foldin_betarowsum.zero();
+  _foldin_itemsum.zero();
+  if (_k > 0)
+    _hbeta.sum_rows(_foldin_betarowsum);
+  if (_ic > 0)
+    _ratings._itemObs.weighted_colsum(_betarate.expected_inv(), _foldin_itemsum);
+}
+
+// Infers theta, sigma, and xi for a user outside the training set. Runs the user updates of vb_hier() for that user alone, with the item parameters (hbeta, hrho, betarate) fixed, until the expected values stop changing. Returns the number of iterations.
+uint32_t
+HGAPRec::foldin_user(const FoldinUser &u, Array &etheta, Array &esigma, double &einvxi) const
+{
+  const uint32_t max_iterations = 200;
+  const double threshold = 1e-6;
+  
+  const param_t **elogbeta = _hbeta.expected_logv().const_data();
+  const param_t **elogrho = _hrho.expected_logv().const_data();
+  const double *elogeta = _betarate.expected_logv().const_data();
+  const double **itemChar = _ratings._itemObs.const_data();
+  const double *itemScale = _ratings._itemObsScale.const_data();
+  const double *betarowsum = _foldin_betarowsum.const_data();
+  const double *itemsum = _foldin_itemsum.const_data();
+  double factor = _env.e/(_env.c*_env.a);
+  
+  Array elogtheta(_k), elogsigma(_ic), logobs(_uc);
+  Array stheta(_k), ssigma(_ic);
+  Array phi(_k+_ic+_uc);
+  for (uint32_t m = 0; m < _uc; ++m)
+    logobs[m] = log(u.obs[m]);
+  
+  // Starts xi at its prior and theta and sigma at their priors given xi
+  double xishape = _env.ap + _k*_env.a + _ic*_env.e;
+  double xirate = _env.ap/_env.bp;
+  double exi = _env.ap/xirate;
+  double elogxi = gsl_sf_psi(_env.ap) - log(xirate);
+  stheta.set_elements(_env.a);
+  ssigma.set_elements(_env.e);
+  
+  uint32_t iter = 0;
+  bool converged = false;
+  while (true) {
+    // Expectations of theta and sigma with the current xi
+    double change = .0;
+    for (uint32_t k = 0; k < _k; ++k) {
+      double rate = exi + betarowsum[k];
+      double v = stheta[k] / rate;
+      if (iter > 0)
+        change = fmax(change, fabs(v - etheta[k]) / etheta[k]);
+      etheta[k] = v;
+      elogtheta[k] = gsl_sf_psi(stheta[k]) - log(rate);
+    }
+    for (uint32_t l = 0; l < _ic; ++l) {
+      double rate = exi * factor * itemScale[l] + itemsum[l];
+      double v = ssigma[l] / rate;
+      if (iter > 0)
+        change = fmax(change, fabs(v - esigma[l]) / esigma[l]);
+      esigma[l] = v;
+      elogsigma[l] = gsl_sf_psi(ssigma[l]) - log(rate);
+    }
+    
+    // Updates xi with the new expectations
+    xirate = _env.ap/_env.bp;
+    for (uint32_t k = 0; k < _k; ++k)
+      xirate += etheta[k];
+    for (uint32_t l = 0; l < _ic; ++l)
+      xirate += factor * itemScale[l] * esigma[l];
+    exi = xishape / xirate;
+    elogxi = gsl_sf_psi(xishape) - log(xirate);
+    
+    if (converged || iter >= max_iterations)
+      break;
+    converged = iter > 0 && change < threshold;
+    iter++;
+    
+    // Adds y_{ui} phi_{ui} of every rating to the prior shapes
+    stheta.set_elements(_env.a);
+    ssigma.set_elements(_env.e);
+    for (uint32_t j = 0; j < u.items.size(); ++j) {
+      uint32_t i = u.items[j];
+      yval_t y = u.ratings[j];
+      for (uint32_t k = 0; k < _k; ++k)
+        phi[k] = elogtheta[k] + elogbeta[i][k];
+      for (uint32_t l = 0; l < _ic; ++l)
+        phi[_k+l] = elogsigma[l] - elogeta[i] + log(itemChar[i][l]);
+      for (uint32_t m = 0; m < _uc; ++m)
+        phi[_k+_ic+m] = elogrho[i][m] - elogxi + logobs[m];
+      phi.lognormalize();
+      if (y > 1)
+        phi.scale(y);
+      for (uint32_t k = 0; k < _k; ++k)
+        stheta[k] += phi[k];
+      for (uint32_t l = 0; l < _ic; ++l)
+        ssigma[l] += phi[_k+l];
+    }
   }
+  einvxi = xirate / (xishape - 1);
+  return iter;
+}
 
-  for (uint32_t n = 0; n < _n; ++n) {
-    const vector<uint32_t> *movies = _ratings.get_movies(n);
+// Computes the rate of the Poisson variable for every training item and a user with observables obs and the given expectations
+void
+HGAPRec::foldin_scores(const Array &obs, const Array &etheta, const Array &esigma, double einvxi, Array &scores) const
+{
+  const double **iaug = _iaug.const_data();
+  uint32_t x = _k+_ic+_uc;
+  
+  // Augmented vector of the user, see build_augmented()
+  Array uaug(x);
+  for (uint32_t k = 0; k < _k; ++k)
+    uaug[k] = etheta[k];
+  for (uint32_t l = 0; l < _ic; ++l)
+    uaug[_k+l] = esigma[l];
+  for (uint32_t m = 0; m < _uc; ++m)
+    uaug[_k+_ic+m] = obs[m] * einvxi;
+  
+  for (uint32_t i = 0; i < _m; ++i)
+    scores[i] = vdot(uaug.const_data(), iaug[i], x);
+}
+
+// Folds in the users in _env.foldin_dir in parallel and writes their best ranked items to foldin_ranking.tsv and their expected theta to foldin_htheta.tsv
+void
+HGAPRec::foldin_users()
+{
+  FoldinUserList users;
+  if (_ratings.read_foldin(_env.foldin_dir, users) < 0)
+    exit(-1);
+  prepare_foldin();
+  
+  uint32_t nusers = users.size();
+  uint32_t topn = _topN_by_user < _m ? _topN_by_user : _m;
+  Matrix thetas(nusers, _k);
+  MatrixKV ranking(nusers, topn);
+  D1Array<uint32_t> iterations(nusers);
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  parallel_for(nusers, _env.nthreads,
+               [&](uint32_t begin, uint32_t end, uint32_t t) {
+    Array etheta(_k), esigma(_ic), scores(_m);
+    KVArray mlist(_m);
+    double einvxi = .0;
+    for (uint32_t n = begin; n < end; ++n) {
+      const FoldinUser &u = *users[n];
+      iterations[n] = foldin_user(u, etheta, esigma, einvxi);
+      thetas.set_row(n, etheta);
+      
+      foldin_scores(u.obs, etheta, esigma, einvxi, scores);
+      for (uint32_t m = 0; m < _m; ++m) {
+        mlist[m].first = m;
+        mlist[m].second = scores[m];
+      }
+      // Items the user already rated go to the end of the ranking
+      for (uint32_t j = 0; j < u.items.size(); ++j)
+        mlist[u.items[j]].second = -1;
+      mlist.sort_by_value(topn);
+      for (uint32_t j = 0; j < topn; ++j)
+        ranking.set(n, j, mlist[j]);
+    }
+  });
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  
+  uint64_t total_iterations = 0;
+  for (uint32_t n = 0; n < nusers; ++n)
+    total_iterations += iterations[n];
+  printf("+ folded in %d users in %.4f secs (%.1f users/sec, %.1f iterations per user, %d threads)\n",
+         nusers, secs.count(), nusers / secs.count(),
+         nusers ? (double)total_iterations / nusers : .0, _env.nthreads);
+  fflush(stdout);
+  lerr("folded in %d users in %.4f secs", nusers, secs.count());
+  
+  string name = _env.outfname+"/"+_env.prefix+"/foldin_ranking.tsv";
+  FILE *f = fopen(name.c_str(), "w");
+  if (!f)  {
+    printf("cannot open foldin ranking file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+  for (uint32_t n = 0; n < nusers; ++n)
+    for (uint32_t j = 0; j < topn; ++j) {
+      const KV &kv = ranking.get(n, j);
+      if (kv.second < 0)
+        break;
+      IDMap::const_iterator mt = _ratings.seq2movie().find(kv.first);
+      assert (mt != _ratings.seq2movie().end());
+      fprintf(f, "%" PRIu64 "\t%" PRIu64 "\t%.5f\n", users[n]->id, mt->second, kv.second);
+    }
+  fclose(f);
+  
+  IDMap ids;
+  for (uint32_t n = 0; n < nusers; ++n)
+    ids[n] = users[n]->id;
+  thetas.save(_env.outfname+"/"+_env.prefix+"/foldin_htheta.tsv", ids);
+  
+  for (uint32_t n = 0; n < nusers; ++n)
+    delete users[n];
+}
+
+// Updates theta, sigma, and xi of user n with the item parameters fixed, from its training ratings and the streamed ones in extra. These are the updates of foldin_user(), started from the current values of the user, and they use the sums over items of prepare_foldin(). Returns the number of iterations.
+uint32_t
+HGAPRec::stream_user(uint32_t n, const StreamRatings &extra)
+{
+  const uint32_t max_iterations = 20;
+  const double threshold = 1e-4;
+  
+  const param_t **elogbeta = _hbeta.expected_logv().const_data();
+  const param_t **elogrho = _hrho.expected_logv().const_data();
+  const double *elogeta = _betarate.expected_logv().const_data();
+  const double **itemChar = _ratings._itemObs.const_data();
+  const double *itemScale = _ratings._itemObsScale.const_data();
+  const double *userChar = _ratings._userObs.const_data()[n];
+  const double *betarowsum = _foldin_betarowsum.const_data();
+  const double *itemsum = _foldin_itemsum.const_data();
+  const param_t *elogtheta = _htheta.expected_logv().const_data()[n];
+  const param_t *elogsigma = _hsigma.expected_logv().const_data()[n];
+  const param_t *etheta = _htheta.expected_v().const_data()[n];
+  const param_t *esigma = _hsigma.expected_v().const_data()[n];
+  double factor = _env.e/(_env.c*_env.a);
+  double xishape = _env.ap + _k*_env.a + _ic*_env.e;
+  
+  const vector<uint32_t> *movies = _ratings.users()[n];
+  uint32_t ntrain = movies ? movies->size() : 0;
+  Array stheta(_k), ssigma(_ic), rtheta(_k), rsigma(_ic), prev(_k+_ic);
+  Array phi(_k+_ic+_uc), logobs(_uc);
+  for (uint32_t m = 0; m < _uc; ++m)
+    logobs[m] = log(userChar[m]);
+  
+  uint32_t iter = 0;
+  while (iter < max_iterations) {
+    iter++;
+    // Adds y_{ui} phi_{ui} of every rating to the prior shapes
+    double elogxi = _thetarate.expected_logv()[n];
+    stheta.set_elements(_env.a);
+    ssigma.set_elements(_env.e);
+    for (uint32_t j = 0; j < ntrain + extra.size(); ++j) {
+      uint32_t i = j < ntrain ? (*movies)[j] : extra[j-ntrain].first;
+      yval_t y = j < ntrain ? _ratings.r(n,i) : extra[j-ntrain].second;
+      for (uint32_t k = 0; k < _k; ++k)
+        phi[k] = elogtheta[k] + elogbeta[i][k];
+      for (uint32_t l = 0; l < _ic; ++l)
+        phi[_k+l] = elogsigma[l] - elogeta[i] + log(itemChar[i][l]);
+      for (uint32_t m = 0; m < _uc; ++m)
+        phi[_k+_ic+m] = elogrho[i][m] - elogxi + logobs[m];
+      phi.lognormalize();
+      if (y > 1)
+        phi.scale(y);
+      for (uint32_t k = 0; k < _k; ++k)
+        stheta[k] += phi[k];
+      for (uint32_t l = 0; l < _ic; ++l)
+        ssigma[l] += phi[_k+l];
+    }
+    
+    // Rates of theta and sigma with the current xi, and then xi
+    double exi = _thetarate.expected_v()[n];
+    for (uint32_t k = 0; k < _k; ++k) {
+      rtheta[k] = exi + betarowsum[k];
+      prev[k] = etheta[k];
+    }
+    for (uint32_t l = 0; l < _ic; ++l) {
+      rsigma[l] = exi * factor * itemScale[l] + itemsum[l];
+      prev[_k+l] = esigma[l];
+    }
+    _htheta.set_row(n, stheta, rtheta);
+    _hsigma.set_row(n, ssigma, rsigma);
+    double change = .0;
+    double xirate = _env.ap/_env.bp;
+    for (uint32_t k = 0; k < _k; ++k) {
+      change = fmax(change, fabs(etheta[k] - prev[k]) / prev[k]);
+      xirate += etheta[k];
+    }
+    for (uint32_t l = 0; l < _ic; ++l) {
+      change = fmax(change, fabs(esigma[l] - prev[_k+l]) / prev[_k+l]);
+      xirate += factor * itemScale[l] * esigma[l];
+    }
+    _thetarate.set(n, xishape, xirate);
+    if (change < threshold)
+      break;
+  }
+  return iter;
+}
+
+// Updates beta, rho, and eta of item m with the user parameters fixed, from its training ratings and the streamed ones in extra (the updates of vb_hier() for one item). thetasum is the sum over users of E[theta_u], and usersum the sum of w_u E[1/xi_u].
+void
+HGAPRec::stream_item(uint32_t m, const StreamRatings &extra, const Array &thetasum, const Array &usersum)
+{
+  const param_t **elogtheta = _htheta.expected_logv().const_data();
+  const param_t **elogsigma = _hsigma.expected_logv().const_data();
+  const double *elogxi = _thetarate.expected_logv().const_data();
+  const double **userChar = _ratings._userObs.const_data();
+  const double *userScale = _ratings._userObsScale.const_data();
+  const double *itemChar = _ratings._itemObs.const_data()[m];
+  const param_t *elogbeta = _hbeta.expected_logv().const_data()[m];
+  const param_t *elogrho = _hrho.expected_logv().const_data()[m];
+  const param_t *ebeta = _hbeta.expected_v().const_data()[m];
+  const param_t *erho = _hrho.expected_v().const_data()[m];
+  double elogeta = _betarate.expected_logv()[m];
+  double factor = _env.f/(_env.c*_env.a);
+  
+  const vector<uint32_t> *users = _ratings.movies()[m];
+  uint32_t ntrain = users ? users->size() : 0;
+  Array sbeta(_k), srho(_uc), rbeta(_k), rrho(_uc);
+  Array phi(_k+_ic+_uc), logobs(_ic);
+  for (uint32_t l = 0; l < _ic; ++l)
+    logobs[l] = log(itemChar[l]);
+  
+  sbeta.set_elements(_env.c);
+  srho.set_elements(_env.f);
+  for (uint32_t j = 0; j < ntrain + extra.size(); ++j) {
+    uint32_t u = j < ntrain ? (*users)[j] : extra[j-ntrain].first;
+    yval_t y = j < ntrain ? _ratings.r(u,m) : extra[j-ntrain].second;
+    for (uint32_t k = 0; k < _k; ++k)
+      phi[k] = elogtheta[u][k] + elogbeta[k];
+    for (uint32_t l = 0; l < _ic; ++l)
+      phi[_k+l] = elogsigma[u][l] - elogeta + logobs[l];
+    for (uint32_t x = 0; x < _uc; ++x)
+      phi[_k+_ic+x] = elogrho[x] - elogxi[u] + log(userChar[u][x]);
+    phi.lognormalize();
+    if (y > 1)
+      phi.scale(y);
+    for (uint32_t k = 0; k < _k; ++k)
+      sbeta[k] += phi[k];
+    for (uint32_t x = 0; x < _uc; ++x)
+      srho[x] += phi[_k+_ic+x];
+  }
+  
+  double eeta = _betarate.expected_v()[m];
+  for (uint32_t k = 0; k < _k; ++k)
+    rbeta[k] = eeta + thetasum[k];
+  for (uint32_t x = 0; x < _uc; ++x)
+    rrho[x] = eeta * factor * userScale[x] + usersum[x];
+  _hbeta.set_row(m, sbeta, rbeta);
+  _hrho.set_row(m, srho, rrho);
+  double etarate = _env.cp/_env.dp;
+  for (uint32_t k = 0; k < _k; ++k)
+    etarate += ebeta[k];
+  for (uint32_t x = 0; x < _uc; ++x)
+    etarate += factor * userScale[x] * erho[x];
+  _betarate.set(m, _env.cp + _k*_env.c + _uc*_env.f, etarate);
+}
+
+// Publishes the parameters of the streamed model. They are written to snapshot.0 or snapshot.1 (in turns) in the output directory, and the link snapshot is then moved to them, so that whoever opens the files through the link (-load <outdir>/<prefix>/snapshot) gets a complete model.
+void
+HGAPRec::save_snapshot(uint32_t count)
+{
+  string model = _env.outfname + "/" + _env.prefix;
+  char name[32];
+  sprintf(name, "snapshot.%d", count % 2);
+  string dir = model + "/" + name;
+  mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+  mkdir((dir + "/" + _env.prefix).c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+  _hbeta.save_state(_ratings.seq2movie(), dir);
+  _hrho.save_state(_ratings.seq2movie(), dir);
+  _betarate.save_state(_ratings.seq2movie(), dir);
+  _htheta.save_state(_ratings.seq2user(), dir);
+  _hsigma.save_state(_ratings.seq2user(), dir);
+  _thetarate.save_state(_ratings.seq2user(), dir);
+  
+  string link = model + "/snapshot", tmp = model + "/snapshot.tmp";
+  unlink(tmp.c_str());
+  if (symlink((string(name) + "/" + _env.prefix).c_str(), tmp.c_str()) < 0 ||
+      rename(tmp.c_str(), link.c_str()) < 0) {
+    printf("error: cannot publish the snapshot in %s: %s\n", dir.c_str(), strerror(errno));
+    exit(-1);
+  }
+  lerr("stream: snapshot %d published in %s", count, dir.c_str());
+}
+
+// Trains on the ratings appended to the file (or FIFO) _env.stream_file, after load_model(). A reader thread parses the ratings and passes them through a queue; this thread takes them in batches and updates the users of each batch at once (stream_user()), with the item parameters fixed. The items of the streamed ratings are updated (stream_item()) once _env.staleness ratings are waiting for them, or when the stream is idle, so the item parameters that a user update reads are never more than that many ratings behind. The latency of a rating is the time from when it was read to when the scores of its user reflect it; its percentiles are taken over a uniform sample (reservoir) of a fixed number of latencies, so that memory does not grow with the stream. Every _env.snapshot seconds, and when the stream ends, the latencies are reported to infer.log and the model is published with save_snapshot(). If the stream cannot be opened, exits with an error without publishing.
+void
+HGAPRec::stream_ratings()
+{
+  const uint32_t batchsize = 4096;
+  uint32_t nthreads = _env.nthreads > 0 ? _env.nthreads : 1;
+  SpscQueue<StreamEvent> queue(1 << 16);
+  StreamReaderStats stats;
+  std::thread reader(stream_reader, _env.stream_file, (bool)_env.session, _env.stream_idle,
+                     std::ref(queue), std::ref(stats));
+  
+  // Sums over items for the user updates, and over users for the item updates, kept up to date as the rows change
+  prepare_foldin();
+  Array thetasum(_k), usersum(_uc);
+  _htheta.sum_rows(thetasum);
+  if (_uc > 0)
+    _ratings._userObs.weighted_colsum(_thetarate.expected_inv(), usersum);
+  
+  vector<StreamRatings> user_new(_n), item_new(_m);
+  vector<char> user_dirty(_n, 0), item_dirty(_m, 0);
+  vector<uint32_t> users, items;
+  vector<StreamEvent> batch;
+  vector<std::chrono::steady_clock::time_point> times;
+  // Uniform sample of the latencies since the last report, of at most reservoir of them, out of nlatencies
+  const uint32_t reservoir = 1 << 16;
+  vector<double> latencies;
+  uint64_t nlatencies = 0;
+  double maxlatency = .0;
+  vector<vector<double> > dtheta(nthreads, vector<double>(_k)), dusersum(nthreads, vector<double>(_uc));
+  vector<uint32_t> iterations(nthreads);
+  uint64_t ratings = 0, skipped = 0, pending = 0, refreshes = 0, user_updates = 0, user_iterations = 0;
+  uint32_t snapshots = 0;
+  double maxlag = .0;
+  std::chrono::steady_clock::time_point oldest, last_snapshot = std::chrono::steady_clock::now();
+  const double **userChar = _ratings._userObs.const_data();
+  const double **itemChar = _ratings._itemObs.const_data();
+  
+  // Copies the expectations of user n and item i to their augmented vectors (see build_augmented())
+  auto augment_user = [&](uint32_t n) {
+    double *uaug = _uaug.data()[n];
+    double einvxi = _thetarate.expected_inv()[n];
+    for (uint32_t k = 0; k < _k; ++k)
+      uaug[k] = _htheta.expected(n, k);
+    for (uint32_t l = 0; l < _ic; ++l)
+      uaug[_k+l] = _hsigma.expected(n, l);
+    for (uint32_t x = 0; x < _uc; ++x)
+      uaug[_k+_ic+x] = userChar[n][x] * einvxi;
+  };
+  auto augment_item = [&](uint32_t i) {
+    double *iaug = _iaug.data()[i];
+    double einveta = _betarate.expected_inv()[i];
+    for (uint32_t k = 0; k < _k; ++k)
+      iaug[k] = _hbeta.expected(i, k);
+    for (uint32_t l = 0; l < _ic; ++l)
+      iaug[_k+l] = itemChar[i][l] * einveta;
+    for (uint32_t x = 0; x < _uc; ++x)
+      iaug[_k+_ic+x] = _hrho.expected(i, x);
+    uint32_t d = _k + _ic + _uc;
+    if (_iaug_packed.size() > 0)
+      memcpy(&_iaug_packed[(size_t)i * d], iaug, d * sizeof(double));
+  };
+  
+  auto update_items = [&]() {
+    parallel_for(items.size(), nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+      for (uint32_t j = begin; j < end; ++j) {
+        stream_item(items[j], item_new[items[j]], thetasum, usersum);
+        augment_item(items[j]);
+      }
+    });
+    prepare_foldin();
+    double lag = std::chrono::duration<double>(std::chrono::steady_clock::now() - oldest).count();
+    maxlag = lag > maxlag ? lag : maxlag;
+    lerr("stream: %d items updated with %" PRIu64 " ratings, %.4f secs after the oldest", (int)items.size(), pending, lag);
+    for (uint32_t j = 0; j < items.size(); ++j)
+      item_dirty[items[j]] = 0;
+    items.clear();
+    pending = 0;
+    refreshes++;
+  };
+  
+  auto add_latency = [&](double l) {
+    if (l > maxlatency)
+      maxlatency = l;
+    if (latencies.size() < reservoir)
+      latencies.push_back(l);
+    else {
+      uint64_t j = gsl_rng_uniform_int(_r, nlatencies + 1);
+      if (j < reservoir)
+        latencies[j] = l;
+    }
+    nlatencies++;
+  };
+  
+  auto report = [&]() {
+    std::sort(latencies.begin(), latencies.end());
+    uint32_t nl = latencies.size();
+    lerr("stream: %" PRIu64 " ratings (%" PRIu64 " lines, %" PRIu64 " bad, %" PRIu64 " with unknown ids), %" PRIu64 " user updates in %.2f iterations on average, %" PRIu64 " item updates; latency of the last %" PRIu64 " (percentiles over %d of them): median %.6f, 99%% %.6f, max %.6f secs; item lag at most %.4f secs",
+         ratings, (uint64_t)stats.lines, (uint64_t)stats.bad, skipped, user_updates,
+         user_updates ? (double)user_iterations / user_updates : .0, refreshes, nlatencies, nl,
+         nl ? latencies[nl/2] : .0, nl ? latencies[(uint32_t)(0.99 * (nl - 1))] : .0,
+         maxlatency, maxlag);
+    latencies.clear();
+    nlatencies = 0;
+    maxlatency = .0;
+  };
+  
+  while (true) {
+    // The reader sets done after its last push, so the queue is empty for good if it is empty after done was seen
+    bool done = stats.done;
+    StreamEvent e;
+    batch.clear();
+    while (batch.size() < batchsize && queue.pop(e))
+      batch.push_back(e);
+    if (batch.empty()) {
+      if (done)
+        break;
+      if (pending > 0)
+        update_items();
+      usleep(1000);
+      continue;
+    }
+    
+    // Adds the ratings of known users and items to the streamed ones
+    times.clear();
+    for (uint32_t j = 0; j < batch.size(); ++j) {
+      IDMap::const_iterator ut = _ratings.user2seq().find(batch[j].user);
+      IDMap::const_iterator mt = _ratings.movie2seq().find(batch[j].item);
+      if (ut == _ratings.user2seq().end() || mt == _ratings.movie2seq().end()) {
+        skipped++;
+        continue;
+      }
+      uint32_t n = ut->second, m = mt->second;
+      user_new[n].push_back(std::make_pair(m, batch[j].y));
+      item_new[m].push_back(std::make_pair(n, batch[j].y));
+      if (!user_dirty[n]) {
+        user_dirty[n] = 1;
+        users.push_back(n);
+      }
+      if (!item_dirty[m]) {
+        item_dirty[m] = 1;
+        items.push_back(m);
+      }
+      if (pending == 0 && times.empty())
+        oldest = batch[j].t;
+      times.push_back(batch[j].t);
+    }
+    
+    // Updates the users of the batch, each thread with its own changes to the sums over users
+    parallel_for(users.size(), nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+      vector<double> &dt = dtheta[t], &du = dusersum[t];
+      for (uint32_t j = begin; j < end; ++j) {
+        uint32_t n = users[j];
+        double einvxi = _thetarate.expected_inv()[n];
+        for (uint32_t k = 0; k < _k; ++k)
+          dt[k] -= _htheta.expected(n, k);
+        iterations[t] += stream_user(n, user_new[n]);
+        for (uint32_t k = 0; k < _k; ++k)
+          dt[k] += _htheta.expected(n, k);
+        for (uint32_t x = 0; x < _uc; ++x)
+          du[x] += userChar[n][x] * (_thetarate.expected_inv()[n] - einvxi);
+        augment_user(n);
+      }
+    });
+    for (uint32_t t = 0; t < nthreads; ++t) {
+      for (uint32_t k = 0; k < _k; ++k)
+        thetasum[k] += dtheta[t][k];
+      for (uint32_t x = 0; x < _uc; ++x)
+        usersum[x] += dusersum[t][x];
+      std::fill(dtheta[t].begin(), dtheta[t].end(), .0);
+      std::fill(dusersum[t].begin(), dusersum[t].end(), .0);
+      user_iterations += iterations[t];
+      iterations[t] = 0;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (uint32_t j = 0; j < times.size(); ++j)
+      add_latency(std::chrono::duration<double>(now - times[j]).count());
+    for (uint32_t j = 0; j < users.size(); ++j)
+      user_dirty[users[j]] = 0;
+    user_updates += users.size();
+    users.clear();
+    ratings += times.size();
+    pending += times.size();
+    
+    if (pending >= _env.staleness)
+      update_items();
+    if (_env.snapshot > 0 && std::chrono::duration<double>(now - last_snapshot).count() >= _env.snapshot) {
+      report();
+      save_snapshot(++snapshots);
+      last_snapshot = std::chrono::steady_clock::now();
+    }
+  }
+  reader.join();
+  if (stats.failed) {
+    lerr("stream: cannot open %s", _env.stream_file.c_str());
+    exit(-1);
+  }
+  if (pending > 0)
+    update_items();
+  report();
+  save_snapshot(++snapshots);
+  printf("+ streamed %" PRIu64 " ratings (%" PRIu64 " with unknown users or items) from %s; model published in %s/%s/snapshot\n",
+         ratings, skipped, _env.stream_file.c_str(), _env.outfname.c_str(), _env.prefix.c_str());
+  fflush(stdout);
+}
+
+// Computes the parts of the rate of a new item that are shared by all new items. Under the prior, E[beta_ik] = c E[1/eta_i] and E[rho_im] = ca/s_m E[1/eta_i], where s_m is the scale of user characteristic m, so the rate for user u is E[1/eta] (c sum_k E[theta_uk] + E[1/xi_u] ca sum_m w_um / s_m + sum_l E[sigma_ul] x_il).
+void
+HGAPRec::prepare_coldstart()
+{
+  const double *einvxi = _thetarate.expected_inv().const_data();
+  const double **userChar = _ratings._userObs.const_data();
+  const double *userScale = _ratings._userObsScale.const_data();
+  
+  _coldstart_einveta = (_env.cp/_env.dp) / (_env.cp - 1);
+  for (uint32_t n = 0; n < _n; ++n) {
+    double s = .0, su = .0;
+    for (uint32_t k = 0; k < _k; ++k)
+      s += _htheta.expected(n, k);
+    for (uint32_t m = 0; m < _uc; ++m)
+      su += userChar[n][m] / userScale[m];
+    _coldstart_base[n] = _env.c * s + einvxi[n] * _env.c * _env.a * su;
+  }
+}
+
+// Ranks the training users for each new item in _env.coldstart_dir and writes the best ranked ones to coldstart_ranking.tsv. Threads take items in batches and score a whole batch in one pass over the users, so that each row of sigma is read once per batch.
+void
+HGAPRec::coldstart_items()
+{
+  const uint32_t batch = 16;
+  
+  FoldinItemList items;
+  if (_ratings.read_coldstart(_env.coldstart_dir, items) < 0)
+    exit(-1);
+  prepare_coldstart();
+  
+  uint32_t nitems = items.size();
+  uint32_t topn = _topN_by_user < _n ? _topN_by_user : _n;
+  MatrixKV ranking(nitems, topn);
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  parallel_for((nitems + batch - 1) / batch, _env.nthreads,
+               [&](uint32_t begin, uint32_t end, uint32_t t) {
+    // Min-heaps with the best topn users of each item in the batch
+    vector<vector<KV> > heaps(batch);
+    auto worse = [](const KV &u, const KV &v) { return u.second > v.second; };
+    for (uint32_t bt = begin; bt < end; ++bt) {
+      uint32_t first = bt * batch;
+      uint32_t nb = nitems - first < batch ? nitems - first : batch;
+      for (uint32_t b = 0; b < nb; ++b)
+        heaps[b].clear();
+      
+      for (uint32_t n = 0; n < _n; ++n) {
+        for (uint32_t b = 0; b < nb; ++b) {
+          const Array &x = items[first+b]->obs;
+          double so = .0;
+          for (uint32_t l = 0; l < _ic; ++l)
+            so += _hsigma.expected(n, l) * x[l];
+          double score = _coldstart_einveta * (_coldstart_base[n] + so);
+          vector<KV> &h = heaps[b];
+          if (h.size() < topn) {
+            h.push_back(KV(n, score));
+            std::push_heap(h.begin(), h.end(), worse);
+          } else if (score > h.front().second) {
+            std::pop_heap(h.begin(), h.end(), worse);
+            h.back() = KV(n, score);
+            std::push_heap(h.begin(), h.end(), worse);
+          }
+        }
+      }
+      
+      for (uint32_t b = 0; b < nb; ++b) {
+        std::sort_heap(heaps[b].begin(), heaps[b].end(), worse);
+        for (uint32_t j = 0; j < topn; ++j)
+          ranking.set(first+b, j, heaps[b][j]);
+      }
+    }
+  });
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  printf("+ scored %d new items for %d users in %.4f secs (%.1f items/sec, %d threads)\n",
+         nitems, _n, secs.count(), nitems / secs.count(), _env.nthreads);
+  fflush(stdout);
+  lerr("scored %d new items in %.4f secs", nitems, secs.count());
+  
+  string name = _env.outfname+"/"+_env.prefix+"/coldstart_ranking.tsv";
+  FILE *f = fopen(name.c_str(), "w");
+  if (!f)  {
+    printf("cannot open coldstart ranking file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+  for (uint32_t i = 0; i < nitems; ++i)
+    for (uint32_t j = 0; j < topn; ++j) {
+      const KV &kv = ranking.get(i, j);
+      IDMap::const_iterator it = _ratings.seq2user().find(kv.first);
+      assert (it != _ratings.seq2user().end());
+      fprintf(f, "%" PRIu64 "\t%" PRIu64 "\t%.5f\n", items[i]->id, it->second, kv.second);
+    }
+  fclose(f);
+  
+  for (uint32_t i = 0; i < nitems; ++i)
+    delete items[i];
+}
+
+// Saves the matrices in output files
+void
+HGAPRec::save_model()
+{
+  if (_env.hier) {
+    _hbeta.save_state(_ratings.seq2movie(),_env.outfname);
+    _betarate.save_state(_ratings.seq2movie(),_env.outfname);
+    _htheta.save_state(_ratings.seq2user(),_env.outfname);
+    _thetarate.save_state(_ratings.seq2user(),_env.outfname);
+    _hsigma.save_state(_ratings.seq2user(),_env.outfname);
+    _hrho.save_state(_ratings.seq2movie(),_env.outfname);
+  } else {
+    _beta.save_state(_ratings.seq2movie(),_env.outfname);
+    _theta.save_state(_ratings.seq2user(),_env.outfname);
+  }
+
+  if (_env.bias) {
+    _betabias.save_state(_ratings.seq2movie(),_env.outfname);
+    _thetabias.save_state(_ratings.seq2user(),_env.outfname);
+  }
+  if (_env.canny || _env.mle_user || _env.mle_item) {
+    _theta_mle.save(Env::file_str("/theta_mle.tsv"), _ratings.seq2user());
+    _beta_mle.save(Env::file_str("/beta_mle.tsv"), _ratings.seq2movie());
+  }
+  
+//  save_phi();
+}
+
+//void
+//HGAPRec::save_phi() {
+//  string name = string("/phi.tsv");
+//  phi.save(_env.outfname+"/"+Env::outfile_str(name));
+//}
+
+// Sums the terms of the ratings in the ELBO, with theta and beta of the flat (GPMatrixGR) or the hierarchical (GPMatrix) model
+template<class GP> double
+HGAPRec::logl_ratings(GP &theta, GP &beta)
+{
+  uint32_t x;
+  if (_env.bias)
+    x = _k+2;
+  else
+    x = _k;
+
+  Array phi(x);
+  double s = .0;
+
+  auto etheta = theta.expected_v().const_data();
+  auto ebeta = beta.expected_v().const_data();
+  auto elogtheta = theta.expected_logv().const_data();
+  auto elogbeta = beta.expected_logv().const_data();
+  const param_t  **eu = NULL;
+  const param_t  **ei = NULL; 
+  const param_t  **elogu = NULL; 
+  const param_t  **elogi = NULL; 
+
+  if (_env.bias) {
+    eu = _thetabias.expected_v().const_data();
+    ei = _betabias.expected_v().const_data();
+    elogu = _thetabias.expected_logv().const_data();
+    elogi = _betabias.expected_logv().const_data();
+  }
+
+  for (uint32_t n = 0; n < _n; ++n) {
+    const vector<uint32_t> *movies = _ratings.get_movies(n);
     for (uint32_t j = 0; j < movies->size(); ++j) {
       uint32_t m = (*movies)[j];
       yval_t y = _ratings.r(n,m);
       
-      if (_env.hier) {
-	if (!_env.bias) 
-	  get_phi(_htheta, n, _hbeta, m, phi);
-	else
-	  get_phi(_htheta, n, _hbeta, m, elogu[n][0], elogi[m][0], phi);
-      } else {
-	if (!_env.bias)
-	  get_phi(_theta, n, _beta, m, phi);
-	else
-	  get_phi(_theta, n, _beta, m, elogu[n][0], elogi[m][0], phi);
-      }
+      if (!_env.bias)
+	get_phi(theta, n, beta, m, phi);
+      else
+	get_phi(theta, n, beta, m, elogu[n][0], elogi[m][0], phi);
       if (y > 1)
 	phi.scale(y);
 
@@ -3132,6 +4416,14 @@ HGAPRec::logl()
     }
   }
 
+  return s;
+}
+
+void
+HGAPRec::logl()
+{
+  double s = !_env.hier ? logl_ratings(_theta, _beta) : logl_ratings(_htheta, _hbeta);
+
   if (!_env.hier) {
     s += _theta.compute_elbo_term();
     s += _beta.compute_elbo_term();
@@ -3241,3 +4533,860 @@ HGAPRec::test()
     lerr("%s, %s\n", _ratings.movie_name(m).c_str(), _ratings.movie_type(m).c_str());
   }
 }
+
+// Computes the top-K most similar items of every item from E[beta] (and E[rho] with -simrho), by inner product or cosine (-simcosine). Item vectors are packed into one contiguous block, and each thread scores a block of query items against a block of candidate items that fits in cache with one matrix product (blas_gemm_nt()), and then scans the tile of scores into the heaps. Saves item_neighbors.bin, a RankTable with one row per item, and item_neighbors.ids with the item ids.
+void
+HGAPRec::item_neighbors()
+{
+  const uint32_t qblock = 64;      // Query items per block
+  const uint32_t cblock = 512;     // Candidate items per block
+  
+  uint32_t d = _k + (_env.simrho ? _uc : 0);
+  uint32_t topk = _m == 0 ? 0 : _env.itemsim_k < _m - 1 ? _env.itemsim_k : _m - 1;
+  
+  vector<double> vecs((size_t)_m * d, .0);
+  for (uint32_t i = 0; i < _m; ++i) {
+    double *v = &vecs[(size_t)i * d];
+    for (uint32_t k = 0; k < _k; ++k)
+      v[k] = _hbeta.expected(i, k);
+    if (_env.simrho)
+      for (uint32_t l = 0; l < _uc; ++l)
+        v[_k+l] = _hrho.expected(i, l);
+    if (_env.simcosine) {
+      double norm = sqrt(vdot(v, v, d));
+      if (norm > 0)
+        for (uint32_t k = 0; k < d; ++k)
+          v[k] /= norm;
+    }
+  }
+  
+  string dir = _env.outfname+"/"+_env.prefix;
+  RankTable table;
+  if (table.create(dir+"/item_neighbors.bin", _m, topk) < 0) {
+    printf("cannot create item neighbors file:%s\n", strerror(errno));
+    exit(-1);
+  }
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  uint32_t nqb = (_m + qblock - 1) / qblock;
+  parallel_for(nqb, _env.nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    // Min-heaps with the best topk neighbors of each item in the query block, and the scores of a tile of query and candidate items
+    vector<vector<KV> > heaps(qblock);
+    vector<double> tile((size_t)qblock * cblock);
+    vector<RankEntry> row(topk);
+    auto worse = [](const KV &u, const KV &v) { return u.second > v.second; };
+    for (uint32_t qb = begin; qb < end; ++qb) {
+      uint32_t q0 = qb * qblock;
+      uint32_t q1 = q0 + qblock < _m ? q0 + qblock : _m;
+      for (uint32_t q = q0; q < q1; ++q)
+        heaps[q-q0].clear();
+      
+      for (uint32_t c0 = 0; c0 < _m; c0 += cblock) {
+        uint32_t c1 = c0 + cblock < _m ? c0 + cblock : _m;
+        uint32_t nc = c1 - c0;
+        blas_gemm_nt(q1 - q0, nc, d, &vecs[(size_t)q0 * d], &vecs[(size_t)c0 * d], tile.data());
+        for (uint32_t q = q0; q < q1; ++q) {
+          const double *sq = &tile[(size_t)(q - q0) * nc];
+          vector<KV> &h = heaps[q-q0];
+          for (uint32_t c = c0; c < c1; ++c) {
+            if (c == q)
+              continue;
+            double s = sq[c - c0];
+            if (h.size() < topk) {
+              h.push_back(KV(c, s));
+              std::push_heap(h.begin(), h.end(), worse);
+            } else if (s > h.front().second) {
+              std::pop_heap(h.begin(), h.end(), worse);
+              h.back() = KV(c, s);
+              std::push_heap(h.begin(), h.end(), worse);
+            }
+          }
+        }
+      }
+      
+      for (uint32_t q = q0; q < q1; ++q) {
+        vector<KV> &h = heaps[q-q0];
+        std::sort_heap(h.begin(), h.end(), worse);
+        for (uint32_t j = 0; j < h.size(); ++j) {
+          row[j].idx = h[j].first;
+          row[j].score = h[j].second;
+        }
+        if (table.write_row(q, row.data(), h.size()) < 0) {
+          printf("cannot write item neighbors file:%s\n", strerror(errno));
+          exit(-1);
+        }
+      }
+    }
+  });
+  table.close();
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  printf("+ computed %d neighbors for %d items in %.4f secs (%.1f items/sec, %d threads)\n",
+         topk, _m, secs.count(), _m / secs.count(), _env.nthreads);
+  fflush(stdout);
+  lerr("computed item neighbors in %.4f secs", secs.count());
+  
+  save_id_directory(dir+"/item_neighbors.ids", _ratings.seq2movie(), _m);
+}
+
+// Saves the ids of sequence numbers 0 to count-1 as an IdDirectory file
+void
+HGAPRec::save_id_directory(string name, const IDMap &seq2id, uint32_t count) const
+{
+  IdDirectory ids;
+  for (uint32_t i = 0; i < count; ++i) {
+    IDMap::const_iterator it = seq2id.find(i);
+    assert (it != seq2id.end());
+    ids.add(it->second);
+  }
+  if (ids.save(name) < 0) {
+    printf("cannot write id directory %s:%s\n", name.c_str(), strerror(errno));
+    exit(-1);
+  }
+}
+
+// Writes the decimal digits of v at p and returns the position after them
+static inline char *
+put_uint(char *p, uint64_t v)
+{
+  char tmp[20];
+  uint32_t n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
+
+// Writes v >= 0 with five decimals at p and returns the position after them
+static inline char *
+put_fixed5(char *p, double v)
+{
+  uint64_t f = (uint64_t)(v * 100000 + 0.5);
+  p = put_uint(p, f / 100000);
+  *p++ = '.';
+  uint32_t d = f % 100000;
+  for (int j = 4; j >= 0; --j, d /= 10)
+    p[j] = '0' + d % 10;
+  return p + 5;
+}
+
+// Reads an unsigned integer at p, skipping any spaces or tabs before it. Returns false if there is none.
+static inline bool
+get_uint(const char *&p, const char *end, uint64_t &v)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    ++p;
+  if (p == end || *p < '0' || *p > '9')
+    return false;
+  v = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    v = v * 10 + (*p++ - '0');
+  return true;
+}
+
+// Computes the rate of the Poisson r.v. for every (user id, item id) pair in the file given with -score, in the same order. The file is read in chunks, ids are looked up in the hashed id maps, and each chunk is split at line boundaries across threads that parse, score, and format their part into their own buffer. Saves pair_scores.tsv (user id, item id, rate, NA for unknown ids, and NA for all three on a line that cannot be parsed) or, with -scorebinary, pair_scores.bin with one float per line (NaN for unknown ids and lines that cannot be parsed), so that row i always belongs to line i.
+void
+HGAPRec::score_pairs()
+{
+  const size_t chunk = 1 << 24;
+  
+  FILE *inf = fopen(_env.score_file.c_str(), "r");
+  if (!inf)  {
+    printf("cannot open pairs file %s:%s\n", _env.score_file.c_str(), strerror(errno));
+    exit(-1);
+  }
+  string name = _env.outfname+"/"+_env.prefix+(_env.score_binary ? "/pair_scores.bin" : "/pair_scores.tsv");
+  FILE *outf = fopen(name.c_str(), "wb");
+  if (!outf)  {
+    printf("cannot open pair scores file:%s\n", strerror(errno));
+    exit(-1);
+  }
+  setvbuf(outf, NULL, _IOFBF, chunk);
+  
+  uint32_t nthreads = _env.nthreads > 0 ? _env.nthreads : 1;
+  vector<vector<char> > out(nthreads);
+  vector<uint64_t> npairs(nthreads, 0), nunknown(nthreads, 0), nbad(nthreads, 0);
+  vector<char> buf(chunk + 1);
+  size_t carry = 0;
+  const double **uaug = _uaug.const_data();
+  const double **iaug = _iaug.const_data();
+  uint32_t d = _k + _ic + _uc;
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  while (true) {
+    size_t len = carry + fread(&buf[carry], 1, chunk - carry, inf);
+    if (len == 0)
+      break;
+    bool last = len < chunk;
+    size_t upto = len;
+    if (!last) {
+      while (upto > 0 && buf[upto-1] != '\n')
+        --upto;
+      if (upto == 0) {
+        printf("line too long in pairs file %s\n", _env.score_file.c_str());
+        exit(-1);
+      }
+    }
+    
+    // Split [0,upto) in one piece per thread, each starting after a newline
+    vector<size_t> cut(nthreads + 1);
+    cut[0] = 0;
+    for (uint32_t t = 1; t < nthreads; ++t) {
+      size_t c = upto * t / nthreads;
+      if (c < cut[t-1])
+        c = cut[t-1];
+      while (c < upto && c > 0 && buf[c-1] != '\n')
+        ++c;
+      cut[t] = c;
+    }
+    cut[nthreads] = upto;
+    
+    parallel_for(nthreads, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+      vector<char> &o = out[t];
+      o.resize(4096);
+      size_t pos = 0;
+      const char *p = &buf[cut[t]], *e = &buf[0] + cut[t+1];
+      while (p < e) {
+        const char *eol = (const char *)memchr(p, '\n', e - p);
+        if (!eol)
+          eol = e;
+        uint64_t uid, iid;
+        if (o.size() - pos < 64)
+          o.resize(o.size() * 2);
+        if (!get_uint(p, eol, uid) || !get_uint(p, eol, iid)) {
+          // A line that cannot be parsed still gets its row, so that row i is the score of line i
+          nbad[t]++;
+          if (_env.score_binary) {
+            float f = NAN;
+            memcpy(&o[pos], &f, sizeof(f));
+            pos += sizeof(f);
+          } else {
+            memcpy(&o[pos], "NA\tNA\tNA\n", 9);
+            pos += 9;
+          }
+        } else {
+          IDIndex::const_iterator ui = _user_index.find(uid);
+          IDIndex::const_iterator ii = _item_index.find(iid);
+          bool known = ui != _user_index.end() && ii != _item_index.end();
+          double s = known ? vdot(uaug[ui->second], iaug[ii->second], d) : .0;
+          if (!known)
+            nunknown[t]++;
+          npairs[t]++;
+          if (_env.score_binary) {
+            float f = known ? (float)s : NAN;
+            memcpy(&o[pos], &f, sizeof(f));
+            pos += sizeof(f);
+          } else {
+            char *q = &o[pos];
+            q = put_uint(q, uid);
+            *q++ = '\t';
+            q = put_uint(q, iid);
+            *q++ = '\t';
+            if (known)
+              q = put_fixed5(q, s);
+            else {
+              *q++ = 'N';
+              *q++ = 'A';
+            }
+            *q++ = '\n';
+            pos = q - &o[0];
+          }
+        }
+        p = eol + 1;
+      }
+      o.resize(pos);
+    });
+    for (uint32_t t = 0; t < nthreads; ++t)
+      fwrite(out[t].data(), 1, out[t].size(), outf);
+    
+    if (last)
+      break;
+    carry = len - upto;
+    memmove(&buf[0], &buf[upto], carry);
+  }
+  fclose(inf);
+  fclose(outf);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  
+  uint64_t tot = 0, unknown = 0, bad = 0;
+  for (uint32_t t = 0; t < nthreads; ++t) {
+    tot += npairs[t];
+    unknown += nunknown[t];
+    bad += nbad[t];
+  }
+  printf("+ scored %" PRIu64 " pairs (%" PRIu64 " with unknown ids, %" PRIu64 " lines that could not be parsed) in %.4f secs (%.1f pairs/sec, %d threads)\n",
+         tot, unknown, bad, secs.count(), tot / secs.count(), nthreads);
+  fflush(stdout);
+  lerr("scored %" PRIu64 " pairs in %.4f secs, %" PRIu64 " lines could not be parsed", tot, secs.count(), bad);
+}
+
+// Interns a set of available items, given by their ids, and returns a handle for topn_candidates(). Unknown ids are dropped, and equal sets get the same handle. Not thread safe.
+uint32_t
+HGAPRec::intern_candidates(const uint64_t *ids, uint32_t n)
+{
+  vector<uint32_t> set;
+  set.reserve(n);
+  for (uint32_t j = 0; j < n; ++j) {
+    IDIndex::const_iterator it = _item_index.find(ids[j]);
+    if (it != _item_index.end())
+      set.push_back(it->second);
+  }
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+  
+  std::map<vector<uint32_t>, uint32_t>::const_iterator it = _candset_index.find(set);
+  if (it != _candset_index.end())
+    return it->second;
+  uint32_t handle = _candsets.size();
+  _candsets.push_back(set);
+  _candset_index[set] = handle;
+  return handle;
+}
+
+// Ranks the items of an interned candidate set for a user. Only the candidates are scored, by gathering their augmented vectors, so the cost is proportional to the size of the set. Saves the best topn (item sequence number, rate) pairs, best first, in ranking.
+void
+HGAPRec::topn_candidates(uint32_t user, uint32_t set, uint32_t topn, vector<KV> &ranking) const
+{
+  const vector<uint32_t> &cands = _candsets[set];
+  const double *uaug = _uaug.const_data()[user];
+  const double **iaug = _iaug.const_data();
+  uint32_t d = _k + _ic + _uc;
+  auto worse = [](const KV &u, const KV &v) { return u.second > v.second; };
+  
+  ranking.clear();
+  for (uint32_t j = 0; j < cands.size(); ++j) {
+    double s = vdot(uaug, iaug[cands[j]], d);
+    if (ranking.size() < topn) {
+      ranking.push_back(KV(cands[j], s));
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    } else if (s > ranking.front().second) {
+      std::pop_heap(ranking.begin(), ranking.end(), worse);
+      ranking.back() = KV(cands[j], s);
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    }
+  }
+  std::sort_heap(ranking.begin(), ranking.end(), worse);
+}
+
+// Ranks the items with the given ids for a user, without interning them
+void
+HGAPRec::topn_candidates(uint32_t user, const uint64_t *ids, uint32_t n, uint32_t topn, vector<KV> &ranking) const
+{
+  const double *uaug = _uaug.const_data()[user];
+  const double **iaug = _iaug.const_data();
+  uint32_t d = _k + _ic + _uc;
+  auto worse = [](const KV &u, const KV &v) { return u.second > v.second; };
+  
+  ranking.clear();
+  for (uint32_t j = 0; j < n; ++j) {
+    IDIndex::const_iterator it = _item_index.find(ids[j]);
+    if (it == _item_index.end())
+      continue;
+    double s = vdot(uaug, iaug[it->second], d);
+    if (ranking.size() < topn) {
+      ranking.push_back(KV(it->second, s));
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    } else if (s > ranking.front().second) {
+      std::pop_heap(ranking.begin(), ranking.end(), worse);
+      ranking.back() = KV(it->second, s);
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    }
+  }
+  std::sort_heap(ranking.begin(), ranking.end(), worse);
+}
+
+// Ranks the available items for every (user id, session id) pair in the file given with -sessions. The available items of each pair come from the availability callback and are interned, so sessions with the same availability share one candidate set. Saves session_ranking.tsv (user id, session id, item id, rate).
+void
+HGAPRec::session_rankings()
+{
+  FILE *f = fopen(_env.sessions_file.c_str(), "r");
+  if (!f)  {
+    printf("cannot open sessions file %s:%s\n", _env.sessions_file.c_str(), strerror(errno));
+    exit(-1);
+  }
+  vector<std::pair<uint64_t, uint64_t> > queries;
+  vector<uint32_t> users, sets;
+  std::map<std::pair<uint64_t, uint64_t>, uint32_t> interned;
+  uint64_t uid, sid;
+  uint32_t unknown = 0;
+  while (fscanf(f, "%" SCNu64 "\t%" SCNu64 "%*[^\n]\n", &uid, &sid) == 2) {
+    IDIndex::const_iterator it = _user_index.find(uid);
+    if (it == _user_index.end()) {
+      unknown++;
+      continue;
+    }
+    std::pair<uint64_t, uint64_t> q(uid, sid);
+    std::map<std::pair<uint64_t, uint64_t>, uint32_t>::const_iterator qi = interned.find(q);
+    uint32_t set;
+    if (qi != interned.end())
+      set = qi->second;
+    else {
+      uint32_t navail = 0;
+      uint64_t *avail = _ratings.available_items(uid, sid, navail);
+      set = intern_candidates(avail, navail);
+      delete[] avail;
+      interned[q] = set;
+    }
+    queries.push_back(q);
+    users.push_back(it->second);
+    sets.push_back(set);
+  }
+  fclose(f);
+  
+  uint32_t nq = queries.size();
+  vector<vector<KV> > rankings(nq);
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  parallel_for(nq, _env.nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    for (uint32_t q = begin; q < end; ++q)
+      topn_candidates(users[q], sets[q], _topN_by_user, rankings[q]);
+  });
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  printf("+ ranked %d sessions (%d with unknown users, %d distinct candidate sets) in %.4f secs (%.1f sessions/sec, %d threads)\n",
+         nq, unknown, (uint32_t)_candsets.size(), secs.count(), nq / secs.count(), _env.nthreads);
+  fflush(stdout);
+  lerr("ranked %d sessions in %.4f secs", nq, secs.count());
+  
+  string name = _env.outfname+"/"+_env.prefix+"/session_ranking.tsv";
+  FILE *outf = fopen(name.c_str(), "w");
+  if (!outf)  {
+    printf("cannot open session ranking file:%s\n", strerror(errno));
+    exit(-1);
+  }
+  for (uint32_t q = 0; q < nq; ++q)
+    for (uint32_t j = 0; j < rankings[q].size(); ++j) {
+      IDMap::const_iterator it = _ratings.seq2movie().find(rankings[q][j].first);
+      assert (it != _ratings.seq2movie().end());
+      fprintf(outf, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.5f\n",
+              queries[q].first, queries[q].second, it->second, rankings[q][j].second);
+    }
+  fclose(outf);
+}
+
+// Ranks all items for user n, leaving out the items in the training data, and saves the best topn (item sequence number, rate) pairs, best first, in ranking. stamp has one entry per item and is used to mark the training items; it must start at zero and be reused for users in increasing order.
+void
+HGAPRec::rank_items(uint32_t n, uint32_t topn, vector<uint32_t> &stamp, vector<KV> &ranking) const
+{
+  const vector<uint32_t> *rated = _ratings.users()[n];
+  if (rated)
+    for (uint32_t j = 0; j < rated->size(); ++j)
+      stamp[(*rated)[j]] = n + 1;
+  
+  const double *uaug = _uaug.const_data()[n];
+  const double **iaug = _iaug.const_data();
+  uint32_t d = _k + _ic + _uc;
+  auto worse = [](const KV &u, const KV &v) { return u.second > v.second; };
+  
+  ranking.clear();
+  for (uint32_t m = 0; m < _m; ++m) {
+    if (stamp[m] == n + 1)
+      continue;
+    double s = vdot(uaug, iaug[m], d);
+    if (ranking.size() < topn) {
+      ranking.push_back(KV(m, s));
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    } else if (s > ranking.front().second) {
+      std::pop_heap(ranking.begin(), ranking.end(), worse);
+      ranking.back() = KV(m, s);
+      std::push_heap(ranking.begin(), ranking.end(), worse);
+    }
+  }
+  std::sort_heap(ranking.begin(), ranking.end(), worse);
+}
+
+// Computes the top-N items of every training user, leaving out the items in the training data, and saves them as user_topn.bin, a RankTable with one row per user sequence number, with the id directories user_topn_users.ids and user_topn_items.ids. RankIndex in ranktable.hh serves lookups by user id from these files.
+void
+HGAPRec::user_topn_table()
+{
+  uint32_t topn = _env.topn_table < _m ? _env.topn_table : _m;
+  string dir = _env.outfname+"/"+_env.prefix;
+  RankTable table;
+  if (table.create(dir+"/user_topn.bin", _n, topn) < 0) {
+    printf("cannot create top-N table file:%s\n", strerror(errno));
+    exit(-1);
+  }
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  parallel_for(_n, _env.nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    vector<uint32_t> stamp(_m, 0);
+    vector<KV> ranking;
+    vector<RankEntry> row(topn);
+    for (uint32_t n = begin; n < end; ++n) {
+      rank_items(n, topn, stamp, ranking);
+      for (uint32_t j = 0; j < ranking.size(); ++j) {
+        row[j].idx = ranking[j].first;
+        row[j].score = ranking[j].second;
+      }
+      if (table.write_row(n, row.data(), ranking.size()) < 0) {
+        printf("cannot write top-N table file:%s\n", strerror(errno));
+        exit(-1);
+      }
+    }
+  });
+  table.close();
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  printf("+ computed top %d items for %d users in %.4f secs (%.1f users/sec, %d threads)\n",
+         topn, _n, secs.count(), _n / secs.count(), _env.nthreads);
+  fflush(stdout);
+  lerr("computed top-N table in %.4f secs", secs.count());
+  
+  save_id_directory(dir+"/user_topn_users.ids", _ratings.seq2user(), _n);
+  save_id_directory(dir+"/user_topn_items.ids", _ratings.seq2movie(), _m);
+}
+
+// Ranks all items for every training user, leaving out the items in the training data, and exports the best N (-exportranking) to the directory ranking_export. Each thread ranks a contiguous block of users and writes its own shard file through a large buffer, resolving ids through arrays indexed by sequence number. manifest.tsv lists, for each shard, its file name, first and last user sequence numbers, and number of lines.
+void
+HGAPRec::export_rankings()
+{
+  const size_t bufsize = 1 << 22;
+  uint32_t topn = _env.export_topn < _m ? _env.export_topn : _m;
+  string dir = _env.outfname+"/"+_env.prefix+"/ranking_export";
+  mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+  
+  vector<uint64_t> user_ids(_n), item_ids(_m);
+  for (IDMap::const_iterator it = _ratings.seq2user().begin(); it != _ratings.seq2user().end(); ++it)
+    if (it->first < _n)
+      user_ids[it->first] = it->second;
+  for (IDMap::const_iterator it = _ratings.seq2movie().begin(); it != _ratings.seq2movie().end(); ++it)
+    if (it->first < _m)
+      item_ids[it->first] = it->second;
+  
+  uint32_t nthreads = _env.nthreads < 1 ? 1 : (_env.nthreads > _n ? _n : _env.nthreads);
+  vector<uint32_t> first(nthreads, 0), last(nthreads, 0);
+  vector<uint64_t> lines(nthreads, 0);
+  
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  parallel_for(_n, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    char name[32];
+    sprintf(name, "/shard-%03d.tsv", t);
+    FILE *f = fopen((dir+name).c_str(), "w");
+    if (!f)  {
+      printf("cannot open ranking shard file:%s\n", strerror(errno));
+      exit(-1);
+    }
+    vector<char> buf(bufsize);
+    size_t pos = 0;
+    vector<uint32_t> stamp(_m, 0);
+    vector<KV> ranking;
+    first[t] = begin;
+    last[t] = end > begin ? end - 1 : begin;
+    for (uint32_t n = begin; n < end; ++n) {
+      rank_items(n, topn, stamp, ranking);
+      for (uint32_t j = 0; j < ranking.size(); ++j) {
+        if (bufsize - pos < 64) {
+          fwrite(&buf[0], 1, pos, f);
+          pos = 0;
+        }
+        char *q = &buf[pos];
+        q = put_uint(q, user_ids[n]);
+        *q++ = '\t';
+        q = put_uint(q, item_ids[ranking[j].first]);
+        *q++ = '\t';
+        q = put_fixed5(q, ranking[j].second);
+        *q++ = '\n';
+        pos = q - &buf[0];
+      }
+      lines[t] += ranking.size();
+    }
+    fwrite(&buf[0], 1, pos, f);
+    fclose(f);
+  });
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+  
+  FILE *mf = fopen((dir+"/manifest.tsv").c_str(), "w");
+  if (!mf)  {
+    printf("cannot open ranking manifest file:%s\n", strerror(errno));
+    exit(-1);
+  }
+  uint64_t total = 0;
+  for (uint32_t t = 0; t < nthreads; ++t) {
+    fprintf(mf, "shard-%03d.tsv\t%d\t%d\t%" PRIu64 "\n", t, first[t], last[t], lines[t]);
+    total += lines[t];
+  }
+  fclose(mf);
+  
+  printf("+ exported top %d items for %d users (%" PRIu64 " lines, %d shards) in %.4f secs (%.1f users/sec)\n",
+         topn, _n, total, nthreads, secs.count(), _n / secs.count());
+  fflush(stdout);
+  lerr("exported rankings in %.4f secs", secs.count());
+}
+
+// Sorts the ratings into tiles for the -tiled sweep. Users are split in blocks, and the ratings of a block are sorted by item block and then by user, so that a tile touches the rows of one block of users and one block of items. Block sizes are chosen so that the expected logs and next shapes of the rows in a tile take about 1MB. The ratings keep their values, so the sweep does not look them up.
+void
+HGAPRec::build_tiles()
+{
+  const uint32_t half_cache = 1 << 19;
+  _tile_users = half_cache / (16 * (_k + _ic + 1));
+  _tile_items = half_cache / (16 * (_k + _uc + 1));
+  if (_tile_users < 64)
+    _tile_users = 64;
+  if (_tile_items < 64)
+    _tile_items = 64;
+  
+  uint32_t nblocks = (_n + _tile_users - 1) / _tile_users;
+  _tiled.clear();
+  _tiled.reserve(_user_offsets[_n] - _n);
+  _tile_offsets.assign(nblocks + 1, 0);
+  uint32_t tile_items = _tile_items;
+  for (uint32_t b = 0; b < nblocks; ++b) {
+    uint32_t nlast = (b + 1) * _tile_users < _n ? (b + 1) * _tile_users : _n;
+    size_t first = _tiled.size();
+    for (uint32_t n = b * _tile_users; n < nlast; ++n) {
+      const vector<uint32_t> *movies = _ratings.users()[n];
+      for (uint32_t j = 0; movies && j < movies->size(); ++j) {
+        TiledRating r;
+        r.n = n;
+        r.m = (*movies)[j];
+        r.y = _ratings.r(n, r.m);
+        _tiled.push_back(r);
+      }
+    }
+    std::sort(_tiled.begin() + first, _tiled.end(),
+              [tile_items](const TiledRating &u, const TiledRating &v) {
+                uint32_t bu = u.m / tile_items, bv = v.m / tile_items;
+                if (bu != bv)
+                  return bu < bv;
+                return u.n < v.n || (u.n == v.n && u.m < v.m);
+              });
+    _tile_offsets[b+1] = _tiled.size();
+  }
+  printf("+ tiled %d ratings in blocks of %d users and %d items\n",
+         (uint32_t)_tiled.size(), _tile_users, _tile_items);
+  lerr("tiled %d ratings in blocks of %d users and %d items",
+       (uint32_t)_tiled.size(), _tile_users, _tile_items);
+}
+
+// Pins the threads and moves the rows of the parameters to the NUMA node of the thread that starts with them in the sweeps: users as in the user sweep and items as in the item pass. On machines with several nodes, also makes a copy of the expected log of beta on each node, which every thread reads in the user sweep, if the copies take less than a quarter of the free memory.
+void
+HGAPRec::place_parameters(uint32_t nthreads)
+{
+  pin_threads() = true;
+  balanced_blocks(_n, nthreads, _user_offsets.data(), _user_blocks);
+  balanced_blocks(_m, nthreads, NULL, _item_blocks);
+  parallel_for(nthreads, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+    _htheta.move_rows(_user_blocks[t], _user_blocks[t+1]);
+    _hsigma.move_rows(_user_blocks[t], _user_blocks[t+1]);
+    _hbeta.move_rows(_item_blocks[t], _item_blocks[t+1]);
+    _hrho.move_rows(_item_blocks[t], _item_blocks[t+1]);
+  });
+  
+  uint32_t nodes = numa_nodes();
+  if (nodes > 1 && _k > 0) {
+    double bytes = (double)nodes * _m * _k * sizeof(param_t);
+    double avail = (double)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (bytes < avail / 4) {
+      // The copy of a node is allocated by the first thread on it
+      _elogbeta_copies.assign(nodes, (ParamMatrix *)NULL);
+      parallel_for(nthreads, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+        uint32_t j = cpu_node(thread_cpu(t));
+        for (uint32_t u = 0; u < t; ++u)
+          if (cpu_node(thread_cpu(u)) == j)
+            return;
+        _elogbeta_copies[j] = new ParamMatrix(_m, _k);
+      });
+    } else
+      lerr("no copies of the expected log of beta: %.0f MB needed, %.0f MB free",
+           bytes / (1 << 20), avail / (1 << 20));
+  }
+  numa_report(nthreads);
+}
+
+// Copies the expected log of beta to the copy on each node
+void
+HGAPRec::copy_elogbeta()
+{
+  const param_t **elogbeta = _hbeta.expected_logv().const_data();
+  for (uint32_t j = 0; j < _elogbeta_copies.size(); ++j) {
+    if (!_elogbeta_copies[j])
+      continue;
+    param_t **d = _elogbeta_copies[j]->data();
+    for (uint32_t m = 0; m < _m; ++m)
+      memcpy(d[m], elogbeta[m], sizeof(param_t) * _k);
+  }
+}
+
+// Copies the current shapes and rates of theta, sigma, beta, rho, xi, and eta, in this order, to x, or from x if restore, and then computes their expectations
+void
+HGAPRec::vb_state(vector<double> &x, bool restore)
+{
+  uint64_t p = 0;
+  auto rows = [&](ParamMatrix &v) {
+    param_t **d = v.data();
+    for (uint32_t i = 0; i < v.m(); ++i)
+      for (uint32_t k = 0; k < v.n(); ++k, ++p)
+        if (restore)
+          d[i][k] = x[p];
+        else
+          x[p] = d[i][k];
+  };
+  auto array = [&](Array &v) {
+    double *d = v.data();
+    for (uint32_t i = 0; i < v.size(); ++i, ++p)
+      if (restore)
+        d[i] = x[p];
+      else
+        x[p] = d[i];
+  };
+  if (!restore)
+    x.resize(2 * ((uint64_t)_n * (_k + _ic) + (uint64_t)_m * (_k + _uc) + _n + _m));
+  GPMatrix *g[4] = { &_htheta, &_hsigma, &_hbeta, &_hrho };
+  for (uint32_t j = 0; j < 4; ++j) {
+    rows(g[j]->shape_curr());
+    rows(g[j]->rate_curr());
+  }
+  array(_thetarate.shape_curr());
+  array(_thetarate.rate_curr());
+  array(_betarate.shape_curr());
+  array(_betarate.rate_curr());
+  assert(p == x.size());
+  if (restore) {
+    for (uint32_t j = 0; j < 4; ++j)
+      g[j]->compute_expectations();
+    _thetarate.compute_expectations();
+    _betarate.compute_expectations();
+  }
+}
+
+// Returns the ELBO of the current parameters without sessions, given logl, the sum over ratings of y log sum_j exp(log phi_j) from the sweep (up to the log factorials of the ratings)
+double
+HGAPRec::vb_elbo(double logl)
+{
+  // Sum over all users and items of the expected rate
+  Array thetasum(_k), betasum(_k), sigmasum(_ic), rhosum(_uc), itemsum(_ic), usersum(_uc);
+  _htheta.sum_rows(thetasum);
+  _hbeta.sum_rows(betasum);
+  _hsigma.sum_rows(sigmasum);
+  _hrho.sum_rows(rhosum);
+  _ratings._itemObs.weighted_colsum(_betarate.expected_inv(), itemsum);
+  _ratings._userObs.weighted_colsum(_thetarate.expected_inv(), usersum);
+  double rate = .0;
+  for (uint32_t k = 0; k < _k; ++k)
+    rate += thetasum[k] * betasum[k];
+  for (uint32_t l = 0; l < _ic; ++l)
+    rate += sigmasum[l] * itemsum[l];
+  for (uint32_t l = 0; l < _uc; ++l)
+    rate += usersum[l] * rhosum[l];
+  
+  double s = logl - rate;
+  s += _htheta.compute_elbo_term();
+  s += _hbeta.compute_elbo_term();
+  s += _thetarate.compute_elbo_term();
+  s += _betarate.compute_elbo_term();
+  
+  // Terms of sigma and rho, whose prior rates are the expected values of xi and eta times factor and the scale of each characteristic
+  auto scaled_terms = [&](GPMatrix &g, const Array &ev, const Array &elogv, double factor, const Array &scale) {
+    const param_t **shape = g.shape_curr().const_data();
+    const param_t **rate = g.rate_curr().const_data();
+    const param_t **elog = g.expected_logv().const_data();
+    double a0 = g.sprior(), t = .0;
+    for (uint32_t i = 0; i < g.n(); ++i)
+      for (uint32_t l = 0; l < g.k(); ++l) {
+        double r = factor * scale[l], a = shape[i][l], b = rate[i][l], e = g.expected(i, l);
+        t += a0 * (log(r) + elogv[i]) + (a0 - 1) * elog[i][l] - r * ev[i] * e - gsl_sf_lngamma(a0);
+        t -= a * log(b) + (a - 1) * elog[i][l] - b * e - gsl_sf_lngamma(a);
+      }
+    return t;
+  };
+  s += scaled_terms(_hsigma, _thetarate.expected_v(), _thetarate.expected_logv(),
+                    _env.e / (_env.c * _env.a), _ratings._itemObsScale);
+  s += scaled_terms(_hrho, _betarate.expected_v(), _betarate.expected_logv(),
+                    _env.f / (_env.c * _env.a), _ratings._userObsScale);
+  return s;
+}
+
+// Prints and logs, for each parameter, the share of rows whose pages are on the node of the thread that updates them (local) or on another node (remote), and where the copies of the expected log of beta are. Rows whose node the kernel does not report are counted as unknown.
+void
+HGAPRec::numa_report(uint32_t nthreads)
+{
+  uint32_t nodes = numa_nodes();
+  printf("+ numa: %d nodes, %d threads pinned\n", nodes, nthreads);
+  lerr("numa: %d nodes, %d threads pinned", nodes, nthreads);
+  
+  auto report = [&](GPMatrix &g, const vector<uint32_t> &blocks) {
+    uint64_t local = 0, remote = 0, unknown = 0;
+    const param_t **ev = g.expected_logv().const_data();
+    const param_t **shape = g.shape_curr().const_data();
+    for (uint32_t t = 0; t < nthreads; ++t) {
+      int node = cpu_node(thread_cpu(t));
+      for (uint32_t r = blocks[t]; r < blocks[t+1]; ++r) {
+        const param_t *rows[2] = { ev[r], shape[r] };
+        for (uint32_t i = 0; i < 2; ++i) {
+          int p = page_node(rows[i]);
+          if (p < 0)
+            unknown++;
+          else if (p == node)
+            local++;
+          else
+            remote++;
+        }
+      }
+    }
+    uint64_t tot = local + remote + unknown;
+    printf("+ numa: %s rows %.1f%% local, %.1f%% remote, %.1f%% unknown\n", g.name().c_str(),
+           tot ? 100.0 * local / tot : .0, tot ? 100.0 * remote / tot : .0,
+           tot ? 100.0 * unknown / tot : .0);
+    lerr("numa: %s rows %" PRIu64 " local, %" PRIu64 " remote, %" PRIu64 " unknown",
+         g.name().c_str(), local, remote, unknown);
+  };
+  report(_htheta, _user_blocks);
+  report(_hsigma, _user_blocks);
+  report(_hbeta, _item_blocks);
+  report(_hrho, _item_blocks);
+  
+  for (uint32_t j = 0; j < _elogbeta_copies.size(); ++j) {
+    if (!_elogbeta_copies[j])
+      continue;
+    const param_t **d = _elogbeta_copies[j]->const_data();
+    uint64_t local = 0;
+    for (uint32_t m = 0; m < _m; ++m)
+      if (page_node(d[m]) == (int)j)
+        local++;
+    printf("+ numa: copy of the expected log of hbeta on node %d, %.1f%% of rows local\n",
+           j, _m ? 100.0 * local / _m : .0);
+    lerr("numa: copy of the expected log of hbeta on node %d, %" PRIu64 " of %d rows local",
+         j, local, _m);
+  }
+}
+
+// Logs the memory of the parameters and of the buffers of the sweeps, and what the parameters would take without -lowmem
+void
+HGAPRec::memory_report(uint32_t nthreads)
+{
+  const double mb = 1024.0 * 1024.0;
+  uint64_t params = 0, full = 0;
+  auto report = [&](const GPMatrix &g) {
+    uint64_t b = g.bytes(g.lowmem());
+    params += b;
+    full += g.bytes(false);
+    lerr("memory: %s %.1f MB (%.1f MB without -lowmem)", g.name().c_str(),
+         b / mb, g.bytes(false) / mb);
+  };
+  report(_htheta);
+  report(_hsigma);
+  report(_hbeta);
+  report(_hrho);
+  
+  uint64_t aug = ((uint64_t)_n + _m) * (_k + _ic + _uc) * sizeof(double);
+#ifdef HAVE_CBLAS
+  aug += (uint64_t)_m * (_k + _ic + _uc) * sizeof(double);
+#endif
+  uint64_t sweep = _env.twopass ? 0 : (uint64_t)(nthreads - 1) * _m * (_k + _uc) * sizeof(param_t);
+  uint64_t tiles = _tiled.size() * sizeof(TiledRating);
+  const uint32_t perline = 64 / sizeof(param_t);
+  uint64_t packed = _env.packed ? ((uint64_t)_n + _m) * ((_k + _ic + _uc + 1 + perline - 1) / perline * perline) * sizeof(param_t) : 0;
+  uint64_t copies = 0;
+  for (uint32_t j = 0; j < _elogbeta_copies.size(); ++j)
+    if (_elogbeta_copies[j])
+      copies += (uint64_t)_m * _k * sizeof(param_t);
+  lerr("memory: augmented vectors %.1f MB, thread buffers %.1f MB, tiles %.1f MB, copies of hbeta %.1f MB, packed rows %.1f MB",
+       aug / mb, sweep / mb, tiles / mb, copies / mb, packed / mb);
+  
+  uint64_t total = params + aug + sweep + tiles + copies + packed;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("+ memory: parameters %.1f MB (%.1f MB without -lowmem), total %.1f MB, max resident %.1f MB\n",
+         params / mb, full / mb, total / mb, ru.ru_maxrss / 1024.0);
+  lerr("memory: parameters %.1f MB, %.1f MB without -lowmem, total %.1f MB, max resident %.1f MB",
+       params / mb, full / mb, total / mb, ru.ru_maxrss / 1024.0);
+}
@@ -4,6 +4,17 @@
 #include "env.hh"
 #include "ratings.hh"
 #include "gpbase.hh"
+#include <unordered_map>
+
+typedef std::unordered_map<uint64_t, uint32_t> IDIndex;
+typedef vector<std::pair<uint32_t, yval_t> > StreamRatings; // Streamed ratings of a user (by item) or of an item (by user)
+
+// A rating in the tiled order of the sweep
+struct TiledRating {
+  uint32_t n;
+  uint32_t m;
+  yval_t y;
+};
 
 class HGAPRec {
 public:
@@ -28,6 +39,22 @@ public:
     void gen_ranking_for_users(bool load_model_state);
     void gen_msr_csv();
     
+    void load_model(string dir);
+    void foldin_users();
+    void stream_ratings();
+    uint32_t foldin_user(const FoldinUser &u, Array &etheta, Array &esigma, double &einvxi) const;
+    void foldin_scores(const Array &obs, const Array &etheta, const Array &esigma, double einvxi, Array &scores) const;
+    void coldstart_items();
+    void item_neighbors();
+    void score_pairs();
+    
+    uint32_t intern_candidates(const uint64_t *ids, uint32_t n);
+    void topn_candidates(uint32_t user, uint32_t set, uint32_t topn, vector<KV> &ranking) const;
+    void topn_candidates(uint32_t user, const uint64_t *ids, uint32_t n, uint32_t topn, vector<KV> &ranking) const;
+    void session_rankings();
+    void user_topn_table();
+    void export_rankings();
+    
     double compute_rmse();
     double compute_itemrank(bool final);
     
@@ -53,14 +80,14 @@ private:
     
     void get_phi(GPBase<Matrix> &theta, uint32_t ai, GPBase<Matrix> &beta, uint32_t bi, GPBase<Matrix> &sigma, GPBase<Matrix> &rho, uint32_t ic, uint32_t uc, Array &phi);
     
-    void get_phi(GPMatrix &theta, uint32_t ai, GPMatrix &beta, uint32_t bi, GPMatrix &sigma, GPMatrix &rho, GPArray &xi, GPArray &eta, uint32_t ic, uint32_t uc, Array &phi);
+    void get_phi(GPMatrix &theta, uint32_t ai, GPMatrix &beta, uint32_t bi, GPMatrix &sigma, GPMatrix &rho, GPArray &xi, GPArray &eta, uint32_t ic, uint32_t uc, Array &phi, const param_t **elogbeta = NULL);
     
     void get_phi(GPMatrix &theta, uint32_t u, GPMatrix &beta, uint32_t i, Array &phi);
     
     void get_phi(uint32_t u, uint32_t i, GPMatrix &sigma, GPMatrix &rho, GPArray &xi, GPArray &eta, uint32_t ic, uint32_t uc, Array &phi);
     
-    void get_phi(GPBase<Matrix> &a, uint32_t ai,
-                 GPBase<Matrix> &b, uint32_t bi,
+    template<class GP> void get_phi(GP &a, uint32_t ai,
+                 GP &b, uint32_t bi,
                  double biasa, double biasb,
                  Array &phi);
     void get_phi(Matrix &a, uint32_t ai,
@@ -81,15 +108,35 @@ private:
     
     double prediction_score(uint32_t user, uint32_t movie) const;
     double prediction_score_hier(uint32_t user, uint32_t movie) const;
+    double hier_score(uint32_t user, uint32_t movie, double s) const;
+    void score_users(const uint32_t *users, uint32_t nu, double *scores) const;
+    void score_next_block(UserMap::const_iterator itr, vector<uint32_t> &block, vector<double> &scores) const;
     double prediction_score_nmf(uint32_t user, uint32_t movie) const;
     double prediction_score_lda(uint32_t user, uint32_t movie) const;
     double prediction_score_chi(uint32_t user, uint32_t movie) const;
     double prediction_score_ctr(uint32_t user, uint32_t movie) const;
     
     void load_beta_and_theta();
+    void prepare_foldin();
+    void prepare_coldstart();
+    void build_augmented();
+    void build_tiles();
+    void place_parameters(uint32_t nthreads);
+    void copy_elogbeta();
+    void warm_start(string dir, vector<char> &user_affected, vector<char> &item_affected);
+    uint32_t stream_user(uint32_t n, const StreamRatings &extra);
+    void stream_item(uint32_t m, const StreamRatings &extra, const Array &thetasum, const Array &usersum);
+    void save_snapshot(uint32_t count);
+    void vb_state(vector<double> &x, bool restore);
+    double vb_elbo(double logl);
+    void numa_report(uint32_t nthreads);
+    void memory_report(uint32_t nthreads);
+    void rank_items(uint32_t n, uint32_t topn, vector<uint32_t> &stamp, vector<KV> &ranking) const;
+    void save_id_directory(string name, const IDMap &seq2id, uint32_t count) const;
     void save_model();
     void save_phi();
     void logl();
+    template<class GP> double logl_ratings(GP &theta, GP &beta);
     
     double rating_likelihood(uint32_t p, uint32_t q, yval_t y) const;
     double rating_likelihood_hier(uint32_t p, uint32_t q, yval_t y) const;
@@ -123,6 +170,32 @@ private:
     GPArray _thetarate;
     GPArray _betarate;
     
+    Matrix _uaug;             // Augmented user vectors [E theta_u, E sigma_u, w_u E[1/xi_u]]
+    Matrix _iaug;             // Augmented item vectors [E beta_i, x_i E[1/eta_i], E rho_i]
+    vector<double> _iaug_packed; // _iaug in one block by rows, with CBLAS
+    
+    Array _foldin_betarowsum; // Sums over items of E[beta], fixed during fold-in
+    Array _foldin_itemsum;    // Sums over items of x_il E[1/eta_i], fixed during fold-in
+    Array _coldstart_base;    // Part of the rate of a new item for each user that does not depend on its observables
+    double _coldstart_einveta; // E[1/eta] under the prior
+    
+    vector<uint64_t> _user_offsets; // Offsets of the ratings of each user (plus one per user), to balance the sweeps
+    vector<uint64_t> _item_offsets; // Offsets of the ratings of each item (plus one per item)
+    
+    vector<TiledRating> _tiled;     // Ratings sorted in tiles, with -tiled
+    vector<uint64_t> _tile_offsets; // Offsets in _tiled of each block of users
+    uint32_t _tile_users;           // Users per block
+    uint32_t _tile_items;           // Items per block
+    
+    vector<uint32_t> _user_blocks;  // First user of each thread, with -numa
+    vector<uint32_t> _item_blocks;  // First item of each thread, with -numa
+    vector<ParamMatrix *> _elogbeta_copies; // Copy of the expected log of beta on each NUMA node, with -numa
+    
+    IDIndex _user_index;      // User id to sequence number
+    IDIndex _item_index;      // Item id to sequence number
+    vector<vector<uint32_t> > _candsets;        // Interned candidate item sets, as sorted sequence numbers
+    std::map<vector<uint32_t>, uint32_t> _candset_index; // Candidate set to its handle
+    
     Matrix _theta_mle;
     Matrix _beta_mle;
     Matrix _old_theta_mle;
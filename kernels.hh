@@ -0,0 +1,49 @@
+#ifndef KERNELS_HH
+#define KERNELS_HH
+
+#include <stdint.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Returns the dot product of the n-vectors a and b. Uses AVX (with FMA if available) or SSE2 when the compiler targets them, with two accumulators to hide the latency of the additions.
+inline double
+vdot(const double *a, const double *b, uint32_t n)
+{
+  uint32_t i = 0;
+  double s = .0;
+#if defined(__AVX__)
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  for (; i + 8 <= n; i += 8) {
+#ifdef __FMA__
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a+i+4), _mm256_loadu_pd(b+i+4), s1);
+#else
+    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i)));
+    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a+i+4), _mm256_loadu_pd(b+i+4)));
+#endif
+  }
+  if (i + 4 <= n) {
+    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i)));
+    i += 4;
+  }
+  s0 = _mm256_add_pd(s0, s1);
+  __m128d h = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+  h = _mm_add_sd(h, _mm_unpackhi_pd(h, h));
+  s = _mm_cvtsd_f64(h);
+#elif defined(__SSE2__)
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a+i), _mm_loadu_pd(b+i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a+i+2), _mm_loadu_pd(b+i+2)));
+  }
+  s0 = _mm_add_pd(s0, s1);
+  s0 = _mm_add_sd(s0, _mm_unpackhi_pd(s0, s0));
+  s = _mm_cvtsd_f64(s0);
+#endif
+  for (; i < n; ++i)
+    s += a[i] * b[i];
+  return s;
+}
+
+#endif
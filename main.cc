@@ -126,6 +126,40 @@ int main(int argc, char **argv) {
   bool session = false;   // If the train, validation, and test set contain a column for the session
   bool fitpriors = false; // Fit the prior values of bp and dp so that under the priors the rate of the Poisson r.v. fits the average rating
   
+  string model_location = "";   // Directory of a trained model to load instead of running vb_hier()
+  string foldin_dir = "";       // Directory with new users to fold in
+  string coldstart_dir = "";    // Directory with new items to score
+  uint32_t nthreads = 1;
+  uint32_t itemsim_k = 0;       // Neighbors per item in the item similarity table
+  bool simcosine = false;
+  bool simrho = false;
+  string score_file = "";       // File with (user id, item id) pairs to score
+  bool score_binary = false;
+  string sessions_file = "";    // File with (user id, session id) pairs to rank
+  uint32_t topn_table = 0;      // Items per user in the materialized top-N table
+  uint32_t export_topn = 0;     // Items per user in the full ranking export
+  bool twopass = false;         // Item-side shapes in a second pass over items
+  bool tiled = false;           // Sweep the ratings in cache-sized tiles
+  bool counters = false;        // Log cache counters of the sweep
+  int reorder = 0;              // Renumber users and items after loading
+  bool pin = false;             // Pin threads to CPUs
+  bool numa = false;            // NUMA placement of the parameters
+  bool lowmem = false;          // Low-memory training
+  bool packed = false;          // Packed rows of expected logs for the sweep
+  uint32_t phitop = 0;          // Components kept by truncated phi
+  double phimass = 0;           // Mass dropped by truncated phi
+  string phiref = "";           // Validation likelihoods of a run with exact phi
+  double activeset = 0;         // Change below which users and items are frozen
+  uint32_t reactivate = 10;     // Iterations between reactivations of the frozen
+  bool squarem = false;         // Extrapolation of the parameters
+  string warmstart_dir = "";    // Previous model to start from
+  string newratings = "";       // Ratings added since the previous model
+  uint32_t localsweeps = 0;     // Iterations on the affected users and items only
+  string stream_file = "";      // Ratings to train on as they arrive
+  uint32_t staleness = 1000;    // Streamed ratings between updates of their items
+  double snapshot = 0;          // Seconds between snapshots of the streamed model
+  double stream_idle = 0;       // Seconds after which an idle streamed file ends
+  
   // Parse parameters
   while (i <= argc - 1) {
     if (strcmp(argv[i], "-dir") == 0) {
@@ -192,6 +226,137 @@ int main(int argc, char **argv) {
       session = true;
     } else if (strcmp(argv[i], "-fpriors") == 0) {
       fitpriors = true;
+    } else if (strcmp(argv[i], "-load") == 0) {
+      model_location = string(argv[++i]);
+      fprintf(stdout, "+ model dir = %s\n", model_location.c_str());
+    } else if (strcmp(argv[i], "-foldin") == 0) {
+      foldin_dir = string(argv[++i]);
+      fprintf(stdout, "+ fold-in dir = %s\n", foldin_dir.c_str());
+    } else if (strcmp(argv[i], "-coldstart") == 0) {
+      coldstart_dir = string(argv[++i]);
+      fprintf(stdout, "+ cold-start dir = %s\n", coldstart_dir.c_str());
+    } else if (strcmp(argv[i], "-nthreads") == 0) {
+      nthreads = atoi(argv[++i]);
+      fprintf(stdout, "+ threads = %d\n", nthreads);
+    } else if (strcmp(argv[i], "-itemsim") == 0) {
+      itemsim_k = atoi(argv[++i]);
+      fprintf(stdout, "+ item neighbors = %d\n", itemsim_k);
+    } else if (strcmp(argv[i], "-simcosine") == 0) {
+      simcosine = true;
+    } else if (strcmp(argv[i], "-simrho") == 0) {
+      simrho = true;
+    } else if (strcmp(argv[i], "-score") == 0) {
+      score_file = string(argv[++i]);
+      fprintf(stdout, "+ pairs file = %s\n", score_file.c_str());
+    } else if (strcmp(argv[i], "-scorebinary") == 0) {
+      score_binary = true;
+    } else if (strcmp(argv[i], "-sessions") == 0) {
+      sessions_file = string(argv[++i]);
+      fprintf(stdout, "+ sessions file = %s\n", sessions_file.c_str());
+    } else if (strcmp(argv[i], "-topntable") == 0) {
+      topn_table = atoi(argv[++i]);
+      fprintf(stdout, "+ top-N table size = %d\n", topn_table);
+    } else if (strcmp(argv[i], "-exportranking") == 0) {
+      export_topn = atoi(argv[++i]);
+      fprintf(stdout, "+ ranking export size = %d\n", export_topn);
+    } else if (strcmp(argv[i], "-twopass") == 0) {
+      twopass = true;
+    } else if (strcmp(argv[i], "-tiled") == 0) {
+      tiled = true;
+    } else if (strcmp(argv[i], "-counters") == 0) {
+      counters = true;
+    } else if (strcmp(argv[i], "-reorder") == 0) {
+      ++i;
+      if (strcmp(argv[i], "degree") == 0)
+        reorder = Env::DEGREE;
+      else if (strcmp(argv[i], "rcm") == 0)
+        reorder = Env::RCM;
+      else {
+        printf("error: unknown order %s (degree or rcm)\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-pin") == 0) {
+      pin = true;
+    } else if (strcmp(argv[i], "-numa") == 0) {
+      numa = true;
+    } else if (strcmp(argv[i], "-lowmem") == 0) {
+      lowmem = true;
+    } else if (strcmp(argv[i], "-packed") == 0) {
+      packed = true;
+    } else if (strcmp(argv[i], "-phitop") == 0) {
+      int v = atoi(argv[++i]);
+      if (v < 1) {
+        printf("error: -phitop must be at least 1\n");
+        exit(-1);
+      }
+      phitop = v;
+      fprintf(stdout, "+ phi truncated to %d components\n", phitop);
+    } else if (strcmp(argv[i], "-phimass") == 0) {
+      phimass = atof(argv[++i]);
+      if (phimass <= 0 || phimass >= 1) {
+        printf("error: -phimass must be between 0 and 1\n");
+        exit(-1);
+      }
+      fprintf(stdout, "+ phi truncated to drop at most %f of its mass\n", phimass);
+    } else if (strcmp(argv[i], "-phiref") == 0) {
+      phiref = string(argv[++i]);
+      fprintf(stdout, "+ truncated phi compared with the validation likelihoods in %s\n", phiref.c_str());
+    } else if (strcmp(argv[i], "-activeset") == 0) {
+      activeset = atof(argv[++i]);
+      if (activeset <= 0) {
+        printf("error: -activeset must be positive\n");
+        exit(-1);
+      }
+      fprintf(stdout, "+ users and items that change less than %f are frozen\n", activeset);
+    } else if (strcmp(argv[i], "-reactivate") == 0) {
+      int v = atoi(argv[++i]);
+      if (v < 1) {
+        printf("error: -reactivate must be at least 1\n");
+        exit(-1);
+      }
+      reactivate = v;
+      fprintf(stdout, "+ frozen users and items reactivated every %d iterations\n", reactivate);
+    } else if (strcmp(argv[i], "-squarem") == 0) {
+      squarem = true;
+    } else if (strcmp(argv[i], "-warmstart") == 0) {
+      warmstart_dir = string(argv[++i]);
+      fprintf(stdout, "+ warm start from %s\n", warmstart_dir.c_str());
+    } else if (strcmp(argv[i], "-newratings") == 0) {
+      newratings = string(argv[++i]);
+      fprintf(stdout, "+ new ratings in %s\n", newratings.c_str());
+    } else if (strcmp(argv[i], "-localsweeps") == 0) {
+      int v = atoi(argv[++i]);
+      if (v < 0) {
+        printf("error: -localsweeps must not be negative\n");
+        exit(-1);
+      }
+      localsweeps = v;
+      fprintf(stdout, "+ %d iterations on the affected users and items first\n", localsweeps);
+    } else if (strcmp(argv[i], "-stream") == 0) {
+      stream_file = string(argv[++i]);
+      fprintf(stdout, "+ streaming ratings from %s\n", stream_file.c_str());
+    } else if (strcmp(argv[i], "-staleness") == 0) {
+      int v = atoi(argv[++i]);
+      if (v < 1) {
+        printf("error: -staleness must be positive\n");
+        exit(-1);
+      }
+      staleness = v;
+      fprintf(stdout, "+ items updated every %d streamed ratings\n", staleness);
+    } else if (strcmp(argv[i], "-snapshot") == 0) {
+      snapshot = atof(argv[++i]);
+      if (snapshot < 0) {
+        printf("error: -snapshot must not be negative\n");
+        exit(-1);
+      }
+      fprintf(stdout, "+ snapshot of the streamed model every %f seconds\n", snapshot);
+    } else if (strcmp(argv[i], "-stream-idle") == 0) {
+      stream_idle = atof(argv[++i]);
+      if (stream_idle < 0) {
+        printf("error: -stream-idle must not be negative\n");
+        exit(-1);
+      }
+      fprintf(stdout, "+ streamed file ends after %f idle seconds\n", stream_idle);
     } else if (i > 0) {
       fprintf(stdout,  "error: unknown option %s\n", argv[i]);
       assert(0);
@@ -202,10 +367,117 @@ int main(int argc, char **argv) {
   if ( outfname.compare("") == 0 ) {
     outfname = fname;
   }
+  
+  // Low-memory mode needs the same rates for all rows, up to a scalar, and is only for training
+  if (lowmem && (session || lfirst || model_location != "")) {
+    printf("error: -lowmem cannot be used with -session, -lfirst, or -load\n");
+    exit(-1);
+  }
+  // The active set keeps rows of the parameters, which low-memory mode does not store
+  if (activeset > 0 && lowmem) {
+    printf("error: -activeset cannot be used with -lowmem\n");
+    exit(-1);
+  }
+  // A warm start loads the rows of the parameters, which low-memory mode does not store
+  if (warmstart_dir != "" && (lowmem || model_location != "")) {
+    printf("error: -warmstart cannot be used with -lowmem or -load\n");
+    exit(-1);
+  }
+  if ((newratings != "" || localsweeps > 0) && warmstart_dir == "") {
+    printf("error: -newratings and -localsweeps need -warmstart\n");
+    exit(-1);
+  }
+  // New items are scored with E[1/eta] under the prior, which only exists for cp > 1
+  if (coldstart_dir != "" && cp <= 1) {
+    printf("error: -coldstart needs -cp greater than 1\n");
+    exit(-1);
+  }
+  if (phiref != "" && phitop == 0 && phimass == 0) {
+    printf("error: -phiref needs -phitop or -phimass\n");
+    exit(-1);
+  }
+  // Streaming updates the rows of a loaded model
+  if (stream_file != "" && model_location == "") {
+    printf("error: -stream needs -load\n");
+    exit(-1);
+  }
+  // The extrapolation needs the ELBO of all the ratings, which it computes without sessions
+  if (squarem && (lowmem || session || activeset > 0)) {
+    printf("error: -squarem cannot be used with -lowmem, -session, or -activeset\n");
+    exit(-1);
+  }
     
   // Initializes the environment: variables to run the code
   Env env(n, m, k, uc, ic, fname, outfname, rfreq, rand_seed, max_iterations, a, ap, bp, c, cp, dp, e, f, offset, scale, scaleFactor, lfirst, ofirst, session, fitpriors);
   env_global = &env;
+  env.model_load = model_location != "";
+  env.model_location = model_location;
+  env.foldin_dir = foldin_dir;
+  env.coldstart_dir = coldstart_dir;
+  env.nthreads = nthreads;
+  env.itemsim_k = itemsim_k;
+  env.simcosine = simcosine;
+  env.simrho = simrho;
+  env.score_file = score_file;
+  env.score_binary = score_binary;
+  env.sessions_file = sessions_file;
+  env.topn_table = topn_table;
+  env.export_topn = export_topn;
+  env.twopass = twopass;
+  env.tiled = tiled;
+  env.counters = counters;
+  env.reorder = reorder;
+  env.pin = pin;
+  env.numa = numa;
+  env.lowmem = lowmem;
+  env.packed = packed;
+  env.phitop = phitop;
+  env.phimass = phimass;
+  env.phiref = phiref;
+  env.activeset = activeset;
+  env.reactivate = reactivate;
+  env.squarem = squarem;
+  env.warmstart_dir = warmstart_dir;
+  env.newratings = newratings;
+  env.localsweeps = localsweeps;
+  env.stream_file = stream_file;
+  env.staleness = staleness;
+  env.snapshot = snapshot;
+  env.stream_idle = stream_idle;
+  Env::plog("model_location", model_location);
+  Env::plog("foldin_dir", foldin_dir);
+  Env::plog("coldstart_dir", coldstart_dir);
+  Env::plog("nthreads", nthreads);
+  Env::plog("itemsim_k", itemsim_k);
+  Env::plog("simcosine", simcosine);
+  Env::plog("simrho", simrho);
+  Env::plog("score_file", score_file);
+  Env::plog("score_binary", score_binary);
+  Env::plog("sessions_file", sessions_file);
+  Env::plog("topn_table", topn_table);
+  Env::plog("export_topn", export_topn);
+  Env::plog("twopass", twopass);
+  Env::plog("tiled", tiled);
+  Env::plog("counters", counters);
+  Env::plog("reorder", reorder);
+  Env::plog("pin", pin);
+  Env::plog("numa", numa);
+  Env::plog("lowmem", lowmem);
+  Env::plog("packed", packed);
+  Env::plog("phitop", phitop);
+  Env::plog("phimass", phimass);
+  Env::plog("phiref", phiref);
+  Env::plog("activeset", activeset);
+  Env::plog("reactivate", reactivate);
+  Env::plog("squarem", squarem);
+  Env::plog("warmstart_dir", warmstart_dir);
+  Env::plog("newratings", newratings);
+  Env::plog("localsweeps", localsweeps);
+  Env::plog("stream_file", stream_file);
+  Env::plog("staleness", staleness);
+  Env::plog("snapshot", snapshot);
+  Env::plog("stream_idle", stream_idle);
+  Env::plog("param_bytes", (int)sizeof(param_t));
  
   // Reads the input files
   Ratings ratings(env, &getAvailableItems);
@@ -219,6 +491,8 @@ int main(int argc, char **argv) {
   ratings.readValidationAndTest(fname.c_str());
   cout << "Observed" << endl; 
   ratings.readObserved(fname.c_str());
+  if (env.reorder)
+    ratings.reorder(env.reorder);
 
   //
   if (fitpriors) {
@@ -239,8 +513,48 @@ int main(int argc, char **argv) {
   
   moment t1 = now();
   
-  cout << "Running vb_hier()" << endl;
-  hgaprec.vb_hier();
+  if (env.model_load) {
+    cout << "Loading model" << endl;
+    hgaprec.load_model(env.model_location);
+    // After training, the table and the export are written by do_on_stop()
+    if (env.topn_table > 0)
+      hgaprec.user_topn_table();
+    if (env.export_topn > 0)
+      hgaprec.export_rankings();
+  } else {
+    cout << "Running vb_hier()" << endl;
+    hgaprec.vb_hier();
+  }
+  
+  if (env.stream_file != "") {
+    cout << "Streaming ratings" << endl;
+    hgaprec.stream_ratings();
+  }
+  
+  if (env.foldin_dir != "") {
+    cout << "Folding in new users" << endl;
+    hgaprec.foldin_users();
+  }
+  
+  if (env.coldstart_dir != "") {
+    cout << "Scoring new items" << endl;
+    hgaprec.coldstart_items();
+  }
+  
+  if (env.itemsim_k > 0) {
+    cout << "Computing item neighbors" << endl;
+    hgaprec.item_neighbors();
+  }
+  
+  if (env.score_file != "") {
+    cout << "Scoring pairs" << endl;
+    hgaprec.score_pairs();
+  }
+  
+  if (env.sessions_file != "") {
+    cout << "Ranking available items for sessions" << endl;
+    hgaprec.session_rankings();
+  }
   cout << "Finally Done!\n";
   
   moment t2 = now();
@@ -3,6 +3,7 @@
 
 #include <list>
 #include <utility>
+#include <algorithm>
 
 #include <assert.h>
 #include <math.h>
@@ -15,6 +16,7 @@
 #include <string.h>
 
 #include "log.hh"
+#include "blas.hh"
 
 #define SQR(x) (x * x)
 
@@ -95,6 +97,7 @@ public:
     
     void sort();
     void sort_by_value();
+    void sort_by_value(uint32_t top);
     
     //  void print();
     
@@ -280,6 +283,18 @@ D1Array<KV>::sort_by_value()
     qsort(_data, _n, sizeof(KV), cmppairval);
 }
 
+// Sorts only the first top entries by descending value; the rest are left in unspecified order
+template<> inline void
+D1Array<KV>::sort_by_value(uint32_t top)
+{
+    if (top >= _n) {
+        sort_by_value();
+        return;
+    }
+    std::partial_sort(_data, _data + top, _data + _n,
+                      [](const KV &u, const KV &v) { return u.second > v.second; });
+}
+
 template<> inline void
 D1Array<RatingV>::sort_by_value()
 {
@@ -992,6 +1007,7 @@ public:
     void reset(D2Array<T> &u);
     void reset();
     void swap(D2Array<T> &u);
+    void move_rows(uint32_t begin, uint32_t end);
     
     string s() const;
     
@@ -1028,7 +1044,7 @@ _m(m), _n(n)
     for (uint32_t i = 0; i < m; ++i) {
         _data[i] = new T[n];
         if (zero)
-            memset(_data[i], 0, sizeof(T)*n);
+            std::fill(_data[i], _data[i] + n, T());
     }
 }
 
@@ -1154,6 +1170,19 @@ D2Array<T>::swap(D2Array<T> &u)
     u._data = d;
 }
 
+// Copies rows [begin, end) to new memory allocated by the calling thread, so that on a NUMA machine their pages are first touched on its node
+template<class T> inline void
+D2Array<T>::move_rows(uint32_t begin, uint32_t end)
+{
+    assert (begin <= end && end <= _m);
+    for (uint32_t i = begin; i < end; ++i) {
+        T *row = new T[_n];
+        memcpy(row, _data[i], sizeof(T)*_n);
+        delete[] _data[i];
+        _data[i] = row;
+    }
+}
+
 template<class T> inline void
 D2Array<T>::zero()
 {
@@ -1456,8 +1485,6 @@ D2Array<double>::load(string name,
     char *line = (char *)malloc(sz);
     uint32_t l = 0, skipped = 0;
     while (!feof(f)) {
-        printf("%s\n", line);
-        fflush(stdout);
         if (fgets(line, sz, f) == NULL)
             break;
         if (l < skiprows) { //skip header, if any (e.g., vowpal wabbit output)
@@ -1506,6 +1533,32 @@ D2Array<double>::load(string name,
     free(line);
 }
 
+// Float matrices are saved and loaded in the same text format, through a double copy
+template<> inline void
+D2Array<float>::save(string name, const IDMap &m) const
+{
+    D2Array<double> d(_m, _n);
+    double **dd = d.data();
+    for (uint32_t i = 0; i < _m; ++i)
+        for (uint32_t k = 0; k < _n; ++k)
+            dd[i][k] = _data[i][k];
+    d.save(name, m);
+}
+
+template<> inline void
+D2Array<float>::load(string name,
+                     uint32_t skipcols,
+                     bool transpose,
+                     uint32_t skiprows) const
+{
+    D2Array<double> d(_m, _n);
+    d.load(name, skipcols, transpose, skiprows);
+    const double **dd = d.const_data();
+    for (uint32_t i = 0; i < _m; ++i)
+        for (uint32_t k = 0; k < _n; ++k)
+            _data[i][k] = dd[i][k];
+}
+
 template<> inline void
 D2Array<double>::mm_load_rowmajor(string name) const
 {
@@ -1912,6 +1965,20 @@ D2Array<T>::weighted_colsum(D1Array<T> & w, D1Array<T> & s) const {
     }
 }
 
+#ifdef HAVE_CBLAS
+// Adds the rows times their weights, which reads the matrix by rows
+template<> inline void
+D2Array<double>::weighted_colsum(D1Array<double> & w, D1Array<double> & s) const {
+    
+    assert(s.size() == _n);
+    assert(w.size() == _m);
+    
+    s.zero();
+    for (uint32_t j = 0; j < _m; ++j)
+        blas_axpy(_n, w.get(j), _data[j], s.data());
+}
+#endif
+
 // Sums by columns (with inverse weights passed as a parameter) and saves them in s
 template<class T> inline void
 D2Array<T>::inv_weighted_colsum(D1Array<T> & invw, D1Array<T> & s) const {
@@ -0,0 +1,60 @@
+#ifndef NUMA_HH
+#define NUMA_HH
+
+// NUMA topology from /sys and the node of a page from move_pages(2), so that no
+// libnuma is needed. Without Linux (or on a machine with one node) everything is on
+// node 0, and page_node() returns -1 where the kernel cannot tell.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Returns the number of NUMA nodes
+inline uint32_t
+numa_nodes()
+{
+  uint32_t n = 0;
+  char buf[128];
+  while (true) {
+    sprintf(buf, "/sys/devices/system/node/node%d", n);
+    if (access(buf, F_OK) != 0)
+      break;
+    n++;
+  }
+  return n > 0 ? n : 1;
+}
+
+// Returns the node of a CPU
+inline uint32_t
+cpu_node(uint32_t cpu)
+{
+  char buf[128];
+  uint32_t nodes = numa_nodes();
+  for (uint32_t j = 0; j < nodes; ++j) {
+    sprintf(buf, "/sys/devices/system/cpu/cpu%d/node%d", cpu, j);
+    if (access(buf, F_OK) == 0)
+      return j;
+  }
+  return 0;
+}
+
+// Returns the node of the page that holds p, or -1 if it is not known
+inline int
+page_node(const void *p)
+{
+#if defined(__linux__) && defined(__NR_move_pages)
+  long pagesize = sysconf(_SC_PAGESIZE);
+  void *page = (void *)((uintptr_t)p & ~(uintptr_t)(pagesize - 1));
+  int status = -1;
+  if (syscall(__NR_move_pages, 0, 1, &page, NULL, &status, 0) != 0 || status < 0)
+    return -1;
+  return status;
+#else
+  return -1;
+#endif
+}
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef PARALLEL_HH
+#define PARALLEL_HH
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Whether the threads of parallel_for() and parallel_for_balanced() are pinned to CPUs
+inline bool &
+pin_threads()
+{
+  static bool pin = false;
+  return pin;
+}
+
+// Allocates the elements of a std::vector at the start of a cache line, for per-thread counters declared alignas(64), which new does not align before C++17
+template<class T>
+struct CacheAlignedAllocator {
+  typedef T value_type;
+  CacheAlignedAllocator() { }
+  template<class U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &) { }
+  T *allocate(size_t n)
+  {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return (T *)p;
+  }
+  void deallocate(T *p, size_t) { free(p); }
+};
+template<class T, class U> bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return true; }
+template<class T, class U> bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return false; }
+
+// Returns the CPU of thread t when threads are pinned
+inline uint32_t
+thread_cpu(uint32_t t)
+{
+  uint32_t ncpus = std::thread::hardware_concurrency();
+  return ncpus > 0 ? t % ncpus : 0;
+}
+
+// Pins the calling thread to the CPU of thread t, if pinning is on
+inline void
+pin_thread(uint32_t t)
+{
+#ifdef __linux__
+  if (!pin_threads())
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(thread_cpu(t), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Pins the calling thread to the CPU of thread t, if pinning is on, for as long as it is in scope, and then gives the thread back the CPUs it had before. The calling thread runs thread 0 of parallel_for() and parallel_for_balanced(), and must not stay pinned after they return.
+class ScopedPin {
+public:
+  ScopedPin(uint32_t t): _restore(false)
+  {
+#ifdef __linux__
+    if (!pin_threads())
+      return;
+    _restore = pthread_getaffinity_np(pthread_self(), sizeof(_saved), &_saved) == 0;
+    pin_thread(t);
+#endif
+  }
+  ~ScopedPin()
+  {
+#ifdef __linux__
+    if (_restore)
+      pthread_setaffinity_np(pthread_self(), sizeof(_saved), &_saved);
+#endif
+  }
+
+private:
+  bool _restore;
+#ifdef __linux__
+  cpu_set_t _saved;
+#endif
+};
+
+// Worker threads kept alive across the parallel loops, so that a loop wakes them instead of creating and joining threads on every call. Worker i runs thread i+1 of every loop and is pinned once, on the first loop after pinning is turned on; thread 0 runs on the calling thread. The pool is never destroyed, so that exit() from any thread does not have to join the workers.
+class ThreadPool {
+public:
+  static ThreadPool &get()
+  {
+    static ThreadPool *pool = new ThreadPool;
+    return *pool;
+  }
+
+  // Runs job(t) for t in [0,nthreads) and returns when all have finished. A loop started from inside another one, or while another thread runs one, gets its own threads.
+  void run(uint32_t nthreads, const std::function<void(uint32_t)> &job)
+  {
+    if (nthreads <= 1) {
+      job(0);
+      return;
+    }
+    if (in_worker() || !_run.try_lock()) {
+      std::vector<std::thread> threads;
+      for (uint32_t t = 1; t < nthreads; ++t)
+        threads.push_back(std::thread([&job](uint32_t t) {
+              pin_thread(t);
+              job(t);
+            }, t));
+      {
+        ScopedPin pin(0);
+        job(0);
+      }
+      for (uint32_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_workers.size() < nthreads - 1)
+        _workers.push_back(std::thread(&ThreadPool::work, this, (uint32_t)_workers.size(), _generation));
+      _job = &job;
+      _njobs = nthreads;
+      _pending = nthreads - 1;
+      _generation++;
+    }
+    _start.notify_all();
+    {
+      ScopedPin pin(0);
+      job(0);
+    }
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_pending > 0)
+        _done.wait(lock);
+    }
+    _run.unlock();
+  }
+
+private:
+  ThreadPool(): _job(NULL), _njobs(0), _pending(0), _generation(0) { }
+
+  static bool &in_worker()
+  {
+    static thread_local bool w = false;
+    return w;
+  }
+
+  // Waits for each loop, and runs thread i+1 of those that have one for it
+  void work(uint32_t i, uint64_t seen)
+  {
+    in_worker() = true;
+    bool pinned = false;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      while (_generation == seen)
+        _start.wait(lock);
+      seen = _generation;
+      if (i + 1 >= _njobs)
+        continue;
+      const std::function<void(uint32_t)> *job = _job;
+      lock.unlock();
+      if (pin_threads() && !pinned) {
+        pin_thread(i + 1);
+        pinned = true;
+      }
+      (*job)(i + 1);
+      lock.lock();
+      if (--_pending == 0)
+        _done.notify_one();
+    }
+  }
+
+  std::mutex _run;            // Held by the loop that is using the workers
+  std::mutex _mutex;          // Guards the fields below
+  std::condition_variable _start, _done;
+  std::vector<std::thread> _workers;
+  const std::function<void(uint32_t)> *_job;
+  uint32_t _njobs;
+  uint32_t _pending;          // Workers of the current loop that have not finished
+  uint64_t _generation;       // Number of loops started
+};
+
+// Splits the range [0,n) into one contiguous block per thread and runs f(begin, end, thread) on each block. Thread 0 is the calling thread, which is pinned only until the call returns.
+inline void
+parallel_for(uint32_t n, uint32_t nthreads,
+             const std::function<void(uint32_t, uint32_t, uint32_t)> &f)
+{
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > n)
+    nthreads = n > 0 ? n : 1;
+  if (nthreads == 1) {
+    f(0, n, 0);
+    return;
+  }
+
+  uint32_t chunk = n / nthreads, extra = n % nthreads;
+  ThreadPool::get().run(nthreads, [&](uint32_t t) {
+      uint32_t begin = t * chunk + (t < extra ? t : extra);
+      f(begin, begin + chunk + (t < extra ? 1 : 0), t);
+    });
+}
+
+// Range of chunks [head, tail) owned by one thread, packed in one word so that the owner can take chunks from the head and other threads can steal them from the tail without locks
+struct ChunkRange {
+  std::atomic<uint64_t> v;
+  char pad[56];       // Keeps the ranges of different threads in different cache lines
+
+  void set(uint32_t head, uint32_t tail) { v.store(((uint64_t)head << 32) | tail); }
+  uint32_t size() const
+  {
+    uint64_t w = v.load();
+    uint32_t head = w >> 32, tail = (uint32_t)w;
+    return head < tail ? tail - head : 0;
+  }
+  // Takes the first chunk into c; returns false if there is none left
+  bool take(uint32_t &c)
+  {
+    uint64_t w = v.load();
+    while (true) {
+      uint32_t head = w >> 32, tail = (uint32_t)w;
+      if (head >= tail)
+        return false;
+      if (v.compare_exchange_weak(w, ((uint64_t)(head + 1) << 32) | tail)) {
+        c = head;
+        return true;
+      }
+    }
+  }
+  // Takes the last chunk into c; returns false if there is none left
+  bool steal(uint32_t &c)
+  {
+    uint64_t w = v.load();
+    while (true) {
+      uint32_t head = w >> 32, tail = (uint32_t)w;
+      if (head >= tail)
+        return false;
+      if (v.compare_exchange_weak(w, ((uint64_t)head << 32) | (tail - 1))) {
+        c = tail - 1;
+        return true;
+      }
+    }
+  }
+};
+
+// Cuts [0,n) into about grain chunks per thread of equal work, as parallel_for_balanced() does, and saves the chunk boundaries in cuts
+inline void
+balanced_cuts(uint32_t n, uint32_t nthreads, const uint64_t *offsets, uint32_t grain,
+              std::vector<uint32_t> &cuts)
+{
+  uint64_t total = offsets ? offsets[n] - offsets[0] : n;
+  uint64_t target = total / ((uint64_t)nthreads * grain);
+  if (target < 1)
+    target = 1;
+  cuts.assign(1, 0);
+  uint64_t acc = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    acc += offsets ? offsets[i+1] - offsets[i] : 1;
+    if (acc >= target && i + 1 < n) {
+      cuts.push_back(i + 1);
+      acc = 0;
+    }
+  }
+  cuts.push_back(n);
+}
+
+// Saves in bounds the nthreads+1 boundaries of the blocks that the threads of parallel_for_balanced() start with, before any stealing. Thread t starts with [bounds[t], bounds[t+1]).
+inline void
+balanced_blocks(uint32_t n, uint32_t nthreads, const uint64_t *offsets,
+                std::vector<uint32_t> &bounds, uint32_t grain = 16)
+{
+  if (nthreads < 1)
+    nthreads = 1;
+  bounds.assign(nthreads + 1, n);
+  bounds[0] = 0;
+  if (nthreads == 1 || n == 0)
+    return;
+  std::vector<uint32_t> cuts;
+  balanced_cuts(n, nthreads, offsets, grain, cuts);
+  uint32_t nchunks = cuts.size() - 1;
+  for (uint32_t t = 0; t < nthreads; ++t)
+    bounds[t] = cuts[(uint64_t)nchunks * t / nthreads];
+}
+
+// Runs f(begin, end, thread) over [0,n) with work stealing. offsets has n+1 entries, and offsets[i+1]-offsets[i] is the work of element i (for instance, CSR offsets of the ratings of each user); with no offsets every element has the same work. The range is cut into about grain chunks per thread of equal work, each thread starts with a contiguous block of chunks, and threads that run out steal chunks from the end of the block of the thread with the most left. If busy is given, it saves the seconds each thread spent running f. Thread 0 is the calling thread, which is pinned only until the call returns.
+inline void
+parallel_for_balanced(uint32_t n, uint32_t nthreads, const uint64_t *offsets,
+                      const std::function<void(uint32_t, uint32_t, uint32_t)> &f,
+                      std::vector<double> *busy = NULL, uint32_t grain = 16)
+{
+  if (nthreads < 1)
+    nthreads = 1;
+  if (busy)
+    busy->assign(nthreads, .0);
+  if (n == 0)
+    return;
+  if (nthreads == 1) {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    f(0, n, 0);
+    if (busy)
+      (*busy)[0] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return;
+  }
+
+  std::vector<uint32_t> cuts;
+  balanced_cuts(n, nthreads, offsets, grain, cuts);
+  uint32_t nchunks = cuts.size() - 1;
+
+  std::vector<ChunkRange> ranges(nthreads);
+  for (uint32_t t = 0; t < nthreads; ++t)
+    ranges[t].set((uint64_t)nchunks * t / nthreads, (uint64_t)nchunks * (t + 1) / nthreads);
+
+  auto worker = [&](uint32_t t) {
+    std::chrono::duration<double> b(0);
+    uint32_t c;
+    while (true) {
+      if (!ranges[t].take(c)) {
+        // Steals from the thread with the most chunks left
+        uint32_t victim = t, most = 0;
+        for (uint32_t u = 0; u < nthreads; ++u) {
+          uint32_t left = ranges[u].size();
+          if (left > most) {
+            most = left;
+            victim = u;
+          }
+        }
+        if (most == 0 || !ranges[victim].steal(c)) {
+          if (most == 0)
+            break;
+          continue;
+        }
+      }
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      f(cuts[c], cuts[c+1], t);
+      b += std::chrono::steady_clock::now() - t0;
+    }
+    if (busy)
+      (*busy)[t] = b.count();
+  };
+
+  ThreadPool::get().run(nthreads, worker);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef PERFCOUNT_HH
+#define PERFCOUNT_HH
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "parallel.hh"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Hardware counters of the last level cache (references and misses) of the threads of parallel_for() and parallel_for_balanced(). A counter only follows its own thread and the threads that thread starts after it is opened, and the workers of the thread pool outlive the loops, so open() has every thread of a loop of nthreads open its own counters, and the counts are summed over them. Without Linux perf events (or without permission to use them), available() is false and all counts are zero.
+class PerfCounters {
+public:
+  PerfCounters() { }
+  ~PerfCounters() { close(); }
+
+  bool open(uint32_t nthreads);
+  void close();
+  bool available() const { return _refs.size() > 0; }
+
+  void start();
+  void stop();
+  uint64_t references() const { return read(_refs); }
+  uint64_t misses() const { return read(_misses); }
+
+private:
+  int open_counter(uint64_t config);
+  uint64_t read(const std::vector<int> &fds) const;
+  void ioctl_all(unsigned long request);
+
+  std::vector<int> _refs;       // Counters of each thread
+  std::vector<int> _misses;
+};
+
+// Opens one counter with perf_event_open(2), which has no glibc wrapper
+inline int
+PerfCounters::open_counter(uint64_t config)
+{
+#ifdef __linux__
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = config;
+  pe.disabled = 1;
+  pe.inherit = 1;           // Counts the threads that this one starts later too
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+inline bool
+PerfCounters::open(uint32_t nthreads)
+{
+  close();
+  if (nthreads < 1)
+    nthreads = 1;
+  _refs.assign(nthreads, -1);
+  _misses.assign(nthreads, -1);
+#ifdef __linux__
+  parallel_for(nthreads, nthreads, [&](uint32_t begin, uint32_t end, uint32_t t) {
+      _refs[t] = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+      _misses[t] = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    });
+#endif
+  for (uint32_t t = 0; t < nthreads; ++t)
+    if (_refs[t] < 0 || _misses[t] < 0) {
+      close();
+      return false;
+    }
+  return true;
+}
+
+inline void
+PerfCounters::close()
+{
+  for (uint32_t t = 0; t < _refs.size(); ++t) {
+    if (_refs[t] >= 0)
+      ::close(_refs[t]);
+    if (_misses[t] >= 0)
+      ::close(_misses[t]);
+  }
+  _refs.clear();
+  _misses.clear();
+}
+
+inline void
+PerfCounters::ioctl_all(unsigned long request)
+{
+#ifdef __linux__
+  for (uint32_t t = 0; t < _refs.size(); ++t) {
+    ioctl(_refs[t], request, 0);
+    ioctl(_misses[t], request, 0);
+  }
+#endif
+}
+
+// Resets the counters and starts counting
+inline void
+PerfCounters::start()
+{
+#ifdef __linux__
+  ioctl_all(PERF_EVENT_IOC_RESET);
+  ioctl_all(PERF_EVENT_IOC_ENABLE);
+#endif
+}
+
+inline void
+PerfCounters::stop()
+{
+#ifdef __linux__
+  ioctl_all(PERF_EVENT_IOC_DISABLE);
+#endif
+}
+
+// Sums the counts of the threads
+inline uint64_t
+PerfCounters::read(const std::vector<int> &fds) const
+{
+  uint64_t s = 0;
+  for (uint32_t t = 0; t < fds.size(); ++t) {
+    uint64_t v = 0;
+    if (::read(fds[t], &v, sizeof(v)) == sizeof(v))
+      s += v;
+  }
+  return s;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef RANKTABLE_HH
+#define RANKTABLE_HH
+
+// Fixed-stride binary tables of ranked entries (item neighbors, top-N per user) and
+// the id directories that go with them. Serving code only needs this header.
+//
+// Table file: a RankTableHeader followed by rows * width RankEntry records. Row r
+// starts at byte sizeof(RankTableHeader) + r * width * sizeof(RankEntry), so a lookup
+// is one offset computation into the mapped file. Rows with fewer than width entries
+// are padded with idx = RANK_NONE.
+//
+// Id directory file: one uint64_t original id per sequence number.
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+static const uint32_t RANK_NONE = 0xffffffff;
+static const char RANK_MAGIC[8] = { 'H', 'G', 'P', 'R', 'A', 'N', 'K', '1' };
+
+struct RankTableHeader {
+  char magic[8];
+  uint32_t rows;
+  uint32_t width;
+};
+
+struct RankEntry {
+  uint32_t idx;   // Sequence number of the ranked item or user
+  float score;
+};
+
+class RankTable {
+public:
+  RankTable(): _fd(-1), _map(NULL), _size(0), _rows(0), _width(0), _entries(NULL) { }
+  ~RankTable() { close(); }
+
+  int create(std::string fname, uint32_t rows, uint32_t width);
+  int write_row(uint32_t row, const RankEntry *entries, uint32_t n);
+  int open(std::string fname);
+  void close();
+
+  uint32_t rows() const { return _rows; }
+  uint32_t width() const { return _width; }
+
+  // Returns the entries of row r, or NULL if r is out of range
+  const RankEntry *row(uint32_t r) const
+  { return r < _rows ? _entries + (uint64_t)r * _width : NULL; }
+
+private:
+  int _fd;
+  void *_map;
+  size_t _size;
+  uint32_t _rows;
+  uint32_t _width;
+  const RankEntry *_entries;
+};
+
+// Creates a table file with the given dimensions. Rows are then written with write_row(), which can be called from several threads for different rows.
+inline int
+RankTable::create(std::string fname, uint32_t rows, uint32_t width)
+{
+  close();
+  _fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (_fd < 0)
+    return -1;
+  RankTableHeader h;
+  memcpy(h.magic, RANK_MAGIC, sizeof(h.magic));
+  h.rows = rows;
+  h.width = width;
+  _rows = rows;
+  _width = width;
+  if (pwrite(_fd, &h, sizeof(h), 0) != sizeof(h))
+    return -1;
+  off_t size = sizeof(h) + (off_t)rows * width * sizeof(RankEntry);
+  return ftruncate(_fd, size);
+}
+
+// Writes the n <= width entries of a row and pads the rest
+inline int
+RankTable::write_row(uint32_t row, const RankEntry *entries, uint32_t n)
+{
+  std::vector<RankEntry> buf(_width);
+  for (uint32_t j = 0; j < _width; ++j) {
+    if (j < n)
+      buf[j] = entries[j];
+    else {
+      buf[j].idx = RANK_NONE;
+      buf[j].score = 0;
+    }
+  }
+  off_t offset = sizeof(RankTableHeader) + (off_t)row * _width * sizeof(RankEntry);
+  size_t bytes = _width * sizeof(RankEntry);
+  return pwrite(_fd, &buf[0], bytes, offset) == (ssize_t)bytes ? 0 : -1;
+}
+
+// Maps a table file read-only
+inline int
+RankTable::open(std::string fname)
+{
+  close();
+  _fd = ::open(fname.c_str(), O_RDONLY);
+  if (_fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(_fd, &st) < 0 || (size_t)st.st_size < sizeof(RankTableHeader))
+    return -1;
+  _size = st.st_size;
+  _map = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+  if (_map == MAP_FAILED) {
+    _map = NULL;
+    return -1;
+  }
+  const RankTableHeader *h = (const RankTableHeader *)_map;
+  if (memcmp(h->magic, RANK_MAGIC, sizeof(h->magic)) != 0 ||
+      _size != sizeof(RankTableHeader) + (size_t)h->rows * h->width * sizeof(RankEntry))
+    return -1;
+  _rows = h->rows;
+  _width = h->width;
+  _entries = (const RankEntry *)((const char *)_map + sizeof(RankTableHeader));
+  return 0;
+}
+
+inline void
+RankTable::close()
+{
+  if (_map)
+    munmap(_map, _size);
+  if (_fd >= 0)
+    ::close(_fd);
+  _map = NULL;
+  _fd = -1;
+  _entries = NULL;
+}
+
+// Maps original ids to sequence numbers and back
+class IdDirectory {
+public:
+  int load(std::string fname);
+  int save(std::string fname) const;
+
+  // Returns the sequence number of id, or RANK_NONE if it is unknown
+  uint32_t seq(uint64_t id) const
+  {
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it = _seq.find(id);
+    return it == _seq.end() ? RANK_NONE : it->second;
+  }
+  uint64_t id(uint32_t seq) const { return _ids[seq]; }
+  uint32_t size() const { return _ids.size(); }
+
+  void add(uint64_t id) { _seq[id] = _ids.size(); _ids.push_back(id); }
+
+private:
+  std::vector<uint64_t> _ids;
+  std::unordered_map<uint64_t, uint32_t> _seq;
+};
+
+inline int
+IdDirectory::load(std::string fname)
+{
+  FILE *f = fopen(fname.c_str(), "rb");
+  if (!f)
+    return -1;
+  _ids.clear();
+  _seq.clear();
+  uint64_t id;
+  while (fread(&id, sizeof(id), 1, f) == 1)
+    add(id);
+  fclose(f);
+  return 0;
+}
+
+inline int
+IdDirectory::save(std::string fname) const
+{
+  FILE *f = fopen(fname.c_str(), "wb");
+  if (!f)
+    return -1;
+  size_t n = fwrite(_ids.data(), sizeof(uint64_t), _ids.size(), f);
+  fclose(f);
+  return n == _ids.size() ? 0 : -1;
+}
+
+// Serves a rank table by original ids: looks up the row of an id and returns the
+// ids and scores of its entries, with no scoring
+class RankIndex {
+public:
+  int open(std::string table, std::string rowids, std::string entryids);
+
+  // Saves the ranked (id, score) pairs of the row with the given id in out, best
+  // first. Returns false if the id is unknown.
+  bool lookup(uint64_t id, std::vector<std::pair<uint64_t, float> > &out) const;
+
+private:
+  RankTable _table;
+  IdDirectory _rows;
+  IdDirectory _entries;
+};
+
+inline int
+RankIndex::open(std::string table, std::string rowids, std::string entryids)
+{
+  if (_table.open(table) < 0 || _rows.load(rowids) < 0 || _entries.load(entryids) < 0)
+    return -1;
+  return _rows.size() == _table.rows() ? 0 : -1;
+}
+
+inline bool
+RankIndex::lookup(uint64_t id, std::vector<std::pair<uint64_t, float> > &out) const
+{
+  out.clear();
+  uint32_t r = _rows.seq(id);
+  if (r == RANK_NONE)
+    return false;
+  const RankEntry *row = _table.row(r);
+  for (uint32_t j = 0; j < _table.width() && row[j].idx != RANK_NONE; ++j)
+    out.push_back(std::make_pair(_entries.id(row[j].idx), row[j].score));
+  return true;
+}
+
+#endif
@@ -532,6 +532,112 @@ Ratings::read_test_users(FILE *f, UserMap *bmap)
   return 0;
 }
 
+// Reads the users to fold in from foldin_obsUser.tsv and foldin.tsv in dir. The files have the formats of obsUser.tsv and train.tsv. Ratings of items that are not in the training set are skipped.
+int
+Ratings::read_foldin(string dir, FoldinUserList &users)
+{
+  std::map<uint64_t, uint32_t> idx;
+  char buf[1024];
+  
+  if (_env.uc > 0) {
+    sprintf(buf, "%s/foldin_obsUser.tsv", dir.c_str());
+    ifstream infile(buf);
+    if (!infile) {
+      fprintf(stderr, "error: cannot open file %s\n", buf);
+      return -1;
+    }
+    string line;
+    while (getline(infile,line)) {
+      vector<string> strs;
+      split(strs,line,is_any_of("\t"));
+      assert(strs.size()==_env.uc+1);
+      
+      uint64_t uCode = stoull(strs.at(0));
+      // Checks that this is the first line for that user
+      assert(idx.find(uCode) == idx.end());
+      idx[uCode] = users.size();
+      FoldinUser *u = new FoldinUser(uCode, _env.uc);
+      for (uint32_t i = 0; i < _env.uc; i++)
+        u->obs[i] = stod(strs.at(i+1));
+      users.push_back(u);
+    }
+  }
+  
+  sprintf(buf, "%s/foldin.tsv", dir.c_str());
+  FILE *f = fopen(buf, "r");
+  if (!f) {
+    fprintf(stderr, "error: cannot open file %s\n", buf);
+    return -1;
+  }
+  uint64_t uid = 0, sid = 0, mid = 0;
+  uint32_t rating = 0, nratings = 0, nskipped = 0;
+  // Every line must have all its fields (blank lines are skipped); a line that does not parse is an error
+  const int fields = _env.session ? 4 : 3;
+  char line[4096];
+  uint32_t lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if (line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    int r = _env.session ?
+      sscanf(line, "%" SCNu64 "%" SCNu64 "%" SCNu64 "%u", &uid, &sid, &mid, &rating) :
+      sscanf(line, "%" SCNu64 "%" SCNu64 "%u", &uid, &mid, &rating);
+    if (r != fields) {
+      fprintf(stderr, "error: cannot parse line %d of %s\n", lineno, buf);
+      fclose(f);
+      return -1;
+    }
+    
+    IDMap::const_iterator mt = _movie2seq.find(mid);
+    if (mt == _movie2seq.end() || input_rating_class(rating) == 0) {
+      nskipped++;
+      continue;
+    }
+    
+    std::map<uint64_t, uint32_t>::const_iterator it = idx.find(uid);
+    if (it == idx.end()) {
+      idx[uid] = users.size();
+      users.push_back(new FoldinUser(uid, _env.uc));
+      it = idx.find(uid);
+    }
+    FoldinUser *u = users[it->second];
+    u->items.push_back(mt->second);
+    u->ratings.push_back(_env.binary_data ? 1 : rating);
+    nratings++;
+  }
+  fclose(f);
+  
+  lerr("read %d fold-in users, %d ratings, skipped %d ratings",
+       users.size(), nratings, nskipped);
+  return 0;
+}
+
+// Reads new items from coldstart_obsItem.tsv in dir, which has the format of obsItem.tsv
+int
+Ratings::read_coldstart(string dir, FoldinItemList &items)
+{
+  char buf[1024];
+  sprintf(buf, "%s/coldstart_obsItem.tsv", dir.c_str());
+  ifstream infile(buf);
+  if (!infile) {
+    fprintf(stderr, "error: cannot open file %s\n", buf);
+    return -1;
+  }
+  string line;
+  while (getline(infile,line)) {
+    vector<string> strs;
+    split(strs,line,is_any_of("\t"));
+    assert(strs.size()==_env.ic+1);
+    
+    FoldinItem *item = new FoldinItem(stoull(strs.at(0)), _env.ic);
+    for (uint32_t i = 0; i < _env.ic; i++)
+      item->obs[i] = stod(strs.at(i+1));
+    items.push_back(item);
+  }
+  lerr("read %d cold-start items", items.size());
+  return 0;
+}
+
 int
 Ratings::read_echonest(string dir)
 {
@@ -1069,3 +1175,204 @@ IDMap
 Ratings::leave_one_out() {
   return _leave_one_out;
 }
+
+// Returns the median distance between the indices of consecutive items rated by a user. The sweeps read the item rows of each user, so a smaller distance means that they are closer in memory.
+double
+Ratings::median_item_gap() const
+{
+  vector<uint32_t> gaps, v;
+  for (uint32_t n = 0; n < _curr_user_seq; ++n) {
+    if (!_users[n])
+      continue;
+    v = *_users[n];
+    std::sort(v.begin(), v.end());
+    for (uint32_t j = 1; j < v.size(); ++j)
+      gaps.push_back(v[j] - v[j-1]);
+  }
+  if (gaps.size() == 0)
+    return .0;
+  std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+  return gaps[gaps.size() / 2];
+}
+
+// Orders users and items by decreasing number of ratings, so that the rows of the most active users and the most popular items are together
+void
+Ratings::order_by_degree(vector<uint32_t> &uorder, vector<uint32_t> &morder) const
+{
+  uorder.resize(_curr_user_seq);
+  morder.resize(_curr_movie_seq);
+  for (uint32_t n = 0; n < _curr_user_seq; ++n)
+    uorder[n] = n;
+  for (uint32_t m = 0; m < _curr_movie_seq; ++m)
+    morder[m] = m;
+  std::stable_sort(uorder.begin(), uorder.end(), [this](uint32_t a, uint32_t b) {
+      return _users[a]->size() > _users[b]->size();
+    });
+  std::stable_sort(morder.begin(), morder.end(), [this](uint32_t a, uint32_t b) {
+      return _movies[a]->size() > _movies[b]->size();
+    });
+}
+
+// Orders users and items by reverse Cuthill-McKee on the bipartite graph of ratings: a breadth-first search from a node of smallest degree in each component, visiting neighbors by increasing degree, and then reversed. Users that rate the same items get close indices, and so do items rated by the same users.
+void
+Ratings::order_rcm(vector<uint32_t> &uorder, vector<uint32_t> &morder) const
+{
+  // Nodes 0 to nu-1 are users and nu to nu+nm-1 are items
+  uint32_t nu = _curr_user_seq, nm = _curr_movie_seq;
+  auto degree = [&](uint32_t v) {
+    return v < nu ? _users[v]->size() : _movies[v-nu]->size();
+  };
+  auto by_degree = [&](uint32_t a, uint32_t b) { return degree(a) < degree(b); };
+  
+  vector<uint32_t> starts(nu + nm);
+  for (uint32_t v = 0; v < nu + nm; ++v)
+    starts[v] = v;
+  std::stable_sort(starts.begin(), starts.end(), by_degree);
+  
+  vector<uint32_t> order;
+  order.reserve(nu + nm);
+  vector<bool> seen(nu + nm, false);
+  vector<uint32_t> next;
+  for (uint32_t i = 0; i < starts.size(); ++i) {
+    if (seen[starts[i]])
+      continue;
+    seen[starts[i]] = true;
+    order.push_back(starts[i]);
+    for (uint32_t head = order.size() - 1; head < order.size(); ++head) {
+      uint32_t v = order[head];
+      const vector<uint32_t> *adj = v < nu ? _users[v] : _movies[v-nu];
+      uint32_t offset = v < nu ? nu : 0;
+      next.clear();
+      for (uint32_t j = 0; j < adj->size(); ++j) {
+        uint32_t w = (*adj)[j] + offset;
+        if (!seen[w]) {
+          seen[w] = true;
+          next.push_back(w);
+        }
+      }
+      std::stable_sort(next.begin(), next.end(), by_degree);
+      order.insert(order.end(), next.begin(), next.end());
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  
+  uorder.clear();
+  morder.clear();
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    if (order[i] < nu)
+      uorder.push_back(order[i]);
+    else
+      morder.push_back(order[i] - nu);
+  }
+}
+
+// Renumbers users and items, by decreasing degree (Env::DEGREE) or by reverse Cuthill-McKee (Env::RCM), to improve the locality of the sweeps. Permutes the lists of ratings, the observed characteristics, and the validation and test sets, and updates the maps between ids and indices, so that outputs keep the original ids. Must be called after all the input files are read.
+void
+Ratings::reorder(int order)
+{
+  double gap = median_item_gap();
+  vector<uint32_t> uorder, morder;
+  if (order == Env::DEGREE)
+    order_by_degree(uorder, morder);
+  else if (order == Env::RCM)
+    order_rcm(uorder, morder);
+  else {
+    printf("error: unknown order %d\n", order);
+    exit(-1);
+  }
+  
+  // uperm and mperm map old indices to new indices
+  vector<uint32_t> uperm(_curr_user_seq), mperm(_curr_movie_seq);
+  for (uint32_t i = 0; i < uorder.size(); ++i)
+    uperm[uorder[i]] = i;
+  for (uint32_t i = 0; i < morder.size(); ++i)
+    mperm[morder[i]] = i;
+  
+  // Lists of ratings, with the indices in each list sorted
+  vector<vector<uint32_t> *> users(_curr_user_seq), movies(_curr_movie_seq);
+  vector<RatingMap *> ratings(_curr_user_seq);
+  for (uint32_t n = 0; n < _curr_user_seq; ++n) {
+    vector<uint32_t> *v = _users[n];
+    for (uint32_t j = 0; j < v->size(); ++j)
+      (*v)[j] = mperm[(*v)[j]];
+    std::sort(v->begin(), v->end());
+    users[uperm[n]] = v;
+    
+    RatingMap *rm = new RatingMap;
+    const RatingMap *old = _users2rating[n];
+    for (RatingMap::const_iterator i = old->begin(); i != old->end(); ++i)
+      (*rm)[mperm[i->first]] = i->second;
+    delete old;
+    ratings[uperm[n]] = rm;
+  }
+  for (uint32_t m = 0; m < _curr_movie_seq; ++m) {
+    vector<uint32_t> *v = _movies[m];
+    for (uint32_t j = 0; j < v->size(); ++j)
+      (*v)[j] = uperm[(*v)[j]];
+    std::sort(v->begin(), v->end());
+    movies[mperm[m]] = v;
+  }
+  for (uint32_t n = 0; n < _curr_user_seq; ++n) {
+    _users.data()[n] = users[n];
+    _users2rating.data()[n] = ratings[n];
+  }
+  for (uint32_t m = 0; m < _curr_movie_seq; ++m)
+    _movies.data()[m] = movies[m];
+  
+  // Observed characteristics; the scales do not depend on the order
+  if (_env.uc > 0) {
+    vector<double> obs((size_t)_curr_user_seq * _env.uc);
+    for (uint32_t n = 0; n < _curr_user_seq; ++n)
+      for (uint32_t i = 0; i < _env.uc; ++i)
+        obs[(size_t)uperm[n] * _env.uc + i] = _userObs.get(n, i);
+    for (uint32_t n = 0; n < _curr_user_seq; ++n)
+      for (uint32_t i = 0; i < _env.uc; ++i)
+        _userObs.set(n, i, obs[(size_t)n * _env.uc + i]);
+  }
+  if (_env.ic > 0) {
+    vector<double> obs((size_t)_curr_movie_seq * _env.ic);
+    for (uint32_t m = 0; m < _curr_movie_seq; ++m)
+      for (uint32_t i = 0; i < _env.ic; ++i)
+        obs[(size_t)mperm[m] * _env.ic + i] = _itemObs.get(m, i);
+    for (uint32_t m = 0; m < _curr_movie_seq; ++m)
+      for (uint32_t i = 0; i < _env.ic; ++i)
+        _itemObs.set(m, i, obs[(size_t)m * _env.ic + i]);
+  }
+  
+  // Maps between ids and indices
+  _seq2user.clear();
+  for (IDMap::iterator i = _user2seq.begin(); i != _user2seq.end(); ++i) {
+    i->second = uperm[i->second];
+    _seq2user[i->second] = i->first;
+  }
+  _seq2movie.clear();
+  for (IDMap::iterator i = _movie2seq.begin(); i != _movie2seq.end(); ++i) {
+    i->second = mperm[i->second];
+    _seq2movie[i->second] = i->first;
+  }
+  
+  // Validation and test sets
+  CountMap validation, test;
+  for (CountMap::const_iterator i = _validation_map.begin(); i != _validation_map.end(); ++i)
+    validation[Rating(uperm[i->first.first], mperm[i->first.second])] = i->second;
+  for (CountMap::const_iterator i = _test_map.begin(); i != _test_map.end(); ++i)
+    test[Rating(uperm[i->first.first], mperm[i->first.second])] = i->second;
+  _validation_map.swap(validation);
+  _test_map.swap(test);
+  FreqMap users_of_movie;
+  for (FreqMap::const_iterator i = _validation_users_of_movie.begin(); i != _validation_users_of_movie.end(); ++i)
+    users_of_movie[mperm[i->first]] = i->second;
+  _validation_users_of_movie.swap(users_of_movie);
+  IDMap loo;
+  for (IDMap::const_iterator i = _leave_one_out.begin(); i != _leave_one_out.end(); ++i)
+    loo[uperm[i->first]] = mperm[i->second];
+  _leave_one_out.swap(loo);
+  
+  const char *name = order == Env::DEGREE ? "degree" : "rcm";
+  printf("+ reordered users and items by %s: median gap between items of a user %.1f -> %.1f\n",
+         name, gap, median_item_gap());
+  fflush(stdout);
+  char st[1024];
+  sprintf(st, "%s (median gap between items of a user %.1f -> %.1f)", name, gap, median_item_gap());
+  Env::plog("reorder", string(st));
+}
@@ -19,6 +19,26 @@ using namespace std;
 
 typedef std::map<Rating, D1Array<uint64_t>> AvailabilityMap;
 
+// A user outside the training set: its observed characteristics and its ratings of training items
+class FoldinUser {
+public:
+  FoldinUser(uint64_t uid, uint32_t uc): id(uid), obs(uc) { }
+  uint64_t id;
+  Array obs;               // User characteristics
+  vector<uint32_t> items;  // Indices of the rated items
+  vector<yval_t> ratings;
+};
+typedef std::vector<FoldinUser *> FoldinUserList;
+
+// An item outside the training set, known only by its observed characteristics
+class FoldinItem {
+public:
+  FoldinItem(uint64_t iid, uint32_t ic): id(iid), obs(ic) { }
+  uint64_t id;
+  Array obs;               // Item characteristics
+};
+typedef std::vector<FoldinItem *> FoldinItemList;
+
 class Ratings {
 public:
   Ratings(Env &env, uint64_t* (*fptr) (uint64_t, uint64_t, uint32_t &)):
@@ -42,6 +62,8 @@ public:
   int read(string s);
   void readObserved(string s);
   void readValidationAndTest(string s);
+  void reorder(int order);
+  double median_item_gap() const;
   uint32_t input_rating_class(uint32_t v) const;
   bool test_hit(uint32_t v) const;
   int write_marginal_distributions();
@@ -74,19 +96,28 @@ public:
   
   void load_movies_metadata(string dir);
   int read_test_users(FILE *f, UserMap *);
+  int read_foldin(string dir, FoldinUserList &users);
+  int read_coldstart(string dir, FoldinItemList &items);
 
   string movie_type(uint32_t movie_seq) const;
   string movie_name(uint32_t movie_seq) const;
   int read_netflix_movie(string dir, uint32_t movie);
   int read_netflix_metadata(string dir);
   int read_movielens_metadata(string dir);
-  double getAvailability(uint32_t user, uint32_t item){ //Returns value stored in avblty[(user,item)]
-	uint64_t uid = _seq2user[user];
-	uint64_t itemid = _seq2movie[item];
-	Rating elem(uid, itemid);
-	return avblty[elem];
+  double getAvailability(uint32_t user, uint32_t item) const { //Returns value stored in avblty[(user,item)], 0 if there is none
+	// Only finds, so that threads can call it at the same time
+	IDMap::const_iterator ut = _seq2user.find(user);
+	IDMap::const_iterator it = _seq2movie.find(item);
+	if (ut == _seq2user.end() || it == _seq2movie.end())
+	  return 0;
+	Rating elem(ut->second, it->second);
+	ValueMap::const_iterator at = avblty.find(elem);
+	return at == avblty.end() ? 0 : at->second;
   }
 
+  // Returns the ids of the items available to a user in a session, through the availability callback. The caller deletes the array.
+  uint64_t *available_items(uint64_t uid, uint64_t sid, uint32_t &n) { return getAvailableItems(uid, sid, n); }
+
   FreqMap validation_users_of_movie();
   IDMap leave_one_out();
   
@@ -112,6 +143,8 @@ private:
   string movies_by_user_s() const;
   bool add_movie(uint64_t id);
   bool add_user(uint64_t id);
+  void order_by_degree(vector<uint32_t> &uorder, vector<uint32_t> &morder) const;
+  void order_rcm(vector<uint32_t> &uorder, vector<uint32_t> &morder) const;
   
   int _offset;
 
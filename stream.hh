@@ -0,0 +1,145 @@
+#ifndef STREAM_HH
+#define STREAM_HH
+
+// Ratings read as they are appended to a file or written to a FIFO, for -stream. A
+// reader thread parses the lines and hands them to the trainer through a bounded
+// queue of one producer and one consumer, without locks.
+//
+// Line format: user id, [session id,] item id, rating, separated by white space, as in
+// train.tsv.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "env.hh"
+
+// A rating from the stream, with the time it was read
+struct StreamEvent {
+  uint64_t user;
+  uint64_t item;
+  yval_t y;
+  std::chrono::steady_clock::time_point t;
+};
+
+// Ring of a power of two slots, written only by the producer at the head and read
+// only by the consumer at the tail. Each side publishes its position with a release
+// store after touching the slot, and reads the other side's with an acquire load.
+template<class T>
+class SpscQueue {
+public:
+  SpscQueue(uint32_t size): _head(0), _tail(0)
+  {
+    uint32_t n = 1;
+    while (n < size)
+      n <<= 1;
+    _slots.resize(n);
+    _mask = n - 1;
+  }
+
+  // Adds v, or returns false if the queue is full
+  bool push(const T &v)
+  {
+    uint64_t h = _head.load(std::memory_order_relaxed);
+    if (h - _tail.load(std::memory_order_acquire) > _mask)
+      return false;
+    _slots[h & _mask] = v;
+    _head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Takes the oldest entry into v, or returns false if the queue is empty
+  bool pop(T &v)
+  {
+    uint64_t t = _tail.load(std::memory_order_relaxed);
+    if (t == _head.load(std::memory_order_acquire))
+      return false;
+    v = _slots[t & _mask];
+    _tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> _slots;
+  uint64_t _mask;
+  std::atomic<uint64_t> _head;
+  char pad1[56];          // Keeps the positions of the two sides in different cache lines
+  std::atomic<uint64_t> _tail;
+  char pad2[56];
+};
+
+// Counts of the reader thread
+struct StreamReaderStats {
+  std::atomic<uint64_t> lines;
+  std::atomic<uint64_t> bad;    // Lines that could not be parsed
+  std::atomic<bool> done;       // The stream has ended
+  std::atomic<bool> failed;     // The stream could not be opened
+  StreamReaderStats(): lines(0), bad(0), done(false), failed(false) { }
+};
+
+// Reads the ratings of fname into q until the stream ends, and then sets stats.done (and
+// stats.failed too if fname cannot be opened, for the trainer to exit with an error). A
+// FIFO ends when its writers close it; a file is read from the start and polled for
+// appended lines, and ends once nothing is appended for idle seconds (never if idle is
+// 0). A line is parsed once its newline has been written.
+inline void
+stream_reader(std::string fname, bool session, double idle,
+              SpscQueue<StreamEvent> &q, StreamReaderStats &stats)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    printf("error: cannot open %s\n", fname.c_str());
+    stats.failed = true;
+    stats.done = true;
+    return;
+  }
+  struct stat st;
+  bool fifo = fstat(fileno(f), &st) == 0 && S_ISFIFO(st.st_mode);
+  std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+  std::string line;
+  char buf[4096];
+  while (true) {
+    if (!fgets(buf, sizeof(buf), f)) {
+      if (fifo)
+        break;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (idle > 0 && std::chrono::duration<double>(now - last).count() > idle)
+        break;
+      clearerr(f);
+      usleep(1000);
+      continue;
+    }
+    last = std::chrono::steady_clock::now();
+    line += buf;
+    if (line.empty() || line[line.size()-1] != '\n')
+      continue;
+
+    StreamEvent e;
+    unsigned long long uid = 0, sid = 0, mid = 0;
+    unsigned int rating = 0;
+    int r = session ?
+      sscanf(line.c_str(), "%llu %llu %llu %u", &uid, &sid, &mid, &rating) :
+      sscanf(line.c_str(), "%llu %llu %u", &uid, &mid, &rating);
+    line.clear();
+    stats.lines++;
+    if (r != (session ? 4 : 3) || rating == 0) {
+      stats.bad++;
+      continue;
+    }
+    e.user = uid;
+    e.item = mid;
+    e.y = rating;
+    e.t = last;
+    while (!q.push(e))
+      usleep(100);
+  }
+  fclose(f);
+  stats.done = true;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef SWEEP_HH
+#define SWEEP_HH
+
+// Kernels of the sweep over ratings of vb_hier, instantiated for each combination of
+// active blocks (item and user characteristics, bias), for a few common numbers of
+// factors, and for the two layouts of the expected logs (separate matrices, or one
+// packed row per user and per item with -packed), so that the loops over phi have no
+// branches on the configuration and a fixed trip count. sweep_kernels() picks the
+// instantiation once per run. With -phitop or -phimass, phi is truncated to its
+// largest components (for any k, with k known at run time). In the build with
+// -DPARAM_FLOAT, phi and the packed rows are float like the parameters, so that the
+// exponentials and the adds to the shapes run in single precision.
+
+#include <math.h>
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "env.hh"
+
+// Element type of phi and of the packed rows in the kernels
+typedef param_t phi_t;
+
+// Counts of the sweep of one thread (most of them for truncated phi), on a cache line of its own; a vector of them needs CacheAlignedAllocator
+struct alignas(64) SweepStats {
+  uint64_t ratings;             // Ratings swept
+  uint64_t kept;                // Components of phi kept, over all ratings
+  uint64_t sampled;             // Ratings for which the dropped mass was computed exactly
+  double dropped;               // Sum and maximum of the dropped mass of phi over the sampled ratings
+  double maxdropped;
+  double elbogap;               // Sum of the loss in the ELBO from truncating phi over the sampled ratings
+  double logl;                  // Sum of y log sum_j exp(log phi_j), the terms of the ratings in the ELBO
+};
+
+// Pointers to the parameters read and written by the kernels
+struct SweepArgs {
+  uint32_t k, ic, uc;
+  const param_t **elogtheta;
+  const param_t ***elogbeta;    // Expected log of beta read by each thread (its node's copy, with -numa)
+  const param_t **elogsigma;
+  const param_t **elogrho;
+  const double *elogxi;
+  const double *elogeta;
+  const double **logitemobs;    // Logs of the item and user characteristics
+  const double **loguserobs;
+  param_t **thetashape;
+  param_t **sigmashape;
+  param_t **betashape;
+  param_t **rhoshape;
+  param_t **thetabiasshape;
+  param_t **betabiasshape;
+  std::vector<std::vector<param_t> > *tbetashape;  // Item-side buffers of the threads but the first
+  std::vector<std::vector<param_t> > *trhoshape;
+  const param_t *upacked;       // With -packed, [E log theta, E log sigma, log w, E log xi] of each user
+  const param_t *ipacked;        // and [E log beta, log x, E log rho, E log eta] of each item, in rows of stride elements
+  uint32_t stride;
+  uint32_t phitop;              // Truncated phi keeps at most phitop components (0 for all)
+  double phicut;                // and those at least phicut above the largest log (-inf for all)
+  SweepStats *stats;            // Counts of each thread
+  bool twopass;                 // The item-side shapes are left to a second pass over items
+};
+
+// Every how many ratings of a thread the dropped mass of truncated phi is computed exactly
+const uint32_t SWEEP_SAMPLE = 64;
+
+// Adds the contribution of one rating to the shapes, the user side and (unless
+// twopass) the item side, from thread t
+typedef void (*UserKernel)(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y,
+                           uint32_t t, phi_t *phi);
+// Adds the item side only, in the second pass over items of -twopass
+typedef void (*ItemKernel)(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y,
+                           phi_t *phi);
+
+// Computes the log of phi for rating (n, m) up to a constant, with the expected log of
+// beta in elogbeta (unless PACKED). K is the number of factors, or 0 if it is only
+// known at run time.
+template<uint32_t K, bool IC, bool UC, bool PACKED> inline void
+sweep_logphi(const SweepArgs &a, uint32_t n, uint32_t m, const param_t **elogbeta, phi_t *phi)
+{
+  const uint32_t k = K ? K : a.k;
+  const uint32_t ic = IC ? a.ic : 0;
+  const uint32_t uc = UC ? a.uc : 0;
+  const uint32_t d = k + ic + uc;
+
+  if (PACKED) {
+    // The same terms in the same order as below, from one row of each side
+    const param_t *ur = a.upacked + (size_t)n * a.stride;
+    const param_t *ir = a.ipacked + (size_t)m * a.stride;
+    for (uint32_t j = 0; j < k; ++j)
+      phi[j] = ur[j] + ir[j];
+    if (IC)
+      for (uint32_t l = 0; l < ic; ++l)
+        phi[k+l] = ur[k+l] - ir[d] + ir[k+l];
+    if (UC)
+      for (uint32_t l = 0; l < uc; ++l)
+        phi[k+ic+l] = ir[k+ic+l] - ur[d] + ur[k+ic+l];
+  } else {
+    const param_t *et = a.elogtheta[n];
+    const param_t *eb = elogbeta[m];
+    for (uint32_t j = 0; j < k; ++j)
+      phi[j] = et[j] + eb[j];
+    if (IC) {
+      const param_t *es = a.elogsigma[n];
+      const double *lx = a.logitemobs[m];
+      for (uint32_t l = 0; l < ic; ++l)
+        phi[k+l] = es[l] - a.elogeta[m] + lx[l];
+    }
+    if (UC) {
+      const param_t *er = a.elogrho[m];
+      const double *lw = a.loguserobs[n];
+      for (uint32_t l = 0; l < uc; ++l)
+        phi[k+ic+l] = er[l] - a.elogxi[n] + lw[l];
+    }
+  }
+}
+
+// Computes y times phi for rating (n, m), and adds its terms in the ELBO to stats (unless it
+// is NULL)
+template<uint32_t K, bool IC, bool UC, bool PACKED> inline void
+sweep_phi(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y,
+          const param_t **elogbeta, phi_t *phi, SweepStats *stats)
+{
+  const uint32_t d = (K ? K : a.k) + (IC ? a.ic : 0) + (UC ? a.uc : 0);
+  sweep_logphi<K, IC, UC, PACKED>(a, n, m, elogbeta, phi);
+
+  // Normalizes in log space as D1Array::lognormalize() does, and makes phi sum up to y
+  phi_t s = phi[0];
+  for (uint32_t j = 1; j < d; ++j)
+    if (phi[j] < s)
+      s = s + std::log(1 + std::exp(phi[j] - s));
+    else
+      s = phi[j] + std::log(1 + std::exp(s - phi[j]));
+  const phi_t yd = y;
+  for (uint32_t j = 0; j < d; ++j)
+    phi[j] = std::exp(phi[j] - s) * yd;
+  if (stats)
+    stats->logl += yd * s;
+}
+
+// Computes y times phi for rating (n, m) truncated to its largest components, which are
+// renormalized; the others are zero. phi needs room for 2 (k + ic + uc) elements. Every
+// SWEEP_SAMPLE ratings, stats also gets the mass that the exact phi has on the dropped
+// components (unless stats is NULL).
+template<bool IC, bool UC, bool PACKED> inline void
+sweep_phi_truncated(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y,
+                    const param_t **elogbeta, phi_t *phi, SweepStats *stats)
+{
+  const uint32_t d = a.k + (IC ? a.ic : 0) + (UC ? a.uc : 0);
+  sweep_logphi<0, IC, UC, PACKED>(a, n, m, elogbeta, phi);
+
+  phi_t mx = phi[0];
+  for (uint32_t j = 1; j < d; ++j)
+    if (phi[j] > mx)
+      mx = phi[j];
+  // Components with a log below cut are dropped: at most phitop of them are kept, and
+  // none that is more than phicut below the largest
+  phi_t cut = mx + a.phicut;
+  if (a.phitop > 0 && a.phitop < d) {
+    phi_t *top = phi + d;
+    std::copy(phi, phi + d, top);
+    std::nth_element(top, top + a.phitop - 1, top + d, std::greater<phi_t>());
+    if (top[a.phitop - 1] > cut)
+      cut = top[a.phitop - 1];
+  }
+
+  phi_t s = 0;
+  uint32_t kept = 0;
+  for (uint32_t j = 0; j < d; ++j)
+    if (phi[j] >= cut) {
+      s += std::exp(phi[j] - mx);
+      kept++;
+    }
+  if (stats) {
+    stats->kept += kept;
+    stats->logl += y * (mx + log(s));
+  }
+  if (stats && stats->ratings++ % SWEEP_SAMPLE == 0) {
+    double all = s;
+    for (uint32_t j = 0; j < d; ++j)
+      if (phi[j] < cut)
+        all += std::exp(phi[j] - mx);
+    double dropped = 1 - s / all;
+    stats->dropped += dropped;
+    if (dropped > stats->maxdropped)
+      stats->maxdropped = dropped;
+    // The terms of the ELBO of a rating are y log sum_j exp(log phi_j) at the optimal phi, and the same sum over the kept components at truncated phi
+    stats->elbogap += y * log(all / s);
+    stats->sampled++;
+  }
+
+  const phi_t scale = y / s;
+  for (uint32_t j = 0; j < d; ++j)
+    phi[j] = phi[j] >= cut ? std::exp(phi[j] - mx) * scale : 0;
+}
+
+template<uint32_t K, bool IC, bool UC, bool BIAS, bool TRUNC> inline void
+sweep_item_side(const SweepArgs &a, uint32_t m, param_t *bs, param_t *rs, const phi_t *phi)
+{
+  const uint32_t k = K ? K : a.k;
+  const uint32_t ic = IC ? a.ic : 0;
+  for (uint32_t j = 0; j < k; ++j)
+    if (!TRUNC || phi[j] != .0)
+      bs[j] += phi[j];
+  if (UC)
+    for (uint32_t l = 0; l < a.uc; ++l)
+      if (!TRUNC || phi[k+ic+l] != .0)
+        rs[l] += phi[k+ic+l];
+  if (BIAS)
+    a.betabiasshape[m][0] += phi[k+1];
+}
+
+// Computes phi, truncated if TRUNC
+template<uint32_t K, bool IC, bool UC, bool PACKED, bool TRUNC> inline void
+sweep_phi_any(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y,
+              const param_t **elogbeta, phi_t *phi, SweepStats *stats)
+{
+  if (TRUNC)
+    sweep_phi_truncated<IC, UC, PACKED>(a, n, m, y, elogbeta, phi, stats);
+  else
+    sweep_phi<K, IC, UC, PACKED>(a, n, m, y, elogbeta, phi, stats);
+}
+
+template<uint32_t K, bool IC, bool UC, bool BIAS, bool PACKED, bool TRUNC> void
+sweep_user_kernel(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y, uint32_t t, phi_t *phi)
+{
+  const uint32_t k = K ? K : a.k;
+  sweep_phi_any<K, IC, UC, PACKED, TRUNC>(a, n, m, y, a.elogbeta[t], phi, &a.stats[t]);
+
+  param_t *ts = a.thetashape[n];
+  for (uint32_t j = 0; j < k; ++j)
+    if (!TRUNC || phi[j] != .0)
+      ts[j] += phi[j];
+  if (IC) {
+    param_t *ss = a.sigmashape[n];
+    for (uint32_t l = 0; l < a.ic; ++l)
+      if (!TRUNC || phi[k+l] != .0)
+        ss[l] += phi[k+l];
+  }
+  if (BIAS)
+    a.thetabiasshape[n][0] += phi[k];
+  if (a.twopass)
+    return;
+
+  param_t *bs = t == 0 ? a.betashape[m] : &(*a.tbetashape)[t][(size_t)m*k];
+  param_t *rs = t == 0 ? a.rhoshape[m] : &(*a.trhoshape)[t][(size_t)m*a.uc];
+  sweep_item_side<K, IC, UC, BIAS, TRUNC>(a, m, bs, rs, phi);
+}
+
+template<uint32_t K, bool IC, bool UC, bool BIAS, bool PACKED, bool TRUNC> void
+sweep_item_kernel(const SweepArgs &a, uint32_t n, uint32_t m, yval_t y, phi_t *phi)
+{
+  sweep_phi_any<K, IC, UC, PACKED, TRUNC>(a, n, m, y, a.elogbeta[0], phi, NULL);
+  sweep_item_side<K, IC, UC, BIAS, TRUNC>(a, m, a.betashape[m], a.rhoshape[m], phi);
+}
+
+template<uint32_t K, bool IC, bool UC, bool PACKED, bool TRUNC> inline void
+sweep_kernels_k(bool bias, UserKernel &uk, ItemKernel &ik)
+{
+  uk = bias ? sweep_user_kernel<K, IC, UC, true, PACKED, TRUNC> : sweep_user_kernel<K, IC, UC, false, PACKED, TRUNC>;
+  ik = bias ? sweep_item_kernel<K, IC, UC, true, PACKED, TRUNC> : sweep_item_kernel<K, IC, UC, false, PACKED, TRUNC>;
+}
+
+template<bool IC, bool UC, bool PACKED> inline void
+sweep_kernels_obs(uint32_t k, bool bias, bool truncated, UserKernel &uk, ItemKernel &ik)
+{
+  if (truncated) {
+    sweep_kernels_k<0, IC, UC, PACKED, true>(bias, uk, ik);
+    return;
+  }
+  switch (k) {
+  case 10: sweep_kernels_k<10, IC, UC, PACKED, false>(bias, uk, ik); break;
+  case 25: sweep_kernels_k<25, IC, UC, PACKED, false>(bias, uk, ik); break;
+  case 50: sweep_kernels_k<50, IC, UC, PACKED, false>(bias, uk, ik); break;
+  case 100: sweep_kernels_k<100, IC, UC, PACKED, false>(bias, uk, ik); break;
+  default: sweep_kernels_k<0, IC, UC, PACKED, false>(bias, uk, ik); break;
+  }
+}
+
+template<bool PACKED> inline void
+sweep_kernels_layout(uint32_t k, uint32_t ic, uint32_t uc, bool bias, bool truncated,
+                     UserKernel &uk, ItemKernel &ik)
+{
+  if (ic > 0 && uc > 0)
+    sweep_kernels_obs<true, true, PACKED>(k, bias, truncated, uk, ik);
+  else if (ic > 0)
+    sweep_kernels_obs<true, false, PACKED>(k, bias, truncated, uk, ik);
+  else if (uc > 0)
+    sweep_kernels_obs<false, true, PACKED>(k, bias, truncated, uk, ik);
+  else
+    sweep_kernels_obs<false, false, PACKED>(k, bias, truncated, uk, ik);
+}
+
+// Picks the kernels for k factors, ic item and uc user characteristics, the bias
+// terms, the layout, and exact or truncated phi. Returns true if k is one of the
+// sizes with a compile-time number of factors.
+inline bool
+sweep_kernels(uint32_t k, uint32_t ic, uint32_t uc, bool bias, bool packed, bool truncated,
+              UserKernel &uk, ItemKernel &ik)
+{
+  if (packed)
+    sweep_kernels_layout<true>(k, ic, uc, bias, truncated, uk, ik);
+  else
+    sweep_kernels_layout<false>(k, ic, uc, bias, truncated, uk, ik);
+  return !truncated && (k == 10 || k == 25 || k == 50 || k == 100);
+}
+
+#endif